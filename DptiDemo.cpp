@@ -56,6 +56,11 @@
 /*  12/28/2015(MTA): Created                                            */
 /*  06/06/2016(MTA): modified verification code to correspond to a      */
 /*      change that was made in the FPGA logic                          */
+/*  Added the "-s" option to stream large transfers through a fixed     */
+/*      pair of buffers, with 64-bit byte counts                        */
+/*  Verification now uses a generated pattern and counts every bit      */
+/*      error instead of stopping at the first bad byte                 */
+/*  Added the "-b" benchmark mode; transfers are timed in nanoseconds   */
 /*                                                                      */
 /************************************************************************/
 
@@ -85,9 +90,11 @@
 #include <ctype.h>
 #include <time.h>
 
-#include "dpcdecl.h"
-#include "dmgr.h"
-#include "dpti.h"
+#include <algorithm>
+#include <vector>
+
+#include "transport.h"
+#include "pattern.h"
 
 /* ------------------------------------------------------------ */
 /*				Local Type Definitions          				*/
@@ -102,11 +109,28 @@ typedef struct {
 } OPTN ;
 
 typedef DWORD   TIMEMS;  // type used to represent time in milliseconds
+typedef unsigned long long  QWORD;  // 64-bit byte counts
+typedef unsigned long long  TIMENS; // type used to represent time in nanoseconds
 
 const TIMEMS    tmsInfinite = 0xFFFFFFFF; // infinite timeout
 
 const DWORD     cbTransDefault = 10240;
 
+/* Chunk size used when the byte count is too large for a single DptiIO
+** and no chunk size was given with "-s".
+*/
+const DWORD     cbChunkDefault = 1048576;
+
+/* Interval between progress reports when streaming.
+*/
+const TIMEMS    tmsReportInterval = 1000;
+
+/* Benchmark defaults: transfers timed per size, and the smallest size
+** of the sweep.
+*/
+const DWORD     ctransBenchDefault = 100;
+const DWORD     cbBenchMin = 64;
+
 /* ------------------------------------------------------------ */
 /*				Global Variables								*/
 /* ------------------------------------------------------------ */
@@ -114,10 +138,14 @@ const DWORD     cbTransDefault = 10240;
 /* Define an array of supported command line options and descriptions.
 */
 OPTN   rgoptn[] = {
-    {"-d           ", "device user name or alias"},
+    {"-d           ", "device user name or alias, or sim[:options]"},
     {"-c           ", "number of bytes to transfer"},
+    {"-s           ", "stream in chunks of this many bytes, reusing buffers"},
     {"-p           ", "DPTI port to use for data tranfer"},
-    {"-v           ", "verify data after transfer completes"},
+    {"-v           ", "verify data and report the bit error rate"},
+    {"-b           ", "benchmark sizes from 64 bytes to -c on every port"},
+    {"-n           ", "transfers timed per size with -b (default 100)"},
+    {"-f           ", "benchmark output format: csv (default) or json"},
     {"-?, -help    ", "print usage, supported arguments, and options"},
     {"", ""}
 };
@@ -127,11 +155,17 @@ OPTN   rgoptn[] = {
 BOOL    fDevName;
 BOOL    fShowHelp;
 BOOL    fVerifyData;
+BOOL    fStream;
+BOOL    fBenchmark;
+BOOL    fJson;
+BOOL    fPortSet;
 
 char*   pszCmd;
 char    szDevName[cchDvcNameMax + 1];
 INT32   prtReq;
-DWORD   cbTrans;
+QWORD   cbTrans;
+DWORD   cbChunk;
+DWORD   ctransBench;
 
 /* ------------------------------------------------------------ */
 /*				Local Variables									*/
@@ -145,6 +179,9 @@ DWORD   cbTrans;
 BOOL    FParseArguments( int cszArg, char* rgszArg[] );
 BOOL    FHelp();
 TIMEMS  GetTimeMs();
+TIMEMS  TmsElapsed( TIMEMS tmsStart, TIMEMS tmsEnd );
+TIMENS  GetTimeNs();
+BOOL    FRunBenchmark( transport* ptrans, INT32 cprtPti );
 
 /* ------------------------------------------------------------ */
 /*                  Procedure Definitions                       */
@@ -166,27 +203,36 @@ TIMEMS  GetTimeMs();
 int 
 main( int cszArg, char* rgszArg[] ) {
     
-    HIF     hif;
+    transport*  ptrans;
     INT32   cprtPti;
     INT32   iprt;
     DPRP    dprpPti;
     BYTE*   pbOut;
     BYTE*   pbIn;
-    DWORD   ib;
+    DWORD   cbBuf;
+    DWORD   cbCur;
+    QWORD   cbDone;
+    QWORD   cbReport;
+    pattern_gen*    ppat;
+    bit_errors      berr;
+    int     ierr;
     TIMEMS  tmsStart;
-    TIMEMS  tmsEnd;
     TIMEMS  tmsElapsed;
+    TIMEMS  tmsReport;
+    TIMEMS  tmsNow;
+    TIMENS  tnsStart;
+    TIMENS  tnsEnd;
     double  ts;
     double  trateBps;
     double  trateKBps;
     double  trateMBps;
-    BYTE    bTemp;
     ERC     erc;
     BOOL    fSuccess;
     
-    hif = hifInvalid;
+    ptrans = NULL;
     pbOut = NULL;
     pbIn = NULL;
+    ppat = NULL;
     
     /* Parse the command and command options from the command line
     ** arguments.
@@ -215,15 +261,16 @@ main( int cszArg, char* rgszArg[] ) {
     
     /* Attempt to open the device.
     */
-    if ( ! DmgrOpen(&hif, szDevName) ) {
+    ptrans = transport_open(szDevName);
+    if ( NULL == ptrans ) {
         printf("ERROR: unable to open device \"%s\"\n", szDevName);
         goto lErrorExit;
     }
     
     /* Determine how many DPTI ports the device supports.
     */
-    if ( ! DptiGetPortCount(hif, &cprtPti) ) {
-        printf("ERROR: failed to determine DPTI port count, erc = %d\n", DmgrGetLastError());
+    if ( ! ptrans->get_port_count(&cprtPti) ) {
+        printf("ERROR: failed to determine DPTI port count, erc = %d\n", ptrans->last_error());
         goto lErrorExit;
     }
     
@@ -237,7 +284,7 @@ main( int cszArg, char* rgszArg[] ) {
     /* Make sure that the user specified DPTI port is supported by the
     ** device.
     */
-    if ( prtReq >= cprtPti ) {
+    if (( ! fBenchmark || fPortSet ) && ( prtReq >= cprtPti )) {
         printf("ERROR: invalid DPTI port specified: %d\n", prtReq);
         printf("%s supports DPTI on the following ports:\n", szDevName);
         for ( iprt = 0; iprt < cprtPti; iprt++ ) {
@@ -246,17 +293,28 @@ main( int cszArg, char* rgszArg[] ) {
         goto lErrorExit;
     }
     
+    /* The benchmark enables the ports itself.
+    */
+    if ( fBenchmark ) {
+        if ( ! FRunBenchmark(ptrans, cprtPti) ) {
+            goto lErrorExit;
+        }
+        ptrans->close();
+        delete ptrans;
+        goto lExit;
+    }
+    
     /* Obtain the port properties associated with the specified DPTI port.
     */
-    if ( ! DptiGetPortProperties(hif, prtReq, &dprpPti) ) {
-        printf("ERROR: failed to get DPTI port properties, erc = %d\n", DmgrGetLastError());
+    if ( ! ptrans->get_port_properties(prtReq, &dprpPti) ) {
+        printf("ERROR: failed to get DPTI port properties, erc = %d\n", ptrans->last_error());
         goto lErrorExit;
     }
     
     /* Enable the specified DPTI port.
     */
-    if ( ! DptiEnableEx(hif, prtReq) ) {
-        printf("ERROR: failed to enable PTI, erc = %d\n", DmgrGetLastError());
+    if ( ! ptrans->enable(prtReq) ) {
+        printf("ERROR: failed to enable PTI, erc = %d\n", ptrans->last_error());
         goto lErrorExit;
     }
     
@@ -270,59 +328,112 @@ main( int cszArg, char* rgszArg[] ) {
         printf("Synchronous DPTI Port Enabled\n");
     }
     
-    /* Allocate the memory required for the data transfer.
+    /* A single DptiIO can move at most 4 GB, so larger transfers are
+    ** always streamed.
+    */
+    if (( ! fStream ) && ( 0xFFFFFFFF < cbTrans )) {
+        fStream = fTrue;
+        cbChunk = cbChunkDefault;
+    }
+    
+    /* Allocate the memory required for the data transfer. When streaming
+    ** the same pair of buffers is reused for every chunk.
     */
-    pbOut = (BYTE*)malloc(sizeof(BYTE) * cbTrans);
-    pbIn = (BYTE*)calloc(cbTrans, sizeof(BYTE));
+    cbBuf = (DWORD)cbTrans;
+    if (( fStream ) && ( cbChunk < cbTrans )) {
+        cbBuf = cbChunk;
+    }
+    
+    pbOut = (BYTE*)malloc(sizeof(BYTE) * cbBuf);
+    pbIn = (BYTE*)calloc(cbBuf, sizeof(BYTE));
     
     if (( NULL == pbOut ) || ( NULL == pbIn )) {
         printf("ERROR: failed to allocate memory for data transfer\n");
         goto lErrorExit;
     }
     
-    /* Check to see if we want to verify the data received after the
-    ** transaction completes. If we want to verify data then we will need
-    ** generate random data and place it in the output buffer.
+    /* Check to see if we want to verify the data received. If we do then
+    ** each buffer is filled with the next part of a pseudo-random
+    ** pattern before it is sent.
     */
+    bit_errors_clear(&berr);
     if ( fVerifyData ) {
-        srand((unsigned int)time(NULL));
-        for ( ib = 0; ib < cbTrans; ib++ ) {
-            pbOut[ib] = (rand() % 256);
-        }
+        ppat = new pattern_gen((uint64_t)time(NULL));
     }
     
     /* Perform the data transfer.
     */
     printf("beginning data transfer...\n");
     
+    tnsStart = GetTimeNs();
     tmsStart = GetTimeMs();
+    tmsReport = tmsStart;
+    cbDone = 0;
+    cbReport = 0;
+    fSuccess = fTrue;
     
-    fSuccess = DptiIO(hif, pbOut, cbTrans, pbIn, cbTrans, fFalse);
-    
-    tmsEnd = GetTimeMs();
-    
-    /* Calculate the amount of time that the transaction took.
+    /* Transfer one buffer at a time until the requested number of bytes
+    ** has been moved. Without "-s" there is only one buffer's worth. The
+    ** received data is checked as it arrives.
     */
-    if ( tmsEnd < tmsStart ) {
-        tmsElapsed = tmsInfinite - tmsStart;
-        tmsElapsed = tmsElapsed + tmsEnd;
-    }
-    else {
-        tmsElapsed = tmsEnd - tmsStart;
+    while (( cbDone < cbTrans ) && ( fSuccess )) {
+        
+        cbCur = cbBuf;
+        if ( cbTrans - cbDone < cbCur ) {
+            cbCur = (DWORD)(cbTrans - cbDone);
+        }
+        
+        if ( fVerifyData ) {
+            ppat->fill(pbOut, cbCur);
+        }
+        
+        fSuccess = ptrans->io(pbOut, cbCur, pbIn, cbCur, false);
+        if ( ! fSuccess ) {
+            break;
+        }
+        
+        if ( fVerifyData ) {
+            pattern_compare(pbOut, pbIn, cbCur, cbDone, &berr);
+        }
+        
+        cbDone += cbCur;
+        
+        /* Report the throughput of the last interval and of the whole
+        ** transfer so far.
+        */
+        if ( fStream ) {
+            tmsNow = GetTimeMs();
+            tmsElapsed = TmsElapsed(tmsReport, tmsNow);
+            if ( tmsReportInterval <= tmsElapsed ) {
+                printf("%llu of %llu bytes, %f MB/sec now, %f MB/sec average",
+                       cbDone, cbTrans,
+                       (double)(cbDone - cbReport) / tmsElapsed * 1000.0 / 1048576.0,
+                       (double)cbDone / TmsElapsed(tmsStart, tmsNow) * 1000.0 / 1048576.0);
+                if ( fVerifyData ) {
+                    printf(", %llu bit errors", (unsigned long long)berr.errors);
+                }
+                printf("\n");
+                fflush(stdout);
+                tmsReport = tmsNow;
+                cbReport = cbDone;
+            }
+        }
     }
     
-    if ( 0 == tmsElapsed ) {
-        tmsElapsed = 1;
-    }
+    tnsEnd = GetTimeNs();
     
     /* Determine how many seconds the transaction took.
     */
-    ts = (double)tmsElapsed / 1000.0;
+    ts = (double)(tnsEnd - tnsStart) / 1e9;
+    
+    if ( tnsEnd == tnsStart ) {
+        ts = 1e-9;
+    }
     
     /* Confirm that the data transfer was successful.
     */
     if ( ! fSuccess) {
-        erc = DmgrGetLastError();
+        erc = ptrans->last_error();
         switch ( erc ) {
             case ercTransferCancelled:
                 printf("ERROR: data transfer timed out after %f seconds\n", ts);
@@ -335,43 +446,53 @@ main( int cszArg, char* rgszArg[] ) {
     
     /* Determine the transfer rate (bytes/second).
     */
-    trateBps = (double)cbTrans / ts;
+    trateBps = (double)cbDone / ts;
     trateKBps = trateBps / 1024.0;
     trateMBps = trateKBps / 1024.0;
     
-    printf("transferred %d bytes in %f seconds, transfer rate = ", cbTrans, ts);
+    printf("transferred %llu bytes in %f seconds, transfer rate = ", cbDone, ts);
     printf("%f B/sec, %f KB/sec, %f MB/sec\n", trateBps, trateKBps, trateMBps);
     
     /* Perform data verification if necessary.
     */
     if ( fVerifyData ) {
-        for ( ib = 0; ib < cbTrans; ib++ ) {
-            bTemp = pbOut[ib];
-            if ( pbIn[ib] != bTemp ) {
-                printf("ERROR: data verification failed on byte %d of %d\n", ib, cbTrans);
-                goto lErrorExit;
+        printf("verified %llu bits, %llu bit errors in %llu bytes, bit error rate = %e\n",
+               (unsigned long long)berr.bits, (unsigned long long)berr.errors,
+               (unsigned long long)berr.bad_bytes,
+               berr.bits > 0 ? (double)berr.errors / berr.bits : 0.0);
+        
+        if ( 0 < berr.errors ) {
+            printf("errors by bit:");
+            for ( ierr = 7; ierr >= 0; ierr-- ) {
+                printf(" %llu", (unsigned long long)berr.by_bit[ierr]);
             }
+            printf(" (bit 7 first)\nfirst bad bytes at:");
+            for ( ierr = 0; ierr < berr.n_first; ierr++ ) {
+                printf(" %llu", (unsigned long long)berr.first[ierr]);
+            }
+            printf("\n");
+            printf("ERROR: data verification failed\n");
+            goto lErrorExit;
         }
     }
     
     /* Disable the DPTI port.
     */
-    if ( ! DptiDisable(hif) ) {
-        printf("ERROR: failed to disable PTI port, erc = %d\n", DmgrGetLastError());
+    if ( ! ptrans->disable() ) {
+        printf("ERROR: failed to disable PTI port, erc = %d\n", ptrans->last_error());
         goto lErrorExit;
     }
     
     /* Close the device handle.
     */
-    if ( ! DmgrClose(hif) ) {
-        printf("ERROR: failed to close device handle, erc = %d\n", DmgrGetLastError());
-        goto lErrorExit;
-    }
+    ptrans->close();
+    delete ptrans;
     
     /* Free the memory that was previously allocated.
     */
     free(pbOut);
     free(pbIn);
+    delete ppat;
     
 lExit:
     
@@ -379,9 +500,10 @@ lExit:
     
 lErrorExit:
     
-    if ( hifInvalid != hif ) {
-        DptiDisable(hif);
-        DmgrClose(hif);
+    if ( NULL != ptrans ) {
+        ptrans->disable();
+        ptrans->close();
+        delete ptrans;
     }
     
     if ( NULL != pbOut ) {
@@ -392,6 +514,8 @@ lErrorExit:
         free(pbIn);
     }
     
+    delete ppat;
+    
     return 1;
 }
 
@@ -415,6 +539,7 @@ FParseArguments( int cszArg, char* rgszArg[] ) {
     
     int     iszArg;
     DWORD   ich;
+    QWORD   cbTemp;
     
     /* Set all of the flags to their default values of fFalse. Flags will
     ** only be set to fTrue when the corresponding command or option has
@@ -423,6 +548,10 @@ FParseArguments( int cszArg, char* rgszArg[] ) {
     fDevName = fFalse;
     fShowHelp = fFalse;
     fVerifyData = fFalse;
+    fStream = fFalse;
+    fBenchmark = fFalse;
+    fJson = fFalse;
+    fPortSet = fFalse;
     
     /* Set all of the string parameters to their default values: empty
     ** strings.
@@ -433,6 +562,8 @@ FParseArguments( int cszArg, char* rgszArg[] ) {
     */
     prtReq = 0;
     cbTrans = cbTransDefault;
+    cbChunk = cbChunkDefault;
+    ctransBench = ctransBenchDefault;
     
     /* Get a pointer to the command string used to launch the application.
     ** This is used when printing the usage as part of the help command.
@@ -496,7 +627,45 @@ FParseArguments( int cszArg, char* rgszArg[] ) {
                 ich++;
             }
             
-            cbTrans = strtol(rgszArg[iszArg], NULL, 10);
+            cbTrans = strtoull(rgszArg[iszArg], NULL, 10);
+        }
+        
+        /* Check for the -s option. This specifies the chunk size used to
+        ** stream the transfer through a fixed pair of buffers.
+        */
+        else if ( 0 == strcmp(rgszArg[iszArg], "-s") ) {
+            
+            iszArg++;
+            
+            if (( iszArg >= cszArg ) || ( NULL == rgszArg[iszArg] )) {
+                
+                printf("ERROR: no chunk size was specified\n");
+                return fFalse;
+            }
+            
+            /* Make sure that the string consists entirely of digits 0-9.
+            */
+            ich = 0;
+            while ( '\0' != rgszArg[iszArg][ich] ) {
+                
+                if ( 0 == isdigit(rgszArg[iszArg][ich]) ) {
+                    
+                    printf("ERROR: invalid character detected in chunk size string: %c\n", rgszArg[iszArg][ich]);
+                    return fFalse;
+                }
+                
+                ich++;
+            }
+            
+            cbTemp = strtoull(rgszArg[iszArg], NULL, 10);
+            if (( 0 == cbTemp ) || ( 0xFFFFFFFF < cbTemp ) || ( 10 < ich )) {
+                
+                printf("ERROR: invalid chunk size specified\n");
+                return fFalse;
+            }
+            
+            cbChunk = (DWORD)cbTemp;
+            fStream = fTrue;
         }
         
         /* Check for the -p option. This specifies which DPTI port is
@@ -527,6 +696,60 @@ FParseArguments( int cszArg, char* rgszArg[] ) {
             }
             
             prtReq = strtol(rgszArg[iszArg], NULL, 10);
+            fPortSet = fTrue;
+        }
+        
+        /* Check for the -b option. This selects the benchmark.
+        */
+        else if ( 0 == strcmp(rgszArg[iszArg], "-b") ) {
+            
+            fBenchmark = fTrue;
+        }
+        
+        /* Check for the -n option. This specifies how many transfers of
+        ** each size the benchmark times.
+        */
+        else if ( 0 == strcmp(rgszArg[iszArg], "-n") ) {
+            
+            iszArg++;
+            
+            if (( iszArg >= cszArg ) || ( NULL == rgszArg[iszArg] )) {
+                
+                printf("ERROR: no transfer count was specified\n");
+                return fFalse;
+            }
+            
+            ctransBench = strtoul(rgszArg[iszArg], NULL, 10);
+            if (( 0 == ctransBench ) || ( 0 == isdigit(rgszArg[iszArg][0]) )) {
+                
+                printf("ERROR: invalid transfer count specified\n");
+                return fFalse;
+            }
+        }
+        
+        /* Check for the -f option. This specifies the format of the
+        ** benchmark results.
+        */
+        else if ( 0 == strcmp(rgszArg[iszArg], "-f") ) {
+            
+            iszArg++;
+            
+            if (( iszArg >= cszArg ) || ( NULL == rgszArg[iszArg] )) {
+                
+                printf("ERROR: no output format was specified\n");
+                return fFalse;
+            }
+            
+            if ( 0 == strcmp(rgszArg[iszArg], "json") ) {
+                fJson = fTrue;
+            }
+            else if ( 0 == strcmp(rgszArg[iszArg], "csv") ) {
+                fJson = fFalse;
+            }
+            else {
+                printf("ERROR: invalid output format specified: %s\n", rgszArg[iszArg]);
+                return fFalse;
+            }
         }
         
         /* Check for the -v option. If this option is specified then the
@@ -652,6 +875,231 @@ GetTimeMs() {
 
 #endif
 
+/* ------------------------------------------------------------ */
+/***    GetTimeNs
+**
+**  Parameters:
+**      none
+**
+**  Return Values:
+**      monotonic time in nanoseconds
+**
+**  Errors:
+**
+**  Description:
+**      High resolution clock for timing transfers. Unlike GetTimeMs it
+**      does not wrap and is not affected by changes to the system time.
+*/
+#if defined(WIN32)
+
+TIMENS
+GetTimeNs() {
+    
+    LARGE_INTEGER   lnFreq;
+    LARGE_INTEGER   lnCount;
+    
+    QueryPerformanceFrequency(&lnFreq);
+    QueryPerformanceCounter(&lnCount);
+    
+    return (TIMENS)((double)lnCount.QuadPart * 1e9 / (double)lnFreq.QuadPart);
+}
+
+#else
+
+TIMENS
+GetTimeNs() {
+    
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (TIMENS)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif
+
+/* ------------------------------------------------------------ */
+/***    FRunBenchmark
+**
+**  Parameters:
+**      ptrans  - open device
+**      cprtPti - number of DPTI ports on the device
+**
+**  Return Values:
+**      fTrue for success, fFalse otherwise
+**
+**  Errors:
+**
+**  Description:
+**      Time ctransBench round trips of each size from cbBenchMin up to
+**      cbTrans, doubling each time, on the port given with "-p" or on
+**      every port in turn. Prints one result per port and size to
+**      stdout, as CSV or as a JSON array.
+*/
+BOOL
+FRunBenchmark( transport* ptrans, INT32 cprtPti ) {
+    
+    INT32   iprt;
+    INT32   iprtFirst;
+    INT32   iprtLast;
+    DPRP    dprpPti;
+    BYTE*   pbOut;
+    BYTE*   pbIn;
+    DWORD   cbMax;
+    DWORD   cb;
+    DWORD   itrans;
+    TIMENS  tnsStart;
+    TIMENS  tnsTotal;
+    TIMENS  tnsMedian;
+    TIMENS  tnsP99;
+    TIMENS  tnsP999;
+    double  trateMBps;
+    BOOL    fFirst;
+    BOOL    fSuccess;
+    std::vector<TIMENS> rgtns;
+    
+    if ( 0xFFFFFFFF < cbTrans ) {
+        printf("ERROR: benchmark transfers are at most 4 GB\n");
+        return fFalse;
+    }
+    cbMax = (DWORD)cbTrans;
+    if ( cbMax < cbBenchMin ) {
+        cbMax = cbBenchMin;
+    }
+    
+    pbOut = (BYTE*)malloc(cbMax);
+    pbIn = (BYTE*)malloc(cbMax);
+    if (( NULL == pbOut ) || ( NULL == pbIn )) {
+        printf("ERROR: failed to allocate memory for data transfer\n");
+        free(pbOut);
+        free(pbIn);
+        return fFalse;
+    }
+    memset(pbOut, 0x5A, cbMax);
+    rgtns.resize(ctransBench);
+    
+    iprtFirst = fPortSet ? prtReq : 0;
+    iprtLast = fPortSet ? prtReq : cprtPti - 1;
+    
+    if ( fJson ) {
+        printf("[\n");
+    }
+    else {
+        printf("port,type,bytes,count,min_ns,median_ns,p99_ns,p999_ns,mb_per_s\n");
+    }
+    
+    fFirst = fTrue;
+    fSuccess = fTrue;
+    for ( iprt = iprtFirst; ( iprt <= iprtLast ) && fSuccess; iprt++ ) {
+        
+        /* The synchronous and asynchronous ports cannot be enabled at
+        ** the same time, so each is enabled only for its own sweep.
+        */
+        if (( ! ptrans->get_port_properties(iprt, &dprpPti) ) ||
+            ( ! ptrans->enable(iprt) )) {
+            printf("ERROR: failed to enable PTI port %d, erc = %d\n", iprt, ptrans->last_error());
+            fSuccess = fFalse;
+            break;
+        }
+        
+        cb = cbBenchMin;
+        while ( fSuccess ) {
+            
+            /* One untimed transfer to get the port going.
+            */
+            fSuccess = ptrans->io(pbOut, cb, pbIn, cb, false);
+            
+            tnsTotal = 0;
+            for ( itrans = 0; ( itrans < ctransBench ) && fSuccess; itrans++ ) {
+                tnsStart = GetTimeNs();
+                fSuccess = ptrans->io(pbOut, cb, pbIn, cb, false);
+                rgtns[itrans] = GetTimeNs() - tnsStart;
+                tnsTotal += rgtns[itrans];
+            }
+            
+            if ( ! fSuccess ) {
+                printf("ERROR: DptiIO of %u bytes failed on port %d, erc = %d\n",
+                       cb, iprt, ptrans->last_error());
+                break;
+            }
+            
+            /* Nearest-rank percentiles of the sorted times.
+            */
+            std::sort(rgtns.begin(), rgtns.end());
+            tnsMedian = rgtns[(size_t)(0.5 * (ctransBench - 1) + 0.5)];
+            tnsP99 = rgtns[(size_t)(0.99 * (ctransBench - 1) + 0.5)];
+            tnsP999 = rgtns[(size_t)(0.999 * (ctransBench - 1) + 0.5)];
+            trateMBps = 0.0;
+            if ( 0 < tnsTotal ) {
+                trateMBps = (double)cb * ctransBench / tnsTotal * 1e9 / 1048576.0;
+            }
+            
+            if ( fJson ) {
+                printf("%s  {\"port\": %d, \"type\": \"%s\", \"bytes\": %u, \"count\": %u, "
+                       "\"min_ns\": %llu, \"median_ns\": %llu, \"p99_ns\": %llu, "
+                       "\"p999_ns\": %llu, \"mb_per_s\": %.3f}",
+                       fFirst ? "" : ",\n", iprt,
+                       dprpPtiAsynchronous & dprpPti ? "async" : "sync", cb, ctransBench,
+                       rgtns[0], tnsMedian, tnsP99, tnsP999, trateMBps);
+            }
+            else {
+                printf("%d,%s,%u,%u,%llu,%llu,%llu,%llu,%.3f\n", iprt,
+                       dprpPtiAsynchronous & dprpPti ? "async" : "sync", cb, ctransBench,
+                       rgtns[0], tnsMedian, tnsP99, tnsP999, trateMBps);
+            }
+            fflush(stdout);
+            fFirst = fFalse;
+            
+            if ( cbMax == cb ) {
+                break;
+            }
+            cb = ( cbMax / 2 < cb ) ? cbMax : cb * 2;
+        }
+        
+        ptrans->disable();
+    }
+    
+    if ( fJson ) {
+        printf("\n]\n");
+    }
+    
+    free(pbOut);
+    free(pbIn);
+    
+    return fSuccess;
+}
+
+/* ------------------------------------------------------------ */
+/***    TmsElapsed
+**
+**  Parameters:
+**      tmsStart    - time returned by GetTimeMs at the start
+**      tmsEnd      - time returned by GetTimeMs at the end
+**
+**  Return Values:
+**      milliseconds from tmsStart to tmsEnd
+**
+**  Errors:
+**
+**  Description:
+**      Compute an elapsed time, allowing for GetTimeMs wrapping around.
+*/
+TIMEMS
+TmsElapsed( TIMEMS tmsStart, TIMEMS tmsEnd ) {
+    
+    TIMEMS  tmsElapsed;
+    
+    if ( tmsEnd < tmsStart ) {
+        tmsElapsed = tmsInfinite - tmsStart;
+        tmsElapsed = tmsElapsed + tmsEnd;
+    }
+    else {
+        tmsElapsed = tmsEnd - tmsStart;
+    }
+    
+    return tmsElapsed;
+}
+
 /* ------------------------------------------------------------ */
 
 /************************************************************************/
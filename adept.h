@@ -0,0 +1,46 @@
+/* adept.h -- Adept SDK declarations used by dpticat and DptiDemo.
+ *
+ * Normally this just pulls in the SDK headers. When built with
+ * DPTICAT_NO_ADEPT (make NO_ADEPT=1) the SDK is not required: the few
+ * types and constants this tree uses are declared here instead, and only
+ * the simulated transport is available.
+ */
+#ifndef ADEPT_H
+#define ADEPT_H
+
+#ifndef DPTICAT_NO_ADEPT
+
+#include "dpcdecl.h"
+#include "dmgr.h"
+#include "dpti.h"
+
+#else
+
+#include <stdint.h>
+
+typedef int32_t   BOOL;
+typedef uint8_t   BYTE;
+typedef uint32_t  DWORD;
+typedef int32_t   INT32;
+typedef uint32_t  HIF;
+typedef uint32_t  DPRP;
+typedef int32_t   ERC;
+
+const BOOL  fFalse = 0;
+const BOOL  fTrue = 1;
+
+const int   cchDvcNameMax = 64;
+const HIF   hifInvalid = 0;
+
+const DPRP  dprpPtiAsynchronous = 0x00010000;
+const DPRP  dprpPtiSynchronous = 0x00020000;
+
+const ERC   ercNoErc = 0;
+const ERC   ercInvParam = 3004;
+const ERC   ercNotSupported = 3008;
+const ERC   ercTransferCancelled = 3109;
+const ERC   ercConnReject = 3001;
+
+#endif
+
+#endif
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "calib.h"
+
+/* Equal code widths, the table used until enough hits are in.
+ */
+static void uniform_table(cal_table *t){
+  for(int k = 0; k < CAL_CODES; k++){
+    t->frac[k] = (k + 0.5) / CAL_CODES;
+    t->frac_u[k] = t->frac[k] * CAL_FRAC_SCALE;
+  }
+}
+
+fine_calibrator::fine_calibrator() :
+  stopping(false), counts(CAL_CODES), gen(0) {
+  uniform_table(&table);
+  table.gen = 0;
+  worker = std::thread(&fine_calibrator::run, this);
+}
+
+fine_calibrator::~fine_calibrator(){
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopping = true;
+  }
+  stop_cv.notify_all();
+  worker.join();
+}
+
+void fine_calibrator::merge(const uint64_t *c){
+  std::lock_guard<std::mutex> lock(mtx);
+  for(int k = 0; k < CAL_CODES; k++){
+    counts[k] += c[k];
+  }
+}
+
+void fine_calibrator::update(cal_table *t){
+  if(t->gen == gen.load(std::memory_order_acquire)){
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mtx);
+  memcpy(t, &table, sizeof(table));
+}
+
+void fine_calibrator::run(){
+  std::unique_lock<std::mutex> lock(mtx);
+  while(!stopping){
+    stop_cv.wait_for(lock, std::chrono::nanoseconds(CAL_REBUILD_NS));
+    if(!stopping){
+      rebuild();
+    }
+  }
+}
+
+/* Called with mtx held. The sums are cheap next to the rebuild
+ * interval, so the totals are simply rescanned each time.
+ */
+void fine_calibrator::rebuild(){
+  uint64_t total = 0;
+  for(int k = 0; k < CAL_CODES; k++){
+    total += counts[k];
+  }
+  if(total < CAL_MIN_HITS){
+    return;
+  }
+  uint64_t below = 0;
+  for(int k = 0; k < CAL_CODES; k++){
+    table.frac[k] = (below + counts[k] / 2.0) / total;
+    table.frac_u[k] = table.frac[k] * CAL_FRAC_SCALE;
+    if(table.frac_u[k] >= CAL_FRAC_SCALE){
+      table.frac_u[k] = CAL_FRAC_SCALE - 1;
+    }
+    below += counts[k];
+  }
+  table.gen++;
+  gen.store(table.gen, std::memory_order_release);
+}
+
+bool fine_calibrator::save(const char *path){
+  FILE *f = fopen(path, "w");
+  if(f == NULL){
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mtx);
+  rebuild();
+  for(int k = 0; k < CAL_CODES; k++){
+    fprintf(f, "%i %llu %.9f\n", k, (unsigned long long)counts[k], table.frac[k]);
+  }
+  return fclose(f) == 0;
+}
@@ -0,0 +1,74 @@
+/* calib.h -- code-density calibration of the fine time field.
+ *
+ * With hits arriving uncorrelated to the coarse clock, the share of hits
+ * a fine code collects is the share of the coarse period it spans. The
+ * calibrated position of code k within the period is therefore
+ *
+ *   (hits below k + hits on k / 2) / all hits
+ *
+ * Writer threads count the fine codes they decode and merge the counts
+ * into a fine_calibrator, whose background thread rebuilds the lookup
+ * table from the running totals every CAL_REBUILD_NS. Each writer works
+ * from its own copy of the table (cal_table) and only takes a new copy
+ * when one has been published, so a word costs one lookup. Until
+ * CAL_MIN_HITS words have been seen the table assumes equal code widths.
+ */
+#ifndef CALIB_H
+#define CALIB_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "timestamp.h"
+
+#define CAL_CODES (1 << FINE)
+#define CAL_MIN_HITS (100 * CAL_CODES)
+#define CAL_REBUILD_NS 500000000ull
+
+/* Calibrated fine times are also kept in millionths of a coarse period,
+ * which is what the text formats print.
+ */
+#define CAL_FRAC_SCALE 1000000
+
+struct cal_table {
+  double frac[CAL_CODES];
+  uint32_t frac_u[CAL_CODES];
+  int gen;
+};
+
+class fine_calibrator {
+public:
+  fine_calibrator();
+  ~fine_calibrator();
+
+  /* Add a writer's code counts since its last merge.
+   */
+  void merge(const uint64_t *counts);
+
+  /* Refresh t if a newer table has been published.
+   */
+  void update(cal_table *t);
+
+  /* Write the current table as "code hits frac" lines.
+   */
+  bool save(const char *path);
+
+private:
+  void run();
+  void rebuild();
+
+  std::mutex mtx;
+  std::condition_variable stop_cv;
+  bool stopping;
+  std::vector<uint64_t> counts;
+  cal_table table;
+  std::atomic<int> gen;
+  std::thread worker;
+};
+
+#endif
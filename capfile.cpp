@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capfile.h"
+
+static bool pwrite_all(int fd, const void *buf, size_t len, uint64_t pos){
+  const byte *p = (const byte *)buf;
+  while(len > 0){
+    ssize_t n = pwrite(fd, p, len, pos);
+    if(n < 0 && errno == EINTR){
+      continue;
+    }
+    if(n <= 0){
+      return false;
+    }
+    p += n;
+    pos += n;
+    len -= n;
+  }
+  return true;
+}
+
+cap_writer::cap_writer() : fd(-1), seg(NULL), seg_pos(0), seg_used(0), next_index(0) {
+  memset(&hdr, 0, sizeof(hdr));
+}
+
+cap_writer::~cap_writer(){
+  if(fd >= 0){
+    close();
+  }
+}
+
+bool cap_writer::open(const char *path, size_t max_chunk){
+  fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0){
+    return false;
+  }
+  hdr.magic = CAP_MAGIC;
+  hdr.version = CAP_VERSION;
+  hdr.segment_bytes = CAP_SEGMENT_BYTES;
+  uint64_t need = (cap_record_bytes(max_chunk) + 4095) & ~4095ull;
+  if(need > hdr.segment_bytes){
+    hdr.segment_bytes = need;
+  }
+  seg_pos = CAP_HEADER_BYTES;
+  if(!pwrite_all(fd, &hdr, sizeof(hdr), 0) || ftruncate(fd, CAP_HEADER_BYTES) != 0 ||
+     !map_segment()){
+    int err = errno;
+    ::close(fd);
+    fd = -1;
+    errno = err;
+    return false;
+  }
+  return true;
+}
+
+/* Preallocate the segment at seg_pos, so running out of space shows up
+ * here rather than as SIGBUS on a store, and map it.
+ */
+bool cap_writer::map_segment(){
+  int err = posix_fallocate(fd, seg_pos, hdr.segment_bytes);
+  if(err != 0){
+    errno = err;
+    return false;
+  }
+  void *p = mmap(NULL, hdr.segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, seg_pos);
+  if(p == MAP_FAILED){
+    return false;
+  }
+  seg = (byte *)p;
+  seg_used = 0;
+  return true;
+}
+
+void cap_writer::unmap_segment(){
+  if(seg != NULL){
+    munmap(seg, hdr.segment_bytes);
+    seg = NULL;
+  }
+}
+
+bool cap_writer::append(const byte *data, size_t len, uint64_t t_ns){
+  if(len == 0){
+    return true;
+  }
+  uint64_t need = cap_record_bytes(len);
+  if(seg_used + need > hdr.segment_bytes){
+    unmap_segment();
+    seg_pos += hdr.segment_bytes;
+    if(!map_segment()){
+      return false;
+    }
+  }
+
+  if(hdr.bytes >= next_index){
+    cap_index e = { t_ns, hdr.bytes, seg_pos + seg_used };
+    index.push_back(e);
+    next_index = (hdr.bytes / CAP_INDEX_BYTES + 1) * CAP_INDEX_BYTES;
+  }
+
+  /* The segment is fresh from fallocate, so the padding is already zero.
+   */
+  cap_record rec = { CAP_RECORD_MAGIC, (uint32_t)len, t_ns, hdr.bytes };
+  memcpy(seg + seg_used, &rec, sizeof(rec));
+  memcpy(seg + seg_used + sizeof(rec), data, len);
+  seg_used += need;
+  hdr.n_records++;
+  hdr.bytes += len;
+  return true;
+}
+
+bool cap_writer::close(){
+  bool ok = true;
+  hdr.data_end = seg_pos + seg_used;
+  unmap_segment();
+  hdr.index_pos = hdr.data_end;
+  hdr.n_index = index.size();
+  ok = ftruncate(fd, hdr.data_end) == 0;
+  ok = ok && pwrite_all(fd, index.data(), index.size() * sizeof(cap_index), hdr.index_pos);
+  ok = ok && pwrite_all(fd, &hdr, sizeof(hdr), 0);
+  if(::close(fd) != 0){
+    ok = false;
+  }
+  fd = -1;
+  return ok;
+}
+
+cap_reader::cap_reader() : fd(-1), map(NULL), map_bytes(0), data_end(0), pos(0) {
+  memset(&hdr, 0, sizeof(hdr));
+}
+
+cap_reader::~cap_reader(){
+  close();
+}
+
+bool cap_reader::open(const char *path){
+  fd = ::open(path, O_RDONLY);
+  if(fd < 0){
+    fprintf(stderr, "ERROR: cannot open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (uint64_t)st.st_size < CAP_HEADER_BYTES){
+    fprintf(stderr, "ERROR: %s is not a capture file\n", path);
+    close();
+    return false;
+  }
+  map_bytes = st.st_size;
+  void *p = mmap(NULL, map_bytes, PROT_READ, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED){
+    fprintf(stderr, "ERROR: cannot map %s: %s\n", path, strerror(errno));
+    map = NULL;
+    close();
+    return false;
+  }
+  map = (const byte *)p;
+  memcpy(&hdr, map, sizeof(hdr));
+  if(hdr.magic != CAP_MAGIC || hdr.version != CAP_VERSION || hdr.segment_bytes == 0){
+    fprintf(stderr, "ERROR: %s is not a capture file\n", path);
+    close();
+    return false;
+  }
+
+  uint64_t index_end = hdr.index_pos + hdr.n_index * sizeof(cap_index);
+  if(hdr.data_end != 0 && hdr.data_end <= hdr.index_pos && index_end <= map_bytes){
+    data_end = hdr.data_end;
+    index.resize(hdr.n_index);
+    memcpy(index.data(), map + hdr.index_pos, index_end - hdr.index_pos);
+  }
+  else{
+    fprintf(stderr, "WARNING: %s was not closed, scanning it\n", path);
+    data_end = map_bytes;
+    build_index();
+  }
+  madvise((void *)map, map_bytes, MADV_SEQUENTIAL);
+  pos = CAP_HEADER_BYTES;
+  return true;
+}
+
+void cap_reader::close(){
+  if(map != NULL){
+    munmap((void *)map, map_bytes);
+    map = NULL;
+  }
+  if(fd >= 0){
+    ::close(fd);
+    fd = -1;
+  }
+  index.clear();
+}
+
+bool cap_reader::valid_record(uint64_t p, cap_record *rec) const {
+  if(p + sizeof(cap_record) > data_end){
+    return false;
+  }
+  memcpy(rec, map + p, sizeof(*rec));
+  uint64_t seg_end = CAP_HEADER_BYTES +
+    ((p - CAP_HEADER_BYTES) / hdr.segment_bytes + 1) * hdr.segment_bytes;
+  uint64_t end = p + cap_record_bytes(rec->length);
+  return rec->magic == CAP_RECORD_MAGIC && end <= data_end && end <= seg_end;
+}
+
+/* Move *p to the next record, skipping the unused end of a segment.
+ */
+bool cap_reader::advance(uint64_t *p, cap_record *rec) const {
+  while(*p < data_end){
+    if(valid_record(*p, rec)){
+      return true;
+    }
+    *p = CAP_HEADER_BYTES +
+      ((*p - CAP_HEADER_BYTES) / hdr.segment_bytes + 1) * hdr.segment_bytes;
+  }
+  return false;
+}
+
+void cap_reader::build_index(){
+  uint64_t p = CAP_HEADER_BYTES;
+  uint64_t next_index = 0;
+  cap_record rec;
+  hdr.n_records = 0;
+  hdr.bytes = 0;
+  while(advance(&p, &rec)){
+    if(rec.offset >= next_index){
+      cap_index e = { rec.t_ns, rec.offset, p };
+      index.push_back(e);
+      next_index = (rec.offset / CAP_INDEX_BYTES + 1) * CAP_INDEX_BYTES;
+    }
+    hdr.n_records++;
+    hdr.bytes = rec.offset + rec.length;
+    p += cap_record_bytes(rec.length);
+  }
+  hdr.n_index = index.size();
+}
+
+void cap_reader::seek_offset(uint64_t offset){
+  size_t lo = 0, hi = index.size();
+  while(hi - lo > 1){
+    size_t mid = (lo + hi) / 2;
+    if(index[mid].offset <= offset){
+      lo = mid;
+    }
+    else{
+      hi = mid;
+    }
+  }
+  pos = index.empty() ? data_end : index[lo].pos;
+  cap_record rec;
+  while(advance(&pos, &rec) && rec.offset + rec.length <= offset){
+    pos += cap_record_bytes(rec.length);
+  }
+}
+
+void cap_reader::seek_time(uint64_t t_ns){
+  size_t lo = 0, hi = index.size();
+  while(hi - lo > 1){
+    size_t mid = (lo + hi) / 2;
+    if(index[mid].t_ns < t_ns){
+      lo = mid;
+    }
+    else{
+      hi = mid;
+    }
+  }
+  pos = index.empty() ? data_end : index[lo].pos;
+  cap_record rec;
+  while(advance(&pos, &rec) && rec.t_ns < t_ns){
+    pos += cap_record_bytes(rec.length);
+  }
+}
+
+bool cap_reader::next(cap_record *rec, const byte **data){
+  if(!advance(&pos, rec)){
+    return false;
+  }
+  *data = map + pos + sizeof(cap_record);
+  pos += cap_record_bytes(rec->length);
+  return true;
+}
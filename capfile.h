@@ -0,0 +1,147 @@
+/* capfile.h -- indexed, timestamped capture files.
+ *
+ * dpticat -w FILE stores the stream chunk by chunk, each chunk with the
+ * host CLOCK_MONOTONIC_RAW time it was received and its byte offset in
+ * the stream, so a capture can be examined or replayed (simdev.cpp,
+ * replay=FILE) with its original timing.
+ *
+ * The file is a header page followed by segments of segment_bytes. The
+ * writer preallocates each segment and fills it through a shared
+ * mapping, so storing a chunk is a memcpy; the kernel writes the pages
+ * back behind it. Segments hold whole records:
+ *
+ *   cap_record  magic, length, time, offset
+ *   data        length bytes, zero-padded to a multiple of 8
+ *
+ * and are zero after their last record. On close the file is cut after
+ * the last segment's records and a sparse index is appended, one
+ * cap_index entry for the first record at or after every
+ * CAP_INDEX_BYTES of stream, which is what seeking by time or offset
+ * searches. A file whose writer never closed it has no index; the
+ * reader then builds one by scanning the records.
+ *
+ * All fields are little-endian (host order on every platform dpticat
+ * runs on).
+ */
+#ifndef CAPFILE_H
+#define CAPFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "transport.h"
+
+#define CAP_MAGIC 0x43545044          // "DPTC"
+#define CAP_RECORD_MAGIC 0x52545044   // "DPTR"
+#define CAP_VERSION 1
+
+#define CAP_HEADER_BYTES 4096
+#define CAP_SEGMENT_BYTES (64ull << 20)
+#define CAP_INDEX_BYTES (1ull << 20)
+
+struct cap_file_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t segment_bytes;
+  uint64_t data_end;        // file offset after the last record, 0 if unclosed
+  uint64_t index_pos;       // file offset of the index
+  uint64_t n_index;
+  uint64_t n_records;
+  uint64_t bytes;           // stream bytes in the file
+};
+
+struct cap_record {
+  uint32_t magic;
+  uint32_t length;
+  uint64_t t_ns;            // CLOCK_MONOTONIC_RAW when the chunk arrived
+  uint64_t offset;          // stream offset of its first byte
+};
+
+struct cap_index {
+  uint64_t t_ns;
+  uint64_t offset;
+  uint64_t pos;             // file offset of the record
+};
+
+/* Bytes a record of len data bytes takes in a segment.
+ */
+inline uint64_t cap_record_bytes(uint64_t len){
+  return sizeof(cap_record) + ((len + 7) & ~7ull);
+}
+
+class cap_writer {
+public:
+  cap_writer();
+  ~cap_writer();
+
+  /* Create path for chunks of up to max_chunk bytes, growing the
+   * segments beyond CAP_SEGMENT_BYTES if one would not hold such a
+   * chunk. Returns false with errno set.
+   */
+  bool open(const char *path, size_t max_chunk);
+
+  /* Store a chunk received at t_ns. Returns false with errno set.
+   */
+  bool append(const byte *data, size_t len, uint64_t t_ns);
+
+  /* Write the index and the final header. Returns false with errno set.
+   */
+  bool close();
+
+private:
+  bool map_segment();
+  void unmap_segment();
+
+  int fd;
+  cap_file_header hdr;
+  byte *seg;                // mapping of the current segment
+  uint64_t seg_pos;         // its file offset
+  uint64_t seg_used;
+  uint64_t next_index;      // stream offset due an index entry
+  std::vector<cap_index> index;
+};
+
+class cap_reader {
+public:
+  cap_reader();
+  ~cap_reader();
+
+  /* Map path, reading its index or building one. Returns false with an
+   * error on stderr.
+   */
+  bool open(const char *path);
+  void close();
+
+  const cap_file_header &header() const { return hdr; }
+
+  /* Time of the first record, 0 for an empty capture.
+   */
+  uint64_t start_ns() const { return index.empty() ? 0 : index[0].t_ns; }
+
+  /* Position at the record holding the stream offset, or at the first
+   * one received at or after t_ns. Either may be past the end.
+   */
+  void seek_offset(uint64_t offset);
+  void seek_time(uint64_t t_ns);
+
+  /* The next record and its data, false at the end of the capture.
+   */
+  bool next(cap_record *rec, const byte **data);
+
+private:
+  bool valid_record(uint64_t pos, cap_record *rec) const;
+  bool advance(uint64_t *pos, cap_record *rec) const;
+  void build_index();
+
+  int fd;
+  const byte *map;
+  uint64_t map_bytes;
+  uint64_t data_end;
+  cap_file_header hdr;
+  std::vector<cap_index> index;
+  uint64_t pos;
+};
+
+#endif
@@ -0,0 +1,1227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#include "capture.h"
+#include "proto.h"
+#include "util.h"
+#include "server.h"
+#include "stripe.h"
+#include "decode.h"
+#include "histogram.h"
+#include "calib.h"
+#include "frame.h"
+#include "crc32c.h"
+#include "telemetry.h"
+#include "capfile.h"
+#include "disksink.h"
+#include "fanout.h"
+#include "shmring.h"
+#include "trigger.h"
+#include "compress.h"
+#include "realtime.h"
+
+/* Number of overlapped requests kept in flight, 0 for the blocking loop.
+ */
+int queue_depth = 0;
+
+/* Number of chunk buffers between each reader and the writer.
+ */
+int ring_slots = 64;
+
+/* Request protocol version spoken by the bitstream, see proto.h.
+ */
+int proto = PROTO_V1;
+
+/* Bytes asked for per request, 0 for the protocol's default.
+ */
+int n_bytes = 0;
+
+/* Request size auto-tuning, enabled by a non-zero tune_max.
+ */
+uint32_t tune_min = 0;
+uint32_t tune_max = 0;
+double target_rate = 0;
+double target_lat_us = 0;
+
+/* Stream stdin to the device alongside the reads (protocol 2 only).
+ */
+bool duplex = false;
+
+/* Serve the stream to socket subscribers instead of the output.
+ */
+const char *listen_addr = NULL;
+
+/* Stop after this many bytes, 0 for no limit.
+ */
+uint64_t byte_limit = 0;
+
+/* printf pattern for per-source output files, NULL to interleave.
+ */
+const char *split_pattern = NULL;
+
+/* The bitstream frames its replies, see frame.h.
+ */
+bool framed = false;
+
+/* Output format, see decode.h.
+ */
+int out_format = FORMAT_RAW;
+
+/* Write histogram snapshots instead of the stream, every hist_interval
+ * seconds (0 for only at the end) and whenever hist_dump_requested is
+ * set.
+ */
+bool histogram_mode = false;
+double hist_interval = 0;
+volatile sig_atomic_t hist_dump_requested = 0;
+
+static hist_set *hists = NULL;
+
+/* Calibrate the fine field from the data and add calibrated times to
+ * the decoded output; the final table goes to cal_save_path if set.
+ */
+bool calibrate = false;
+const char *cal_save_path = NULL;
+
+static fine_calibrator *calib = NULL;
+
+/* Write the stream to this capture file (capfile.h) instead of the
+ * output.
+ */
+const char *capture_path = NULL;
+
+/* Write the output to this file with O_DIRECT and io_uring instead of
+ * to the output fd (disksink.h).
+ */
+const char *direct_path = NULL;
+
+/* Gift raw output to a pipe with vmsplice instead of copying it.
+ */
+bool zero_copy = false;
+
+/* Outputs to hand the stream to instead of out_fd, NULL for none.
+ */
+fanout *sinks = NULL;
+
+/* Publish the stream in this shared-memory ring of shm_bytes instead of
+ * writing it to the output (shmring.h).
+ */
+const char *shm_name = NULL;
+uint64_t shm_bytes = 64ull << 20;
+
+/* Write only the windows around trig's trigger points (trigger.h), NULL
+ * for the whole stream.
+ */
+trigger *trig = NULL;
+
+/* Compress the output in blocks of compress_block with compress_threads
+ * workers (0 for one per CPU), see compress.h; -1 for not at all.
+ */
+int compress_mode = -1;
+size_t compress_block = Z_DEFAULT_BLOCK_BYTES;
+int compress_threads = 0;
+
+/* Realtime mode (realtime.h): huge-page, locked buffers and loop jitter
+ * reporting; readers pinned round-robin to reader_cpus and run under
+ * SCHED_FIFO at rt_priority if non-zero, writers pinned to writer_cpus.
+ */
+bool realtime = false;
+std::vector<int> reader_cpus;
+std::vector<int> writer_cpus;
+int rt_priority = 0;
+
+/* The pipe size asked for when gifting the output to it.
+ */
+#define SPLICE_PIPE_BYTES (1 << 20)
+
+/* Trace every chunk on stderr when non-zero.
+ */
+int verbose = 0;
+
+/* Write the telemetry of the capture to stderr every stats_interval
+ * seconds (0 for never) and whenever stats_dump_requested is set, and
+ * once more at the end if either happened or verbose is set.
+ */
+double stats_interval = 0;
+volatile sig_atomic_t stats_dump_requested = 0;
+
+static telemetry *tel = NULL;
+
+volatile sig_atomic_t stop_requested = 0;
+volatile sig_atomic_t interrupted = 0;
+std::atomic<bool> transfer_failed(false);
+
+/* Largest OUT transfer used for stdin data in duplex mode.
+ */
+#define SEND_MAX (64 * 1024)
+
+/* Bytes sent by the duplex sender, owned by it until it is joined.
+ */
+static uint64_t bytes_sent = 0;
+
+/* Set once the readers are done, which ends the duplex sender too even
+ * if stdin stays open.
+ */
+static std::atomic<bool> send_stop(false);
+
+transport *open_device(const char *dev_name, int port_num, int *status){
+  /* Attempt to open the device.
+   */
+  transport *trans = transport_open(dev_name);
+  if ( trans == NULL ) {
+    fprintf(stderr, "ERROR: unable to open device \"%s\"\n", dev_name);
+    *status = 2;
+    return NULL;
+  }
+  fprintf(stderr, "Opened HIF\n");
+  int n_ports;
+
+  if(!trans->get_port_count(&n_ports)){
+    fprintf(stderr, "ERROR: failed to determine DPTI port count, erc = %d\n", trans->last_error());
+    trans->close();
+    delete trans;
+    *status = 2;
+    return NULL;
+  }
+
+  fprintf(stderr, "Number of ports on %s: %i\n", dev_name, n_ports);
+
+  DPRP port_props;
+
+  if(!trans->get_port_properties(port_num, &port_props)){
+    fprintf(stderr, "ERROR: failed to get DPTI port properties, erc = %d\n", trans->last_error());
+    trans->close();
+    delete trans;
+    *status = 3;
+    return NULL;
+  }
+
+  if(port_props & dprpPtiAsynchronous){
+    fprintf(stderr, "Port %i is asynchronous\n", port_num);
+  }
+  else{
+    fprintf(stderr, "Port %i is synchronous\n", port_num);
+  }
+
+  if (!trans->enable(port_num)){
+    fprintf(stderr, "ERROR: failed to enable port %i\n", port_num);
+    trans->close();
+    delete trans;
+    *status = 4;
+    return NULL;
+  }
+  return trans;
+}
+
+/* Report a failed transfer and end the capture.
+ */
+static void transfer_error(transport *trans, const char *what){
+  if(!stop_requested){
+    fprintf(stderr, "ERROR: %s, erc = %d\n", what, trans->last_error());
+  }
+  transfer_failed = true;
+  stop_requested = 1;
+}
+
+/* Size of the next request: the tuner's choice or n_bytes, cut short by
+ * the byte limit. 0 once the limit has been requested.
+ */
+static int next_request_size(source *src, int n){
+  if(src->tuner != NULL){
+    n = src->tuner->size();
+  }
+  if(byte_limit > 0){
+    if(src->bytes_requested >= byte_limit){
+      return 0;
+    }
+    if(byte_limit - src->bytes_requested < (uint64_t)n){
+      n = byte_limit - src->bytes_requested;
+    }
+  }
+  src->bytes_requested += n;
+  return n;
+}
+
+void report_partial(const ts_decoder *dec){
+  if(dec->partial() > 0){
+    fprintf(stderr, "WARNING: dropped %zu trailing bytes of an incomplete word\n",
+            dec->partial());
+  }
+}
+
+bool write_all(int fd, const byte *buf, size_t len){
+  size_t bytes_written = 0;
+  while(bytes_written < len){
+    ssize_t bytes_add = write(fd, buf + bytes_written, len - bytes_written);
+    if(bytes_add <= 0){
+      return false;
+    }
+    bytes_written += bytes_add;
+  }
+  return true;
+}
+
+/* Bytes to receive for a request of n data bytes.
+ */
+static DWORD reply_bytes(int n){
+  return framed ? n + FRAME_OVERHEAD : n;
+}
+
+/* Check the frame received in front of, in and behind c->data and count
+ * missing and bad frames. Returns the length of the data, 0 if the frame
+ * is bad.
+ */
+static size_t check_frame(source *src, chunk *c, DWORD n_in){
+  const byte *frame = c->data - FRAME_HEADER_BYTES;
+  frame_header h;
+  uint32_t crc;
+  memcpy(&h, frame, sizeof(h));
+  if(n_in < FRAME_OVERHEAD || h.magic != FRAME_MAGIC || h.length != n_in - FRAME_OVERHEAD){
+    src->bad_frames++;
+    src->bad_run++;
+    return 0;
+  }
+  memcpy(&crc, c->data + h.length, sizeof(crc));
+  if(crc32c(0, frame, FRAME_HEADER_BYTES + h.length) != crc){
+    src->bad_frames++;
+    src->bad_run++;
+    return 0;
+  }
+  /* Sequence numbers wrap, so compare them by their signed difference.
+   * A frame from before the expected one is a repeat and is dropped
+   * without moving frame_seq back. The bad frames since the last good
+   * one have no sequence number to trust; the next good frame resyncs,
+   * and they fill its gap before anything counts as missing.
+   */
+  int32_t ahead = (int32_t)(h.seq - src->frame_seq);
+  uint32_t bad_run = src->bad_run;
+  src->bad_run = 0;
+  if(ahead < 0){
+    src->stale_frames++;
+    return 0;
+  }
+  if((uint32_t)ahead > bad_run){
+    src->missing_frames += ahead - bad_run;
+  }
+  src->frame_seq = h.seq + 1;
+  return h.length;
+}
+
+/* Realtime mode: pin the calling reader to its CPU and run it under
+ * SCHED_FIFO, from the thread itself so that it is in place before the
+ * first transfer.
+ */
+static void enter_realtime(source *src){
+  char who[32];
+  snprintf(who, sizeof(who), "reader %i", src->id);
+  if(src->cpu >= 0){
+    rt_set_cpus(pthread_self(), std::vector<int>(1, src->cpu), who);
+  }
+  if(rt_priority > 0){
+    rt_set_fifo(pthread_self(), rt_priority, who);
+  }
+}
+
+/* Reader thread, blocking mode: one request then one receive per chunk.
+ */
+static void read_blocking(source *src){
+  enter_realtime(src);
+  chunk_ring *ring = src->ring;
+  transport *trans = src->trans;
+  byte out_bytes[PROTO_HDR_MAX];
+  uint64_t t_last = 0;
+  bool at_end = false;
+
+  for(int test_count = 0; !stop_requested && !at_end; test_count++){
+    uint64_t t_wait = now_ns();
+    chunk *c = ring->acquire();
+    if(c == NULL){
+      break;
+    }
+    uint64_t waited = now_ns() - t_wait;
+    int n = next_request_size(src, n_bytes);
+    if(n == 0){
+      break;
+    }
+    int n_out = proto_encode_request(proto, out_bytes, n);
+    uint64_t t_issue = now_ns();
+    if(t_last != 0){
+      src->tel->record(TEL_LOOP, t_issue - t_last - waited);
+    }
+    if(verbose){
+      fprintf(stderr, "Test %i\n", test_count);
+      fprintf(stderr, "Requesting %i bytes\n", n);
+    }
+
+    if(!trans->io(out_bytes, n_out, NULL, 0, false)){
+      transfer_error(trans, "request failed");
+      break;
+    }
+    uint64_t t_sent = now_ns();
+    src->tel->record(TEL_REQUEST, t_sent - t_issue);
+
+    if(verbose){
+      fprintf(stderr, "Request Sent\nReceiving %i bytes\n", n);
+    }
+
+    byte *in = framed ? c->data - FRAME_HEADER_BYTES : c->data;
+    if(!trans->io(NULL, 0, in, reply_bytes(n), false)){
+      if(trans->last_error() != ercEndOfData){
+        transfer_error(trans, "receive failed");
+        break;
+      }
+      /* The device ran out of data; keep what did arrive.
+       */
+      at_end = true;
+      n = trans->end_bytes();
+    }
+    uint64_t t_done = now_ns();
+    c->t_ns = raw_now_ns();
+    src->tel->record(TEL_RECEIVE, t_done - t_sent);
+    t_last = t_done;
+    c->len = framed && !at_end ? check_frame(src, c, reply_bytes(n)) : n;
+    src->bytes_read += c->len;
+    src->tel->count(c->len);
+    if(src->tuner != NULL && !at_end){
+      src->tuner->record(n, t_done - t_issue);
+    }
+
+    if(verbose){
+      fprintf(stderr, "Data received, printing...\n");
+    }
+    ring->publish();
+  }
+  ring->close();
+  src->done = true;
+}
+
+/* Reader thread, overlapped mode: keep queue_depth request/receive
+ * transfers queued on the device. Each one sends its request header and
+ * reads the reply straight into a ring slot in a single overlapped
+ * DptiIO, so the link never waits on a round trip.
+ */
+static void read_overlapped(source *src){
+  enter_realtime(src);
+  chunk_ring *ring = src->ring;
+  transport *trans = src->trans;
+
+  /* Per-transfer state, indexed by issue order modulo the queue depth.
+   * The header must stay valid until its transfer completes.
+   */
+  byte (*out_bytes)[PROTO_HDR_MAX] = new byte[queue_depth][PROTO_HDR_MAX];
+  uint64_t *t_issue = new uint64_t[queue_depth];
+  uint64_t n_issued = 0;
+  uint64_t n_done = 0;
+  int in_flight = 0;
+  bool at_end = false;
+
+  /* When the last completion was taken, and how long the loop has
+   * since waited for free slots.
+   */
+  uint64_t t_last = 0;
+  uint64_t waited = 0;
+
+  while(true){
+    while(!stop_requested && !at_end && in_flight < queue_depth){
+      int n = next_request_size(src, n_bytes);
+      if(n == 0){
+        break;
+      }
+      uint64_t t_wait = now_ns();
+      chunk *c = ring->acquire();
+      waited += now_ns() - t_wait;
+      if(c == NULL){
+        break;
+      }
+      int i = n_issued % queue_depth;
+      int n_out = proto_encode_request(proto, out_bytes[i], n);
+      t_issue[i] = now_ns();
+      byte *in = framed ? c->data - FRAME_HEADER_BYTES : c->data;
+      if(!trans->io(out_bytes[i], n_out, in, reply_bytes(n), true)){
+        transfer_error(trans, "failed to queue request");
+        break;
+      }
+      src->tel->record(TEL_REQUEST, now_ns() - t_issue[i]);
+      if(verbose){
+        fprintf(stderr, "Queued request %llu for %i bytes\n", (unsigned long long)n_issued, n);
+      }
+      in_flight++;
+      n_issued++;
+    }
+    if(in_flight == 0){
+      break;
+    }
+
+    /* Transfers complete in the order they were queued, which is the
+     * order their slots were acquired.
+     */
+    DWORD n_sent, n_in;
+    if(t_last != 0){
+      src->tel->record(TEL_LOOP, now_ns() - t_last - waited);
+    }
+    if(!trans->get_trans_result(&n_sent, &n_in, true)){
+      if(trans->last_error() == ercEndOfData){
+        /* The device ran out of data; keep what did arrive and queue
+         * nothing more.
+         */
+        at_end = true;
+        n_in = trans->end_bytes();
+      }
+      else{
+        transfer_error(trans, "transfer failed");
+        n_in = 0;
+      }
+    }
+    in_flight--;
+    t_last = now_ns();
+    waited = 0;
+    uint64_t t_lat = t_last - t_issue[n_done % queue_depth];
+    src->tel->record(TEL_RECEIVE, t_lat);
+    chunk *c = ring->peek_acquired();
+    c->t_ns = raw_now_ns();
+    c->len = framed && n_in > 0 && !at_end ? check_frame(src, c, n_in) : n_in;
+    src->bytes_read += c->len;
+    src->tel->count(c->len);
+    if(src->tuner != NULL && c->len > 0){
+      src->tuner->record(c->len, t_lat);
+    }
+    if(verbose){
+      fprintf(stderr, "Request %llu done, %u bytes\n", (unsigned long long)n_done, (unsigned)c->len);
+    }
+    n_done++;
+    ring->publish();
+  }
+  ring->close();
+  src->done = true;
+  delete[] out_bytes;
+  delete[] t_issue;
+}
+
+/* Sender thread, duplex mode: batch whatever stdin has into write
+ * requests of up to SEND_MAX bytes. The header goes in front of the
+ * payload so each batch is a single OUT transfer.
+ */
+static void send_input(transport *trans){
+  byte *buf = new byte[PROTO_HDR_MAX + SEND_MAX];
+  byte *payload = buf + PROTO_HDR_MAX;
+  bool eof = false;
+
+  while(!stop_requested && !send_stop && !eof){
+    struct pollfd pfd = { 0, POLLIN, 0 };
+    if(poll(&pfd, 1, 100) <= 0){
+      continue;
+    }
+    size_t n = 0;
+    while(n < SEND_MAX){
+      ssize_t got = read(0, payload + n, SEND_MAX - n);
+      if(got <= 0){
+        eof = got == 0 || errno != EINTR;
+        break;
+      }
+      n += got;
+      if(poll(&pfd, 1, 0) <= 0){
+        break;
+      }
+    }
+    if(n == 0){
+      continue;
+    }
+    int n_hdr = proto_encode_write(payload - PROTO_HDR_MAX, n);
+    if(!trans->io(payload - n_hdr, n_hdr + n, NULL, 0, false)){
+      transfer_error(trans, "send failed");
+      break;
+    }
+    bytes_sent += n;
+  }
+  delete[] buf;
+}
+
+/* Writer thread: drain one ring to fd, or to sink if there is one,
+ * decoding it unless the output format is raw.
+ */
+static void write_output(chunk_ring *ring, int fd, direct_sink *sink, tel_thread *t){
+  ts_decoder *dec = out_format != FORMAT_RAW ? new ts_decoder(out_format) : NULL;
+  cal_table *table = NULL;
+  uint64_t *counts = NULL;
+  uint64_t t_merge = 0;
+  if(calib != NULL){
+    table = new cal_table;
+    table->gen = -1;
+    counts = new uint64_t[CAL_CODES]();
+    dec->set_calibration(table, counts);
+  }
+
+  chunk *c;
+  while((c = ring->peek()) != NULL){
+    const byte *out = c->data;
+    size_t len = c->len;
+    if(table != NULL){
+      calib->update(table);
+    }
+    if(dec != NULL){
+      len = dec->decode(c->data, c->len, &out);
+    }
+    uint64_t t_write = now_ns();
+    if(sink != NULL ? !sink->write(out, len) : !write_all(fd, out, len)){
+      ring->stop();
+      break;
+    }
+    t->record(TEL_WRITE, now_ns() - t_write);
+    t->count(len);
+    ring->release();
+    if(counts != NULL && now_ns() >= t_merge){
+      calib->merge(counts);
+      memset(counts, 0, CAL_CODES * sizeof(uint64_t));
+      t_merge = now_ns() + HIST_MERGE_NS;
+    }
+  }
+  if(counts != NULL){
+    calib->merge(counts);
+    delete[] counts;
+    delete table;
+  }
+  if(dec != NULL){
+    report_partial(dec);
+    delete dec;
+  }
+}
+
+/* Writer thread, raw output to a pipe: gift the whole pages of every
+ * chunk to it with vmsplice rather than copy them with write(), and
+ * write() the rest. ring maps every slot on its own; a slot that was
+ * gifted gets fresh pages before it goes back to the reader, so the
+ * pipe, and whoever it splices the data on to, keeps the old ones for
+ * itself. Falls back to write_output() if the kernel refuses.
+ */
+static void write_gifted(chunk_ring *ring, int fd, tel_thread *t){
+  size_t page = sysconf(_SC_PAGESIZE);
+  bool gifted = false;
+  bool ok = true;
+
+  fcntl(fd, F_SETPIPE_SZ, SPLICE_PIPE_BYTES);
+  chunk *c;
+  while((c = ring->peek()) != NULL){
+    uint64_t t_write = now_ns();
+    size_t whole = c->len & ~(page - 1);
+    size_t done = 0;
+    while(done < whole){
+      struct iovec iov = { c->data + done, whole - done };
+      ssize_t n = vmsplice(fd, &iov, 1, SPLICE_F_GIFT);
+      if(n < 0 && errno == EINTR){
+        continue;
+      }
+      if(n < 0 && !gifted && done == 0 && (errno == EINVAL || errno == ENOSYS)){
+        fprintf(stderr, "WARNING: vmsplice not available, writing the output\n");
+        write_output(ring, fd, NULL, t);
+        return;
+      }
+      if(n < 0){
+        ok = false;
+        break;
+      }
+      done += n;
+      gifted = true;
+    }
+    ok = ok && write_all(fd, c->data + whole, c->len - whole);
+    if(ok && whole > 0 && !ring->renew(c)){
+      fprintf(stderr, "ERROR: failed to replace a gifted buffer\n");
+      ok = false;
+    }
+    if(!ok){
+      ring->stop();
+      break;
+    }
+    t->record(TEL_WRITE, now_ns() - t_write);
+    t->count(c->len);
+    ring->release();
+  }
+}
+
+/* Writer thread, trigger mode: write the windows trig cuts from one
+ * ring to fd, or to sink if there is one.
+ */
+static void write_triggered(chunk_ring *ring, int fd, direct_sink *sink, tel_thread *t){
+  bool ok = true;
+  chunk *c;
+  while(ok && (c = ring->peek()) != NULL){
+    const byte *out;
+    size_t len = trig->feed(c->data, c->len, c->t_ns, &out);
+    if(len > 0){
+      uint64_t t_write = now_ns();
+      ok = sink != NULL ? sink->write(out, len) : write_all(fd, out, len);
+      t->record(TEL_WRITE, now_ns() - t_write);
+      t->count(len);
+    }
+    ring->release();
+  }
+  if(ok){
+    const byte *out;
+    size_t len = trig->flush(&out);
+    ok = sink != NULL ? sink->write(out, len) : write_all(fd, out, len);
+  }
+  if(!ok){
+    ring->stop();
+  }
+}
+
+/* Writer thread, compressed output: hand one ring's chunks to zw.
+ */
+static void write_compressed(chunk_ring *ring, z_writer *zw, tel_thread *t){
+  chunk *c;
+  while((c = ring->peek()) != NULL){
+    uint64_t t_write = now_ns();
+    if(!zw->write(c->data, c->len)){
+      ring->stop();
+      break;
+    }
+    t->record(TEL_WRITE, now_ns() - t_write);
+    t->count(c->len);
+    ring->release();
+  }
+}
+
+/* Writer thread, shared memory: publish one ring's chunks.
+ */
+static void write_shm(chunk_ring *ring, shm_writer *shm, tel_thread *t){
+  chunk *c;
+  while((c = ring->peek()) != NULL){
+    uint64_t t_write = now_ns();
+    shm->publish(c->data, c->len);
+    t->record(TEL_WRITE, now_ns() - t_write);
+    t->count(c->len);
+    ring->release();
+  }
+}
+
+/* Writer thread, capture file: store one ring's chunks with their
+ * arrival times.
+ */
+static void write_capture(chunk_ring *ring, cap_writer *cap, tel_thread *t){
+  chunk *c;
+  while((c = ring->peek()) != NULL){
+    uint64_t t_write = now_ns();
+    if(!cap->append(c->data, c->len, c->t_ns)){
+      fprintf(stderr, "ERROR: cannot write %s: %s\n", capture_path, strerror(errno));
+      ring->stop();
+      break;
+    }
+    t->record(TEL_WRITE, now_ns() - t_write);
+    t->count(c->len);
+    ring->release();
+  }
+}
+
+/* Writer thread, histogram mode: bin one ring's words.
+ */
+static void write_histogram(chunk_ring *ring){
+  hist_thread h(hists);
+  ts_decoder dec(FORMAT_BIN);
+  chunk *c;
+  while((c = ring->peek()) != NULL){
+    const byte *out;
+    size_t len = dec.decode(c->data, c->len, &out);
+    h.add((const ts_fields *)out, len / sizeof(ts_fields));
+    ring->release();
+  }
+  report_partial(&dec);
+}
+
+/* Write a histogram snapshot to fd, returns false if it went away.
+ */
+static bool dump_histogram(int fd, uint64_t t_start){
+  std::string s = hists->snapshot((now_ns() - t_start) / 1e9);
+  return write_all(fd, (const byte *)s.data(), s.size());
+}
+
+/* Writer thread, several sources on one output: take chunks from the
+ * rings as they become ready and frame each with a stripe_header.
+ */
+static void write_striped(std::vector<source *> *sources, int fd, tel_thread *t){
+  size_t n_open = sources->size();
+  std::vector<bool> open(n_open, true);
+  bool ok = true;
+  int spins = 0;
+
+  while(n_open > 0 && ok){
+    bool busy = false;
+    for(size_t i = 0; i < sources->size() && ok; i++){
+      source *src = (*sources)[i];
+      if(!open[i]){
+        continue;
+      }
+      chunk *c = src->ring->try_peek();
+      if(c == NULL){
+        if(src->ring->finished()){
+          open[i] = false;
+          n_open--;
+        }
+        continue;
+      }
+      busy = true;
+      if(c->len == 0){
+        src->ring->release();
+        continue;
+      }
+
+      stripe_header hdr;
+      hdr.magic = STRIPE_MAGIC;
+      hdr.source = src->id;
+      hdr.reserved = 0;
+      hdr.length = c->len;
+      hdr.seq = src->seq++;
+      struct iovec iov[2] = {
+        { &hdr, sizeof(hdr) },
+        { c->data, c->len },
+      };
+      uint64_t t_write = now_ns();
+      ssize_t n = writev(fd, iov, 2);
+      if(n < 0){
+        ok = false;
+      }
+      else if((size_t)n < sizeof(hdr) + c->len){
+        /* Short write, finish it the slow way.
+         */
+        size_t done = n;
+        if(done < sizeof(hdr)){
+          ok = write_all(fd, (byte *)&hdr + done, sizeof(hdr) - done);
+          done = sizeof(hdr);
+        }
+        ok = ok && write_all(fd, c->data + (done - sizeof(hdr)), c->len - (done - sizeof(hdr)));
+      }
+      t->record(TEL_WRITE, now_ns() - t_write);
+      t->count(sizeof(hdr) + c->len);
+      src->ring->release();
+    }
+    if(busy){
+      spins = 0;
+    }
+    else{
+      ring_backoff(spins);
+    }
+  }
+
+  if(!ok){
+    for(size_t i = 0; i < sources->size(); i++){
+      (*sources)[i]->ring->stop();
+    }
+  }
+}
+
+/* Writer threads still running. run_capture() keeps up the periodic
+ * dumps until this drops to zero, since the writers may take a while to
+ * drain the rings after the readers are done.
+ */
+static int writers_running = 0;
+static std::mutex writers_mtx;
+static std::condition_variable writers_cv;
+
+template<class F, class... A>
+static void run_writer(F f, A... args){
+  std::bind(f, args...)();
+  std::lock_guard<std::mutex> lock(writers_mtx);
+  writers_running--;
+  writers_cv.notify_all();
+}
+
+/* std::thread(f, args...), counted in writers_running.
+ */
+template<class F, class... A>
+static std::thread start_writer(F f, A... args){
+  std::lock_guard<std::mutex> lock(writers_mtx);
+  writers_running++;
+  return std::thread(run_writer<F, A...>, f, args...);
+}
+
+int run_capture(std::vector<source *> &sources, int out_fd){
+  int status = 0;
+  std::vector<int> split_fds;
+
+  if(ring_slots <= queue_depth){
+    ring_slots = 2 * queue_depth;
+  }
+  uint32_t slot_bytes = tune_max > (uint32_t)n_bytes ? tune_max : n_bytes;
+  transfer_failed = false;
+  bytes_sent = 0;
+  send_stop = false;
+
+  /* Gifting needs every slot mapped on its own, so it is settled before
+   * the rings are made; it only serves the plain raw stream to a pipe.
+   */
+  struct stat out_st;
+  bool gift = zero_copy && out_format == FORMAT_RAW && !framed && !histogram_mode &&
+    sources.size() == 1 && listen_addr == NULL && split_pattern == NULL && sinks == NULL &&
+    shm_name == NULL && capture_path == NULL && trig == NULL && compress_mode < 0 &&
+    direct_path == NULL && fstat(out_fd, &out_st) == 0 && S_ISFIFO(out_st.st_mode);
+
+  tel = new telemetry;
+  for(size_t i = 0; i < sources.size(); i++){
+    sources[i]->ring = NULL;
+    sources[i]->tuner = NULL;
+    sources[i]->tel = tel->add("reader %i", sources[i]->id);
+    sources[i]->bytes_read = 0;
+    sources[i]->cpu = reader_cpus.empty() ? -1 : reader_cpus[i % reader_cpus.size()];
+  }
+  for(size_t i = 0; i < sources.size() && status == 0; i++){
+    source *src = sources[i];
+    /* chunk_ring is over-aligned, which plain new only honours from C++17.
+     */
+    void *mem = NULL;
+    if(posix_memalign(&mem, alignof(chunk_ring), sizeof(chunk_ring)) != 0){
+      fprintf(stderr, "ERROR: failed to allocate %i buffers\n", ring_slots);
+      status = 5;
+      break;
+    }
+    if(framed){
+      src->ring = new (mem) chunk_ring(ring_slots, slot_bytes + FRAME_TRAILER_BYTES,
+                                       FRAME_HEADER_BYTES, realtime);
+    }
+    else{
+      src->ring = new (mem) chunk_ring(ring_slots, slot_bytes, 0, realtime, gift);
+    }
+    if(tune_max > 0){
+      src->tuner = new chunk_tuner(tune_min, tune_max, n_bytes, target_rate, target_lat_us);
+    }
+    src->bytes_requested = 0;
+    src->seq = 0;
+    src->frame_seq = 0;
+    src->bad_frames = 0;
+    src->missing_frames = 0;
+    src->stale_frames = 0;
+    src->bad_run = 0;
+    src->done = false;
+    if(!src->ring->ok()){
+      fprintf(stderr, "ERROR: failed to allocate %i buffers\n", ring_slots);
+      status = 5;
+    }
+    if(split_pattern != NULL && status == 0){
+      char path[4096];
+      snprintf(path, sizeof(path), split_pattern, src->id);
+      int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if(fd < 0){
+        fprintf(stderr, "ERROR: cannot create %s: %s\n", path, strerror(errno));
+        status = 6;
+      }
+      split_fds.push_back(fd);
+    }
+  }
+
+  bool locked_all = false;
+  if(status == 0 && realtime){
+    static const char *page_kinds[] = { "normal pages", "transparent huge pages",
+                                        "huge pages", "separately mapped pages" };
+    uint64_t ring_bytes = 0;
+    locked_all = rt_lock_all();
+    bool locked = true;
+    for(size_t i = 0; i < sources.size(); i++){
+      ring_bytes += sources[i]->ring->memory_bytes();
+      if(!locked_all){
+        locked = sources[i]->ring->memory() != NULL &&
+          rt_lock(sources[i]->ring->memory(), sources[i]->ring->memory_bytes()) && locked;
+      }
+    }
+    fprintf(stderr, "Realtime: %.1f MB of buffers in %s%s\n", ring_bytes / (1024.0 * 1024.0),
+            page_kinds[sources[0]->ring->page_kind()], locked ? ", locked" : "");
+  }
+
+  if(status == 0 && calibrate){
+    calib = new fine_calibrator;
+  }
+
+  cap_writer *cap = NULL;
+  if(status == 0 && capture_path != NULL){
+    cap = new cap_writer;
+    if(!cap->open(capture_path, slot_bytes)){
+      fprintf(stderr, "ERROR: cannot create %s: %s\n", capture_path, strerror(errno));
+      status = 6;
+    }
+  }
+  direct_sink *sink = NULL;
+  if(status == 0 && direct_path != NULL){
+    sink = new direct_sink;
+    if(!sink->open(direct_path)){
+      status = 6;
+    }
+  }
+  if(status == 0 && sinks != NULL && !sinks->open()){
+    status = 6;
+  }
+  shm_writer *shm = NULL;
+  if(status == 0 && shm_name != NULL){
+    shm = new shm_writer;
+    if(!shm->open(shm_name, shm_bytes)){
+      status = 6;
+    }
+  }
+
+  /* The writers, and any threads they start, inherit the CPUs this
+   * thread is on when they are created.
+   */
+  cpu_set_t main_cpus;
+  bool pin_writers = status == 0 && !writer_cpus.empty() &&
+    pthread_getaffinity_np(pthread_self(), sizeof(main_cpus), &main_cpus) == 0;
+  if(pin_writers){
+    pin_writers = rt_set_cpus(pthread_self(), writer_cpus, "writers");
+  }
+
+  /* Opening zw starts its pool, so it too goes on the writers' CPUs.
+   */
+  z_writer *zw = NULL;
+  if(status == 0 && compress_mode >= 0){
+    zw = new z_writer;
+    zw->open(out_fd, sink, compress_mode, compress_block, compress_threads);
+  }
+
+  std::vector<std::thread> writers;
+  if(status == 0 && histogram_mode){
+    hists = new hist_set;
+    for(size_t i = 0; i < sources.size(); i++){
+      writers.push_back(start_writer(write_histogram, sources[i]->ring));
+    }
+  }
+  else if(status == 0 && listen_addr != NULL){
+    int listen_fd = server_listen(listen_addr);
+    if(listen_fd < 0){
+      status = 6;
+    }
+    else{
+      fprintf(stderr, "Listening on %s\n", listen_addr);
+      writers.push_back(start_writer(server_run, listen_fd, sources[0]->ring));
+    }
+  }
+  else if(status == 0 && split_pattern != NULL){
+    for(size_t i = 0; i < sources.size(); i++){
+      writers.push_back(start_writer(write_output, sources[i]->ring, split_fds[i],
+                                   (direct_sink *)NULL, tel->add("writer %i", sources[i]->id)));
+    }
+  }
+  else if(status == 0 && sinks != NULL){
+    writers.push_back(start_writer(&fanout::run, sinks, sources[0]->ring, tel));
+  }
+  else if(status == 0 && shm != NULL){
+    writers.push_back(start_writer(write_shm, sources[0]->ring, shm, tel->add("writer", 0)));
+  }
+  else if(status == 0 && cap != NULL){
+    writers.push_back(start_writer(write_capture, sources[0]->ring, cap, tel->add("writer", 0)));
+  }
+  else if(status == 0 && trig != NULL){
+    writers.push_back(start_writer(write_triggered, sources[0]->ring, out_fd, sink,
+                                 tel->add("writer", 0)));
+  }
+  else if(status == 0 && zw != NULL){
+    writers.push_back(start_writer(write_compressed, sources[0]->ring, zw, tel->add("writer", 0)));
+  }
+  else if(status == 0 && sources.size() > 1){
+    writers.push_back(start_writer(write_striped, &sources, out_fd, tel->add("writer", 0)));
+  }
+  else if(status == 0 && gift){
+    writers.push_back(start_writer(write_gifted, sources[0]->ring, out_fd, tel->add("writer", 0)));
+  }
+  else if(status == 0){
+    writers.push_back(start_writer(write_output, sources[0]->ring, out_fd, sink,
+                                 tel->add("writer", 0)));
+  }
+
+  if(pin_writers){
+    pthread_setaffinity_np(pthread_self(), sizeof(main_cpus), &main_cpus);
+  }
+
+  uint64_t t_start = now_ns();
+  std::vector<std::thread> readers;
+  std::thread sender;
+  if(status == 0){
+    for(size_t i = 0; i < sources.size(); i++){
+      if(queue_depth > 0){
+        readers.push_back(std::thread(read_overlapped, sources[i]));
+      }
+      else{
+        readers.push_back(std::thread(read_blocking, sources[i]));
+      }
+    }
+    if(duplex){
+      sender = std::thread(send_input, sources[0]->trans);
+    }
+  }
+
+  uint64_t t_dump = t_start + (uint64_t)(hist_interval * 1e9);
+  uint64_t t_stats = t_start + (uint64_t)(stats_interval * 1e9);
+  bool stats_dumped = false;
+  auto poll_dumps = [&](){
+    bool stats_due = stats_interval > 0 && now_ns() >= t_stats;
+    if(stats_due){
+      t_stats += (uint64_t)(stats_interval * 1e9);
+    }
+    if(stats_due || stats_dump_requested){
+      stats_dump_requested = 0;
+      stats_dumped = true;
+      tel->dump(stderr, (now_ns() - t_start) / 1e9);
+    }
+    if(hists == NULL){
+      return;
+    }
+    bool due = hist_interval > 0 && now_ns() >= t_dump;
+    if(due){
+      t_dump += (uint64_t)(hist_interval * 1e9);
+    }
+    if(due || hist_dump_requested){
+      hist_dump_requested = 0;
+      if(!dump_histogram(out_fd, t_start)){
+        stop_requested = 1;
+      }
+    }
+  };
+
+  /* A read may be waiting on the device indefinitely; cancel it once we
+   * are asked to stop.
+   */
+  for(size_t i = 0; i < readers.size(); i++){
+    while(!sources[i]->done && !stop_requested){
+      struct timespec ts = {0, 50000000};
+      nanosleep(&ts, NULL);
+      poll_dumps();
+    }
+    if(!sources[i]->done){
+      sources[i]->trans->cancel();
+    }
+  }
+  for(size_t i = 0; i < readers.size(); i++){
+    readers[i].join();
+  }
+  send_stop = true;
+  while(true){
+    std::unique_lock<std::mutex> lock(writers_mtx);
+    if(writers_running == 0){
+      break;
+    }
+    writers_cv.wait_for(lock, std::chrono::milliseconds(50));
+    lock.unlock();
+    poll_dumps();
+  }
+  for(size_t i = 0; i < writers.size(); i++){
+    writers[i].join();
+  }
+  if(hists != NULL){
+    dump_histogram(out_fd, t_start);
+    delete hists;
+    hists = NULL;
+  }
+  if(zw != NULL){
+    if(status == 0){
+      zw->close();
+    }
+    delete zw;
+  }
+  if(sink != NULL){
+    if(status == 0){
+      sink->close();
+    }
+    delete sink;
+  }
+  if(sinks != NULL && status == 0){
+    sinks->report(stderr);
+  }
+  delete shm;
+  if(trig != NULL && status == 0){
+    trig->report(stderr);
+  }
+  if(cap != NULL){
+    if(status == 0 && !cap->close()){
+      fprintf(stderr, "ERROR: cannot write %s: %s\n", capture_path, strerror(errno));
+    }
+    delete cap;
+  }
+  if(calib != NULL){
+    if(cal_save_path != NULL && !calib->save(cal_save_path)){
+      fprintf(stderr, "ERROR: cannot write calibration to %s\n", cal_save_path);
+    }
+    delete calib;
+    calib = NULL;
+  }
+  if(sender.joinable()){
+    sender.join();
+  }
+  double elapsed = (now_ns() - t_start) / 1e9;
+  if(status == 0 && (stats_dumped || verbose)){
+    tel->dump(stderr, elapsed);
+  }
+  if(locked_all){
+    rt_unlock_all();
+  }
+  if(status == 0 && realtime){
+    for(size_t i = 0; i < sources.size(); i++){
+      fprintf(stderr, "Reader %i: worst loop jitter %.1f us\n", sources[i]->id,
+              sources[i]->tel->max_ns(TEL_LOOP) / 1e3);
+    }
+  }
+  delete tel;
+  tel = NULL;
+
+  uint64_t bytes_read = 0;
+  for(size_t i = 0; i < sources.size(); i++){
+    source *src = sources[i];
+    bytes_read += src->bytes_read;
+    if(status == 0 && sources.size() > 1){
+      fprintf(stderr, "Source %i (%s port %i): %llu bytes, %.3f MB/s\n",
+              src->id, src->name, src->port, (unsigned long long)src->bytes_read,
+              elapsed > 0 ? src->bytes_read / elapsed / (1024.0 * 1024.0) : 0.0);
+    }
+  }
+  if(status == 0){
+    fprintf(stderr, "Read %llu bytes in %.3f s, %.3f MB/s\n",
+            (unsigned long long)bytes_read, elapsed,
+            elapsed > 0 ? bytes_read / elapsed / (1024.0 * 1024.0) : 0.0);
+    if(duplex){
+      fprintf(stderr, "Sent %llu bytes from stdin\n", (unsigned long long)bytes_sent);
+    }
+  }
+
+  for(size_t i = 0; i < sources.size(); i++){
+    source *src = sources[i];
+    if(src->ring == NULL){
+      continue;
+    }
+    if(framed && status == 0){
+      fprintf(stderr, "Source %i: %llu bad frames, %llu missing, %llu repeated\n", src->id,
+              (unsigned long long)src->bad_frames, (unsigned long long)src->missing_frames,
+              (unsigned long long)src->stale_frames);
+    }
+    if(src->ring->producer_waits() > 0){
+      fprintf(stderr, "Reader %i waited on a full buffer ring %zu times\n",
+              src->id, src->ring->producer_waits());
+    }
+    if(src->tuner != NULL){
+      if(sources.size() > 1){
+        fprintf(stderr, "Source %i: ", src->id);
+      }
+      src->tuner->report(stderr);
+      delete src->tuner;
+      src->tuner = NULL;
+    }
+    src->ring->~chunk_ring();
+    free(src->ring);
+    src->ring = NULL;
+  }
+  for(size_t i = 0; i < split_fds.size(); i++){
+    if(split_fds[i] >= 0){
+      close(split_fds[i]);
+    }
+  }
+
+  if(status == 0 && stop_requested){
+    status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,137 @@
+/* capture.h -- the capture engine: device readers, output writers and
+ * the settings they share.
+ *
+ * A capture reads one or more sources, each an open device with its port
+ * enabled. Every source has its own reader thread and ring of chunk
+ * buffers. With one source the stream goes to the output unchanged, or
+ * decoded as set by out_format; with several the chunks are either
+ * interleaved on the output with a stripe_header in front of each
+ * (stripe.h) or, with split_pattern set, written (or decoded) to one
+ * file per source. In histogram mode only snapshots of the merged
+ * histograms of all sources are written (histogram.h), and with
+ * capture_path set a single source goes to a capture file (capfile.h)
+ * or, with sinks, to several outputs at once (fanout.h), or into a
+ * shared-memory ring (shmring.h). With a trigger only the windows of a
+ * single source around its events are written (trigger.h). A single
+ * source may also be compressed on the way out (compress.h). Realtime
+ * mode prepares the buffers and threads for a loaded host (realtime.h).
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <signal.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+#include "transport.h"
+#include "ring.h"
+#include "tuner.h"
+#include "decode.h"
+#include "telemetry.h"
+#include "fanout.h"
+#include "trigger.h"
+
+/* Settings, filled in from the command line before run_capture().
+ */
+extern int queue_depth;
+extern int ring_slots;
+extern int proto;
+extern int n_bytes;
+extern uint32_t tune_min;
+extern uint32_t tune_max;
+extern double target_rate;
+extern double target_lat_us;
+extern bool duplex;
+extern const char *listen_addr;
+extern uint64_t byte_limit;
+extern const char *split_pattern;
+extern bool framed;
+extern int out_format;
+extern bool histogram_mode;
+extern double hist_interval;
+extern bool calibrate;
+extern const char *cal_save_path;
+extern const char *capture_path;
+extern const char *direct_path;
+extern bool zero_copy;
+extern fanout *sinks;
+extern const char *shm_name;
+extern uint64_t shm_bytes;
+extern trigger *trig;
+extern int compress_mode;
+extern size_t compress_block;
+extern int compress_threads;
+extern bool realtime;
+extern std::vector<int> reader_cpus;
+extern std::vector<int> writer_cpus;
+extern int rt_priority;
+extern int verbose;
+extern double stats_interval;
+
+/* stop_requested ends the current capture; interrupted is only set by
+ * Ctrl-C and also ends the daemon.
+ */
+extern volatile sig_atomic_t stop_requested;
+extern volatile sig_atomic_t interrupted;
+extern std::atomic<bool> transfer_failed;
+
+/* Set from a signal handler to have histogram mode write a snapshot.
+ */
+extern volatile sig_atomic_t hist_dump_requested;
+
+/* Set from a signal handler to write the telemetry to stderr.
+ */
+extern volatile sig_atomic_t stats_dump_requested;
+
+struct source {
+  int id;
+  char name[256];
+  int port;
+  transport *trans;
+
+  /* Owned by run_capture() for the length of the capture.
+   */
+  chunk_ring *ring;
+  chunk_tuner *tuner;
+  tel_thread *tel;
+  uint64_t bytes_read;
+  uint64_t bytes_requested;
+  uint32_t seq;
+  std::atomic<bool> done;
+
+  /* Framed transport: the next expected sequence number, the frames that
+   * failed their checks or never arrived, and those that came again or
+   * out of order behind a later one.
+   */
+  uint32_t frame_seq;
+  uint64_t bad_frames;
+  uint64_t missing_frames;
+  uint64_t stale_frames;
+  uint32_t bad_run;         // bad frames since the last good one
+
+  /* Realtime mode: the CPU the reader pins itself to, -1 for none.
+   */
+  int cpu;
+};
+
+/* Open dev_name and enable port, reporting progress on stderr. Returns
+ * NULL with *status set to the exit status on failure.
+ */
+transport *open_device(const char *dev_name, int port, int *status);
+
+/* Read the sources into out_fd until stopped, the byte limit is reached
+ * (per source) or the output goes away. Returns the exit status.
+ */
+int run_capture(std::vector<source *> &sources, int out_fd);
+
+/* Warn about the bytes dec is still holding back at the end of a stream.
+ */
+void report_partial(const ts_decoder *dec);
+
+/* Write all of buf to fd, returns false if the output went away.
+ */
+bool write_all(int fd, const byte *buf, size_t len);
+
+#endif
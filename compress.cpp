@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "capture.h"
+#include "crc32c.h"
+#include "lzblock.h"
+#include "timestamp.h"
+#include "util.h"
+
+enum {
+  Z_SLOT_FREE,
+  Z_SLOT_QUEUED,
+  Z_SLOT_DONE,
+};
+
+int parse_compress_mode(const char *s){
+  if(strcmp(s, "lz4") == 0){
+    return Z_MODE_LZ4;
+  }
+  if(strcmp(s, "delta") == 0){
+    return Z_MODE_DELTA;
+  }
+  return -1;
+}
+
+static int default_threads(int n_threads){
+  if(n_threads > 0){
+    return n_threads;
+  }
+  n_threads = std::thread::hardware_concurrency();
+  return n_threads > 0 ? n_threads : 1;
+}
+
+/* The delta filter: the differences between consecutive words, byte k
+ * of every difference in plane k. A partial word at the end is kept as
+ * it is.
+ */
+static void delta_encode(const byte *in, size_t n, byte *out){
+  size_t n_words = n / W_BYTES;
+  uint64_t prev = 0;
+  for(size_t i = 0; i < n_words; i++){
+    uint64_t w = 0;
+    for(int k = 0; k < W_BYTES; k++){
+      w |= (uint64_t)in[i * W_BYTES + k] << (8 * k);
+    }
+    uint64_t d = w - prev;
+    prev = w;
+    for(int k = 0; k < W_BYTES; k++){
+      out[k * n_words + i] = d >> (8 * k);
+    }
+  }
+  memcpy(out + n_words * W_BYTES, in + n_words * W_BYTES, n - n_words * W_BYTES);
+}
+
+static void delta_decode(const byte *in, size_t n, byte *out){
+  size_t n_words = n / W_BYTES;
+  uint64_t prev = 0;
+  for(size_t i = 0; i < n_words; i++){
+    uint64_t d = 0;
+    for(int k = 0; k < W_BYTES; k++){
+      d |= (uint64_t)in[k * n_words + i] << (8 * k);
+    }
+    prev += d;
+    for(int k = 0; k < W_BYTES; k++){
+      out[i * W_BYTES + k] = prev >> (8 * k);
+    }
+  }
+  memcpy(out + n_words * W_BYTES, in + n_words * W_BYTES, n - n_words * W_BYTES);
+}
+
+/* Read up to len bytes, fewer only at the end of the input.
+ */
+static size_t read_all(int fd, void *buf, size_t len){
+  size_t done = 0;
+  while(done < len){
+    ssize_t n = read(fd, (byte *)buf + done, len - done);
+    if(n < 0 && errno == EINTR){
+      continue;
+    }
+    if(n <= 0){
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+z_pool::z_pool(int n_threads, size_t block_bytes, bool decode, int mode) :
+  decode(decode), mode(mode), stopping(false) {
+  /* Two blocks per worker: one being worked on while the other waits to
+   * be written, or filled.
+   */
+  for(int i = 0; i < 2 * n_threads + 2; i++){
+    z_slot *s = new z_slot;
+    s->raw.resize(block_bytes);
+    s->tmp.resize(block_bytes);
+    s->comp.resize(block_bytes);
+    s->ok = false;
+    s->state = Z_SLOT_FREE;
+    slots.push_back(s);
+  }
+  for(int i = 0; i < n_threads; i++){
+    threads.push_back(std::thread(&z_pool::run, this));
+  }
+}
+
+z_pool::~z_pool(){
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopping = true;
+  }
+  work_cv.notify_all();
+  for(size_t i = 0; i < threads.size(); i++){
+    threads[i].join();
+  }
+  for(size_t i = 0; i < slots.size(); i++){
+    delete slots[i];
+  }
+}
+
+void z_pool::submit(z_slot *s){
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    s->state = Z_SLOT_QUEUED;
+    queue.push_back(s);
+  }
+  work_cv.notify_one();
+}
+
+bool z_pool::done(z_slot *s) const {
+  return s->state.load(std::memory_order_acquire) == Z_SLOT_DONE;
+}
+
+void z_pool::wait(z_slot *s){
+  std::unique_lock<std::mutex> lock(mtx);
+  while(s->state != Z_SLOT_DONE){
+    done_cv.wait(lock);
+  }
+}
+
+void z_pool::run(){
+  while(true){
+    z_slot *s;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      while(!stopping && queue.empty()){
+        work_cv.wait(lock);
+      }
+      if(queue.empty()){
+        return;
+      }
+      s = queue.front();
+      queue.pop_front();
+    }
+    if(decode){
+      decompress(s);
+    }
+    else{
+      compress(s);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      s->state.store(Z_SLOT_DONE, std::memory_order_release);
+    }
+    done_cv.notify_all();
+  }
+}
+
+void z_pool::compress(z_slot *s){
+  size_t n = s->hdr.raw_len;
+  const byte *src = s->raw.data();
+  s->hdr.flags = 0;
+  if(mode == Z_MODE_DELTA){
+    delta_encode(src, n, s->tmp.data());
+    src = s->tmp.data();
+    s->hdr.flags = Z_DELTA;
+  }
+  s->hdr.crc = crc32c(0, s->raw.data(), n);
+
+  /* Anything that does not come out smaller is stored.
+   */
+  size_t len = n > 1 ? lz_compress(src, n, s->comp.data(), n - 1) : 0;
+  if(len == 0){
+    s->hdr.flags = Z_STORED;
+    len = n;
+  }
+  s->hdr.comp_len = len;
+}
+
+void z_pool::decompress(z_slot *s){
+  size_t n = s->hdr.raw_len;
+  if(s->hdr.flags & Z_STORED){
+    s->ok = s->hdr.comp_len == n;
+    memcpy(s->raw.data(), s->comp.data(), n);
+  }
+  else if(s->hdr.flags & Z_DELTA){
+    s->ok = lz_decompress(s->comp.data(), s->hdr.comp_len, s->tmp.data(), n);
+    delta_decode(s->tmp.data(), n, s->raw.data());
+  }
+  else{
+    s->ok = lz_decompress(s->comp.data(), s->hdr.comp_len, s->raw.data(), n);
+  }
+  s->ok = s->ok && crc32c(0, s->raw.data(), n) == s->hdr.crc;
+}
+
+z_writer::z_writer() :
+  fd(-1), sink(NULL), pool(NULL), n_threads(0), block_bytes(0), cur(NULL), fill(0),
+  n_submitted(0), n_written(0), offset(0), pos(0), ok(true), t_open(0) {
+}
+
+z_writer::~z_writer(){
+  delete pool;
+}
+
+void z_writer::open(int fd, direct_sink *sink, int mode, size_t block_bytes, int n_threads){
+  this->fd = fd;
+  this->sink = sink;
+  this->block_bytes = block_bytes;
+  this->n_threads = default_threads(n_threads);
+  pool = new z_pool(this->n_threads, block_bytes, false, mode);
+  t_open = now_ns();
+
+  z_file_header hdr;
+  hdr.magic = Z_MAGIC;
+  hdr.version = Z_VERSION;
+  hdr.block_bytes = block_bytes;
+  hdr.mode = mode;
+  emit(&hdr, sizeof(hdr));
+}
+
+bool z_writer::emit(const void *data, size_t len){
+  if(ok){
+    ok = sink != NULL ? sink->write((const byte *)data, len) :
+      write_all(fd, (const byte *)data, len);
+    pos += len;
+  }
+  return ok;
+}
+
+void z_writer::submit_current(){
+  cur->hdr.magic = Z_BLOCK_MAGIC;
+  cur->hdr.raw_len = fill;
+  cur->hdr.reserved = 0;
+  cur->hdr.offset = offset;
+  offset += fill;
+  pool->submit(cur);
+  n_submitted++;
+  cur = NULL;
+}
+
+/* Write the oldest block, waiting for its worker if need be.
+ */
+bool z_writer::write_oldest(){
+  z_slot *s = pool->slot(n_written);
+  pool->wait(s);
+  z_index e;
+  e.pos = pos;
+  e.offset = s->hdr.offset;
+  index.push_back(e);
+  emit(&s->hdr, sizeof(s->hdr));
+  emit(s->hdr.flags & Z_STORED ? s->raw.data() : s->comp.data(), s->hdr.comp_len);
+  s->state = Z_SLOT_FREE;
+  n_written++;
+  return ok;
+}
+
+bool z_writer::write(const byte *data, size_t len){
+  while(len > 0 && ok){
+    if(cur == NULL){
+      if(n_submitted - n_written == pool->size() && !write_oldest()){
+        break;
+      }
+      cur = pool->slot(n_submitted);
+      fill = 0;
+    }
+    size_t n = block_bytes - fill < len ? block_bytes - fill : len;
+    memcpy(cur->raw.data() + fill, data, n);
+    fill += n;
+    data += n;
+    len -= n;
+    if(fill == block_bytes){
+      submit_current();
+    }
+  }
+
+  /* Keep the output busy with whatever is ready, in order.
+   */
+  while(ok && n_written < n_submitted && pool->done(pool->slot(n_written))){
+    write_oldest();
+  }
+  return ok;
+}
+
+bool z_writer::close(){
+  if(cur != NULL && fill > 0){
+    submit_current();
+  }
+  while(ok && n_written < n_submitted){
+    write_oldest();
+  }
+
+  uint64_t index_pos = pos;
+  z_index_header ih;
+  ih.magic = Z_INDEX_MAGIC;
+  ih.reserved = 0;
+  ih.n_blocks = index.size();
+  emit(&ih, sizeof(ih));
+  if(!index.empty()){
+    emit(index.data(), index.size() * sizeof(z_index));
+  }
+  z_trailer tr;
+  tr.magic = Z_TRAILER_MAGIC;
+  tr.reserved = 0;
+  tr.index_pos = index_pos;
+  emit(&tr, sizeof(tr));
+
+  double elapsed = (now_ns() - t_open) / 1e9;
+  fprintf(stderr, "Compressed %llu bytes to %llu (%.1f%%) in %llu blocks with %i threads, "
+          "%.3f MB/s\n", (unsigned long long)offset, (unsigned long long)pos,
+          offset > 0 ? 100.0 * pos / offset : 0.0, (unsigned long long)n_written, n_threads,
+          elapsed > 0 ? offset / elapsed / (1024.0 * 1024.0) : 0.0);
+  return ok;
+}
+
+int z_decompress(const char *path, int out_fd, int n_threads){
+  int fd = strcmp(path, "-") == 0 ? 0 : open(path, O_RDONLY);
+  if(fd < 0){
+    fprintf(stderr, "ERROR: cannot open %s: %s\n", path, strerror(errno));
+    return 2;
+  }
+  z_file_header fh;
+  if(read_all(fd, &fh, sizeof(fh)) != sizeof(fh) || fh.magic != Z_MAGIC ||
+     fh.version != Z_VERSION || fh.block_bytes == 0 || fh.block_bytes > Z_MAX_BLOCK_BYTES){
+    fprintf(stderr, "ERROR: %s is not a dpticat compressed file\n", path);
+    if(fd != 0){
+      close(fd);
+    }
+    return 1;
+  }
+
+  z_pool pool(default_threads(n_threads), fh.block_bytes, true, fh.mode);
+  uint64_t n_submitted = 0;
+  uint64_t n_written = 0;
+  uint64_t bytes = 0;
+  int status = 0;
+
+  /* Write out the oldest block once its worker is done with it.
+   */
+  auto write_oldest = [&](){
+    z_slot *s = pool.slot(n_written);
+    pool.wait(s);
+    if(status == 0 && !s->ok){
+      fprintf(stderr, "ERROR: block %llu (stream offset %llu) of %s is corrupt\n",
+              (unsigned long long)n_written, (unsigned long long)s->hdr.offset, path);
+      status = 1;
+    }
+    if(status == 0){
+      if(write_all(out_fd, s->raw.data(), s->hdr.raw_len)){
+        bytes += s->hdr.raw_len;
+      }
+      else{
+        status = 1;
+      }
+    }
+    s->state = Z_SLOT_FREE;
+    n_written++;
+  };
+
+  bool complete = false;
+  while(status == 0 && !stop_requested){
+    z_block_header bh;
+    size_t got = read_all(fd, &bh, sizeof(bh));
+    if(got >= sizeof(uint32_t) && bh.magic == Z_INDEX_MAGIC){
+      complete = true;
+      break;
+    }
+    if(got < sizeof(bh)){
+      break;
+    }
+    if(bh.magic != Z_BLOCK_MAGIC || bh.raw_len > fh.block_bytes || bh.comp_len > bh.raw_len){
+      fprintf(stderr, "ERROR: block %llu of %s has a bad header\n",
+              (unsigned long long)n_submitted, path);
+      status = 1;
+      break;
+    }
+    if(n_submitted - n_written == pool.size()){
+      write_oldest();
+    }
+    z_slot *s = pool.slot(n_submitted);
+    s->hdr = bh;
+    if(read_all(fd, s->comp.data(), bh.comp_len) != bh.comp_len){
+      break;
+    }
+    pool.submit(s);
+    n_submitted++;
+    while(status == 0 && n_written < n_submitted && pool.done(pool.slot(n_written))){
+      write_oldest();
+    }
+  }
+  while(n_written < n_submitted){
+    write_oldest();
+  }
+  if(fd != 0){
+    close(fd);
+  }
+
+  if(status == 0 && !complete && !stop_requested){
+    fprintf(stderr, "WARNING: %s ends after block %llu, without an index\n",
+            path, (unsigned long long)n_written);
+  }
+  fprintf(stderr, "Decompressed %llu bytes from %llu blocks\n",
+          (unsigned long long)bytes, (unsigned long long)n_written);
+  return status;
+}
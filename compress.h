@@ -0,0 +1,188 @@
+/* compress.h -- parallel block compression of the output.
+ *
+ * dpticat -Z MODE cuts the stream into independent blocks of
+ * block_bytes, compresses them on a pool of worker threads
+ * (lzblock.h) and writes them in order, each behind a z_block_header:
+ *
+ *   z_file_header
+ *   z_block_header, payload     one per block
+ *   ...
+ *   z_index_header, z_index     one entry per block
+ *   z_trailer                   the file offset of the index
+ *
+ * MODE lz4 compresses the bytes as they are. MODE delta first replaces
+ * every W_BYTES word of the block by its difference to the previous
+ * one and groups the bytes of those differences by significance, which
+ * turns the timestamp stream's slowly increasing words into long runs
+ * of zero bytes. A block that does not get smaller is stored as it is.
+ *
+ * Blocks depend on nothing before them, so they decode in parallel,
+ * and the index at the end lets a reader seek to any stream offset
+ * without reading what comes before. dpticat --decompress FILE decodes
+ * a file with the same pool; it reads the blocks in sequence, so it also
+ * takes a file that was cut short or still being written.
+ *
+ * All fields are little-endian (host order on every platform dpticat
+ * runs on).
+ */
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "transport.h"
+#include "disksink.h"
+
+#define Z_MAGIC 0x5a545044u         // "DPTZ"
+#define Z_BLOCK_MAGIC 0x4b425a44u   // "DZBK"
+#define Z_INDEX_MAGIC 0x58495a44u   // "DZIX"
+#define Z_TRAILER_MAGIC 0x52545a44u // "DZTR"
+#define Z_VERSION 1
+
+#define Z_DEFAULT_BLOCK_BYTES (1 << 20)
+#define Z_MAX_BLOCK_BYTES (64 << 20)
+
+enum {
+  Z_MODE_LZ4,
+  Z_MODE_DELTA,
+};
+
+/* z_block_header flags.
+ */
+#define Z_STORED 1    // the payload is the block itself
+#define Z_DELTA 2     // compressed after the delta filter
+
+struct z_file_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_bytes;     // every block but the last is this long
+  uint32_t mode;
+};
+
+struct z_block_header {
+  uint32_t magic;
+  uint32_t flags;
+  uint32_t raw_len;
+  uint32_t comp_len;        // payload bytes following the header
+  uint32_t crc;             // CRC-32C of the block's raw bytes
+  uint32_t reserved;
+  uint64_t offset;          // stream offset of its first byte
+};
+
+struct z_index_header {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t n_blocks;
+};
+
+struct z_index {
+  uint64_t pos;             // file offset of the block header
+  uint64_t offset;          // stream offset of the block
+};
+
+struct z_trailer {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t index_pos;
+};
+
+/* Mode named by s, or -1 if there is no such mode.
+ */
+int parse_compress_mode(const char *s);
+
+/* A block on its way through the pool.
+ */
+struct z_slot {
+  z_block_header hdr;
+  std::vector<byte> raw;
+  std::vector<byte> tmp;
+  std::vector<byte> comp;
+  bool ok;                  // decoding: the block checked out
+  std::atomic<int> state;
+};
+
+/* Worker threads that compress, or decompress, the blocks submitted to
+ * them. Blocks go round a fixed set of slots; the caller writes them out
+ * in order, waiting for the oldest when it needs its slot back.
+ */
+class z_pool {
+public:
+  z_pool(int n_threads, size_t block_bytes, bool decode, int mode);
+  ~z_pool();
+
+  size_t size() const { return slots.size(); }
+  z_slot *slot(uint64_t seq) { return slots[seq % slots.size()]; }
+
+  void submit(z_slot *s);
+  bool done(z_slot *s) const;
+  void wait(z_slot *s);
+
+private:
+  void run();
+  void compress(z_slot *s);
+  void decompress(z_slot *s);
+
+  bool decode;
+  int mode;
+  std::vector<z_slot *> slots;
+  std::vector<std::thread> threads;
+  std::mutex mtx;
+  std::condition_variable work_cv;
+  std::condition_variable done_cv;
+  std::deque<z_slot *> queue;
+  bool stopping;
+};
+
+class z_writer {
+public:
+  z_writer();
+  ~z_writer();
+
+  /* Write to fd, or to sink if it is not NULL, with n_threads workers (0
+   * for one per CPU).
+   */
+  void open(int fd, direct_sink *sink, int mode, size_t block_bytes, int n_threads);
+
+  /* Returns false once the output has gone away.
+   */
+  bool write(const byte *data, size_t len);
+
+  /* Write the last block and the index and report the ratio on stderr.
+   */
+  bool close();
+
+private:
+  bool emit(const void *data, size_t len);
+  void submit_current();
+  bool write_oldest();
+
+  int fd;
+  direct_sink *sink;
+  z_pool *pool;
+  int n_threads;
+  size_t block_bytes;
+  z_slot *cur;
+  size_t fill;
+  uint64_t n_submitted;
+  uint64_t n_written;
+  uint64_t offset;          // stream bytes taken
+  uint64_t pos;             // file bytes written
+  std::vector<z_index> index;
+  bool ok;
+  uint64_t t_open;
+};
+
+/* Decode the compressed file path ("-" for stdin) to out_fd with
+ * n_threads workers (0 for one per CPU). Returns the exit status.
+ */
+int z_decompress(const char *path, int out_fd, int n_threads);
+
+#endif
@@ -0,0 +1,67 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42
+#endif
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78u
+
+struct crc32c_table {
+  uint32_t t[256];
+
+  crc32c_table(){
+    for(uint32_t i = 0; i < 256; i++){
+      uint32_t c = i;
+      for(int k = 0; k < 8; k++){
+        c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      }
+      t[i] = c;
+    }
+  }
+};
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len){
+  static const crc32c_table table;
+  const uint8_t *p = (const uint8_t *)buf;
+  crc = ~crc;
+  while(len--){
+    crc = table.t[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len){
+  const uint8_t *p = (const uint8_t *)buf;
+  crc = ~crc;
+#ifdef __x86_64__
+  uint64_t c = crc;
+  while(len >= 8){
+    uint64_t v;
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t)c;
+#endif
+  while(len--){
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return ~crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len){
+#ifdef CRC32C_SSE42
+  static const bool have_sse42 = __builtin_cpu_supports("sse4.2");
+  if(have_sse42){
+    return crc32c_hw(crc, buf, len);
+  }
+#endif
+  return crc32c_sw(crc, buf, len);
+}
@@ -0,0 +1,16 @@
+/* crc32c.h -- CRC-32C (Castagnoli), as used by the framed transport.
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it and a lookup
+ * table otherwise. Chains like zlib's crc32(): start from 0 and pass the
+ * previous result to continue over more data.
+ */
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+#endif
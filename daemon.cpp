@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "daemon.h"
+#include "server.h"
+#include "proto.h"
+
+struct cached_device {
+  transport *t;
+  int n_ports;
+  std::vector<DPRP> props;
+  int enabled;
+};
+
+static std::map<std::string, cached_device> devices;
+
+static void forget_device(const char *name){
+  std::map<std::string, cached_device>::iterator it = devices.find(name);
+  if(it != devices.end()){
+    it->second.t->close();
+    delete it->second.t;
+    devices.erase(it);
+  }
+}
+
+/* Find or open the device and make sure the port is enabled. On failure
+ * fills in the exit status and message for the client.
+ */
+static transport *get_device(const daemon_request &req, int *status, char *msg, size_t n_msg){
+  std::map<std::string, cached_device>::iterator it = devices.find(req.device);
+  if(it == devices.end()){
+    cached_device d;
+    d.t = transport_open(req.device);
+    if(d.t == NULL){
+      *status = 2;
+      snprintf(msg, n_msg, "unable to open device \"%s\"", req.device);
+      return NULL;
+    }
+    /* Nothing is cached until the ports are known, so the next request
+     * tries the device afresh.
+     */
+    if(!d.t->get_port_count(&d.n_ports) || d.n_ports < 0){
+      *status = 2;
+      snprintf(msg, n_msg, "failed to determine the port count of \"%s\", erc = %d",
+               req.device, d.t->last_error());
+      d.t->close();
+      delete d.t;
+      return NULL;
+    }
+    d.props.resize(d.n_ports);
+    for(int i = 0; i < d.n_ports; i++){
+      if(!d.t->get_port_properties(i, &d.props[i])){
+        *status = 3;
+        snprintf(msg, n_msg, "failed to get the properties of port %i, erc = %d",
+                 i, d.t->last_error());
+        d.t->close();
+        delete d.t;
+        return NULL;
+      }
+    }
+    d.enabled = -1;
+    fprintf(stderr, "Opened %s, %i ports\n", req.device, d.n_ports);
+    it = devices.insert(std::make_pair(std::string(req.device), d)).first;
+  }
+
+  cached_device &d = it->second;
+  if(req.port < 0 || req.port >= d.n_ports){
+    *status = 3;
+    snprintf(msg, n_msg, "invalid port %i", req.port);
+    return NULL;
+  }
+  if(d.enabled != req.port){
+    if(d.enabled >= 0){
+      d.t->disable();
+    }
+    d.enabled = -1;
+    if(!d.t->enable(req.port)){
+      *status = 4;
+      snprintf(msg, n_msg, "failed to enable port %i", req.port);
+      return NULL;
+    }
+    d.enabled = req.port;
+    fprintf(stderr, "Enabled %s port %i (%s)\n", req.device, req.port,
+            d.props[req.port] & dprpPtiAsynchronous ? "asynchronous" : "synchronous");
+  }
+  return d.t;
+}
+
+static bool read_line(int fd, char *line, size_t n){
+  size_t len = 0;
+  while(len + 1 < n){
+    ssize_t got = read(fd, line + len, 1);
+    if(got <= 0){
+      return false;
+    }
+    if(line[len] == '\n'){
+      break;
+    }
+    len++;
+  }
+  line[len] = '\0';
+  return true;
+}
+
+static void reply(int fd, const char *s){
+  if(write(fd, s, strlen(s)) < 0){
+  }
+}
+
+static bool parse_request(const char *line, daemon_request *req){
+  unsigned long long count;
+  if(sscanf(line, "DPTICAT 1 %d %d %d %d %llu %255s", &req->port, &req->proto,
+            &req->chunk, &req->queue, &count, req->device) != 6){
+    return false;
+  }
+  req->count = count;
+  return (req->proto == PROTO_V1 || req->proto == PROTO_V2) &&
+    req->chunk > 0 && (uint32_t)req->chunk <= proto_max_request(req->proto) &&
+    req->queue >= 0 && req->queue <= 1024;
+}
+
+void daemon_run(int listen_fd, daemon_session_fn session,
+                const daemon_request *preopen, volatile sig_atomic_t *interrupted){
+  char msg[300];
+  int status;
+
+  if(preopen != NULL && get_device(*preopen, &status, msg, sizeof(msg)) == NULL){
+    fprintf(stderr, "ERROR: %s\n", msg);
+  }
+
+  while(!*interrupted){
+    struct pollfd pfd = { listen_fd, POLLIN, 0 };
+    if(poll(&pfd, 1, 100) <= 0){
+      continue;
+    }
+    int fd = accept(listen_fd, NULL, NULL);
+    if(fd < 0){
+      continue;
+    }
+
+    /* Don't let a client that never sends its request hold us up.
+     */
+    struct timeval tv = { 2, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char line[512];
+    daemon_request req;
+    if(!read_line(fd, line, sizeof(line)) || !parse_request(line, &req)){
+      reply(fd, "ERR 1 malformed request\n");
+      close(fd);
+      continue;
+    }
+
+    transport *t = get_device(req, &status, msg, sizeof(msg));
+    if(t == NULL){
+      char err[320];
+      snprintf(err, sizeof(err), "ERR %i %s\n", status, msg);
+      reply(fd, err);
+      fprintf(stderr, "ERROR: %s\n", msg);
+      if(status == 4){
+        forget_device(req.device);
+      }
+      close(fd);
+      continue;
+    }
+
+    reply(fd, "OK\n");
+    if(!session(t, req, fd)){
+      fprintf(stderr, "Device %s failed, will reopen it\n", req.device);
+      forget_device(req.device);
+    }
+    close(fd);
+  }
+
+  while(!devices.empty()){
+    forget_device(devices.begin()->first.c_str());
+  }
+  server_close(listen_fd);
+}
+
+int daemon_request_stream(const char *addr, const daemon_request &req, int *status){
+  *status = 2;
+  int fd = server_connect(addr);
+  if(fd < 0){
+    return -1;
+  }
+
+  char line[512];
+  snprintf(line, sizeof(line), "DPTICAT 1 %i %i %i %i %llu %s\n", req.port, req.proto,
+           req.chunk, req.queue, (unsigned long long)req.count, req.device);
+  if(write(fd, line, strlen(line)) != (ssize_t)strlen(line) ||
+     !read_line(fd, line, sizeof(line))){
+    fprintf(stderr, "ERROR: no reply from daemon at %s\n", addr);
+    close(fd);
+    return -1;
+  }
+  if(strcmp(line, "OK") != 0){
+    int n = 0;
+    if(sscanf(line, "ERR %i %n", status, &n) < 1 || n == 0){
+      *status = 1;
+    }
+    fprintf(stderr, "ERROR: %s\n", n > 0 ? line + n : line);
+    close(fd);
+    return -1;
+  }
+  *status = 0;
+  return fd;
+}
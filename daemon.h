@@ -0,0 +1,52 @@
+/* daemon.h -- keep devices open between dpticat runs.
+ *
+ * Opening a device and enabling a DPTI port takes far longer than a
+ * short capture. In daemon mode dpticat listens on a socket, opens each
+ * device the first time a client asks for it and then keeps it open with
+ * its port enabled, along with the port count and properties. Clients
+ * (dpticat --via) send one request line naming the device, port and read
+ * parameters and get the data back on the same connection. Clients are
+ * served one at a time.
+ *
+ * Request: "DPTICAT 1 <port> <proto> <chunk> <queue> <count> <device>\n"
+ * Reply:   "OK\n" followed by the data, or "ERR <status> <message>\n".
+ *
+ * A count of 0 streams until the client disconnects. <status> is the
+ * exit status a directly-run dpticat would have used for that error.
+ */
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <signal.h>
+#include <stdint.h>
+
+#include "transport.h"
+
+struct daemon_request {
+  char device[256];
+  int port;
+  int proto;
+  int chunk;
+  int queue;
+  uint64_t count;
+};
+
+/* Serve one client's request on fd with an open, enabled device. Returns
+ * false if the device failed, in which case it is closed and reopened
+ * for the next client.
+ */
+typedef bool (*daemon_session_fn)(transport *t, const daemon_request &req, int fd);
+
+/* Serve clients on listen_fd until interrupted is set. Devices named in
+ * preopen (may be NULL) are opened before the first client arrives.
+ */
+void daemon_run(int listen_fd, daemon_session_fn session,
+                const daemon_request *preopen, volatile sig_atomic_t *interrupted);
+
+/* Send req to the daemon at addr. Returns the connection, positioned at
+ * the start of the data, or -1 after printing the error; *status is set
+ * to the exit status to use.
+ */
+int daemon_request_stream(const char *addr, const daemon_request &req, int *status);
+
+#endif
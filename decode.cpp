@@ -0,0 +1,234 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DECODE_AVX2
+#endif
+
+#include "decode.h"
+
+/* Words unpacked per batch; the fields of a batch stay in L1.
+ */
+#define BATCH 1024
+
+/* Longest csv line: 20 digits, separator, 20 digits, separator, an
+ * 8-character fraction, newline.
+ */
+#define LINE_MAX_BYTES 51
+
+/* Width of the text format columns: 2^COARSE - 1 and 2^FINE - 1 in
+ * decimal.
+ */
+#define TEXT_COARSE_COLS 17
+#define TEXT_FINE_COLS 4
+#define TEXT_LINE_BYTES (TEXT_COARSE_COLS + 1 + TEXT_FINE_COLS + 1)
+#define FRAC_BYTES 8
+
+int parse_format(const char *s){
+  if(strcmp(s, "raw") == 0){
+    return FORMAT_RAW;
+  }
+  if(strcmp(s, "bin") == 0){
+    return FORMAT_BIN;
+  }
+  if(strcmp(s, "csv") == 0){
+    return FORMAT_CSV;
+  }
+  if(strcmp(s, "text") == 0){
+    return FORMAT_TEXT;
+  }
+  return -1;
+}
+
+void ts_unpack_scalar(const byte *in, size_t n, ts_fields *out){
+  for(size_t i = 0; i < n; i++){
+    uint64_t w = 0;
+    for(int k = 0; k < W_BYTES; k++){
+      w |= (uint64_t)in[i * W_BYTES + k] << (8 * k);
+    }
+    out[i].coarse = w >> FINE;
+    out[i].fine = w & ((1u << FINE) - 1);
+  }
+}
+
+#ifdef DECODE_AVX2
+/* Four words per iteration: shift and mask them, then interleave the
+ * coarse and fine lanes into ts_fields order. x86 is little-endian, so
+ * the words load as they are.
+ */
+__attribute__((target("avx2")))
+static void ts_unpack_avx2(const byte *in, size_t n, ts_fields *out){
+  const __m256i mask = _mm256_set1_epi64x((1ll << FINE) - 1);
+  size_t i = 0;
+  for(; i + 4 <= n; i += 4){
+    __m256i w = _mm256_loadu_si256((const __m256i *)(in + i * W_BYTES));
+    __m256i c = _mm256_srli_epi64(w, FINE);
+    __m256i f = _mm256_and_si256(w, mask);
+    __m256i lo = _mm256_unpacklo_epi64(c, f);
+    __m256i hi = _mm256_unpackhi_epi64(c, f);
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(out + i + 2), _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+  ts_unpack_scalar(in + i * W_BYTES, n - i, out + i);
+}
+#endif
+
+void ts_unpack(const byte *in, size_t n, ts_fields *out){
+#ifdef DECODE_AVX2
+  static const bool have_avx2 = __builtin_cpu_supports("avx2");
+  if(have_avx2){
+    ts_unpack_avx2(in, n, out);
+    return;
+  }
+#endif
+  ts_unpack_scalar(in, n, out);
+}
+
+static const char digit_pairs[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/* Write v in decimal ending just before end, return where it starts.
+ */
+static char *put_digits(char *end, uint64_t v){
+  while(v >= 100){
+    unsigned d = (v % 100) * 2;
+    v /= 100;
+    *--end = digit_pairs[d + 1];
+    *--end = digit_pairs[d];
+  }
+  if(v >= 10){
+    *--end = digit_pairs[v * 2 + 1];
+    *--end = digit_pairs[v * 2];
+  }
+  else{
+    *--end = '0' + v;
+  }
+  return end;
+}
+
+/* Right-align v in a field of width columns ending just before end.
+ */
+static void put_column(char *end, uint64_t v, int width){
+  char *start = put_digits(end, v);
+  memset(end - width, ' ', start - (end - width));
+}
+
+/* Write a fraction in millionths as 0.dddddd.
+ */
+static void put_frac(char *p, uint32_t u){
+  p[0] = '0';
+  p[1] = '.';
+  for(int i = FRAC_BYTES - 1; i >= 2; i--){
+    p[i] = '0' + u % 10;
+    u /= 10;
+  }
+}
+
+ts_decoder::ts_decoder(int format)
+  : format(format), table(NULL), counts(NULL), n_partial(0), fields(BATCH){
+}
+
+void ts_decoder::set_calibration(const cal_table *table, uint64_t *counts){
+  this->table = table;
+  this->counts = counts;
+}
+
+size_t ts_decoder::decode_words(const byte *in, size_t n, size_t out_off){
+  ts_unpack(in, n, fields.data());
+
+  if(counts != NULL){
+    for(size_t i = 0; i < n; i++){
+      counts[fields[i].fine]++;
+    }
+  }
+
+  if(format == FORMAT_BIN && table == NULL){
+    size_t len = n * sizeof(ts_fields);
+    buf.resize(out_off + len);
+    memcpy(buf.data() + out_off, fields.data(), len);
+    return out_off + len;
+  }
+
+  if(format == FORMAT_BIN){
+    buf.resize(out_off + n * sizeof(ts_calibrated));
+    byte *p = buf.data() + out_off;
+    for(size_t i = 0; i < n; i++){
+      ts_calibrated r = { fields[i].coarse, fields[i].fine, table->frac[fields[i].fine] };
+      memcpy(p, &r, sizeof(r));
+      p += sizeof(r);
+    }
+    return out_off + n * sizeof(ts_calibrated);
+  }
+
+  if(format == FORMAT_TEXT){
+    size_t line = TEXT_LINE_BYTES + (table != NULL ? 1 + FRAC_BYTES : 0);
+    buf.resize(out_off + n * line);
+    char *p = (char *)buf.data() + out_off;
+    for(size_t i = 0; i < n; i++){
+      put_column(p + TEXT_COARSE_COLS, fields[i].coarse, TEXT_COARSE_COLS);
+      p[TEXT_COARSE_COLS] = ' ';
+      put_column(p + TEXT_LINE_BYTES - 1, fields[i].fine, TEXT_FINE_COLS);
+      if(table != NULL){
+        p[TEXT_LINE_BYTES - 1] = ' ';
+        put_frac(p + TEXT_LINE_BYTES, table->frac_u[fields[i].fine]);
+      }
+      p[line - 1] = '\n';
+      p += line;
+    }
+    return out_off + n * line;
+  }
+
+  buf.resize(out_off + n * LINE_MAX_BYTES);
+  char *p = (char *)buf.data() + out_off;
+  char tmp[LINE_MAX_BYTES];
+  char *end = tmp + sizeof(tmp);
+  for(size_t i = 0; i < n; i++){
+    char *s = end - 1;
+    *s = '\n';
+    if(table != NULL){
+      s -= FRAC_BYTES;
+      put_frac(s, table->frac_u[fields[i].fine]);
+      *--s = ',';
+    }
+    s = put_digits(s, fields[i].fine);
+    *--s = ',';
+    s = put_digits(s, fields[i].coarse);
+    memcpy(p, s, end - s);
+    p += end - s;
+  }
+  size_t len = p - (char *)buf.data();
+  buf.resize(len);
+  return len;
+}
+
+size_t ts_decoder::decode(const byte *in, size_t len, const byte **out){
+  size_t out_off = 0;
+  buf.clear();
+
+  if(n_partial > 0){
+    size_t take = W_BYTES - n_partial < len ? W_BYTES - n_partial : len;
+    memcpy(carry + n_partial, in, take);
+    n_partial += take;
+    in += take;
+    len -= take;
+    if(n_partial < W_BYTES){
+      *out = buf.data();
+      return 0;
+    }
+    out_off = decode_words(carry, 1, out_off);
+    n_partial = 0;
+  }
+
+  size_t n_words = len / W_BYTES;
+  for(size_t i = 0; i < n_words; i += BATCH){
+    size_t n = n_words - i < BATCH ? n_words - i : BATCH;
+    out_off = decode_words(in + i * W_BYTES, n, out_off);
+  }
+
+  n_partial = len - n_words * W_BYTES;
+  memcpy(carry, in + n_words * W_BYTES, n_partial);
+  *out = buf.data();
+  return out_off;
+}
@@ -0,0 +1,86 @@
+/* decode.h -- unpack the timestamp stream into coarse/fine fields.
+ *
+ * Instead of passing the raw words through, dpticat can split each one
+ * (timestamp.h) and write
+ *
+ *   bin   a ts_fields struct per word, host byte order
+ *   csv   "coarse,fine" lines
+ *   text  fixed-width lines: coarse in 17 columns, a space, fine in 4
+ *
+ * With a calibration table (calib.h) every record also carries the
+ * calibrated position of the fine time within the coarse period: bin
+ * writes ts_calibrated structs, csv and text add a third field 0.dddddd.
+ *
+ * Words are unpacked in batches, with AVX2 when the CPU has it. A word
+ * split across chunks is carried over to the next one.
+ */
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "transport.h"
+#include "timestamp.h"
+#include "calib.h"
+
+enum {
+  FORMAT_RAW,
+  FORMAT_BIN,
+  FORMAT_CSV,
+  FORMAT_TEXT,
+};
+
+struct ts_fields {
+  uint64_t coarse;
+  uint64_t fine;
+};
+
+struct ts_calibrated {
+  uint64_t coarse;
+  uint64_t fine;
+  double frac;
+};
+
+/* Format named by s, or -1 if there is no such format.
+ */
+int parse_format(const char *s);
+
+/* Split n whole words at in into out, scalar or AVX2.
+ */
+void ts_unpack(const byte *in, size_t n, ts_fields *out);
+void ts_unpack_scalar(const byte *in, size_t n, ts_fields *out);
+
+class ts_decoder {
+public:
+  ts_decoder(int format);
+
+  /* Decode len bytes of stream. The output, valid until the next call,
+   * is returned in *out and its length as the result.
+   */
+  size_t decode(const byte *in, size_t len, const byte **out);
+
+  /* Add calibrated times from table to the output and count the fine
+   * codes into counts (CAL_CODES entries). Either may be NULL.
+   */
+  void set_calibration(const cal_table *table, uint64_t *counts);
+
+  /* Bytes of an incomplete word held back so far.
+   */
+  size_t partial() const { return n_partial; }
+
+private:
+  size_t decode_words(const byte *in, size_t n, size_t out_off);
+
+  int format;
+  const cal_table *table;
+  uint64_t *counts;
+  byte carry[W_BYTES];
+  size_t n_partial;
+  std::vector<ts_fields> fields;
+  std::vector<byte> buf;
+};
+
+#endif
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "disksink.h"
+#include "util.h"
+
+#ifdef __linux__
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+/* Just enough of io_uring for writes, without liburing: the rings are
+ * mapped from the kernel and driven with io_uring_enter.
+ */
+struct uring {
+  int fd;
+  void *sq_map;
+  void *cq_map;
+  size_t sq_bytes;
+  size_t cq_bytes;
+  io_uring_sqe *sqes;
+  size_t sqes_bytes;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  io_uring_cqe *cqes;
+};
+
+static void uring_free(uring *r){
+  if(r->sqes != NULL){
+    munmap(r->sqes, r->sqes_bytes);
+  }
+  if(r->cq_map != NULL && r->cq_map != r->sq_map){
+    munmap(r->cq_map, r->cq_bytes);
+  }
+  if(r->sq_map != NULL){
+    munmap(r->sq_map, r->sq_bytes);
+  }
+  close(r->fd);
+  delete r;
+}
+
+static uring *uring_open(unsigned entries){
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, entries, &p);
+  if(fd < 0){
+    return NULL;
+  }
+  uring *r = new uring();
+  r->fd = fd;
+  r->sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP){
+    if(r->cq_bytes > r->sq_bytes){
+      r->sq_bytes = r->cq_bytes;
+    }
+    r->cq_bytes = r->sq_bytes;
+  }
+  void *sq = mmap(NULL, r->sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_SQ_RING);
+  if(sq == MAP_FAILED){
+    uring_free(r);
+    return NULL;
+  }
+  r->sq_map = sq;
+  if(p.features & IORING_FEAT_SINGLE_MMAP){
+    r->cq_map = sq;
+  }
+  else{
+    void *cq = mmap(NULL, r->cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_CQ_RING);
+    if(cq == MAP_FAILED){
+      uring_free(r);
+      return NULL;
+    }
+    r->cq_map = cq;
+  }
+  r->sqes_bytes = p.sq_entries * sizeof(io_uring_sqe);
+  void *sqes = mmap(NULL, r->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED){
+    uring_free(r);
+    return NULL;
+  }
+  r->sqes = (io_uring_sqe *)sqes;
+
+  byte *sqb = (byte *)r->sq_map;
+  byte *cqb = (byte *)r->cq_map;
+  r->sq_tail = (unsigned *)(sqb + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sqb + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sqb + p.sq_off.array);
+  r->cq_head = (unsigned *)(cqb + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cqb + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cqb + p.cq_off.ring_mask);
+  r->cqes = (io_uring_cqe *)(cqb + p.cq_off.cqes);
+  return r;
+}
+
+/* Queue a write of iov and hand it to the kernel. WRITEV rather than
+ * WRITE, which only came with 5.6, so any kernel with io_uring takes it;
+ * iov must stay valid until the write completes.
+ */
+static bool uring_write(uring *r, int fd, const struct iovec *iov, uint64_t off,
+                        uint64_t tag){
+  unsigned tail = *r->sq_tail;
+  unsigned i = tail & *r->sq_mask;
+  io_uring_sqe *sqe = &r->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)iov;
+  sqe->len = 1;
+  sqe->off = off;
+  sqe->user_data = tag;
+  r->sq_array[i] = i;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  while(syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) < 0){
+    if(errno != EINTR){
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Take one completion, waiting for it if wait is set. Returns false if
+ * there is none, or with errno set if waiting failed.
+ */
+static bool uring_reap(uring *r, bool wait, uint64_t *tag, int *res){
+  while(true){
+    unsigned head = *r->cq_head;
+    if(head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)){
+      io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      *tag = cqe->user_data;
+      *res = cqe->res;
+      __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+    if(!wait){
+      return false;
+    }
+    if(syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+       errno != EINTR){
+      return false;
+    }
+  }
+}
+
+#else
+
+struct uring {
+};
+
+static uring *uring_open(unsigned){
+  return NULL;
+}
+
+static void uring_free(uring *){
+}
+
+static bool uring_write(uring *, int, const struct iovec *, uint64_t, uint64_t){
+  return false;
+}
+
+static bool uring_reap(uring *, bool, uint64_t *, int *){
+  return false;
+}
+
+#endif
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+direct_sink::direct_sink() :
+  fd(-1), direct(false), ring(NULL), cur(0), fill(0), in_flight(0), offset(0),
+  alloc_end(0), failed(false), err(0), t_open(0), wait_ns(0) {
+  for(int i = 0; i < DIRECT_BUFFERS; i++){
+    bufs[i] = NULL;
+    queued[i] = 0;
+  }
+}
+
+direct_sink::~direct_sink(){
+  if(fd >= 0){
+    close();
+  }
+  for(int i = 0; i < DIRECT_BUFFERS; i++){
+    free(bufs[i]);
+  }
+}
+
+bool direct_sink::open(const char *path){
+  direct = O_DIRECT != 0;
+  fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+  if(fd < 0 && errno == EINVAL){
+    direct = false;
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  if(fd < 0){
+    fprintf(stderr, "ERROR: cannot create %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  for(int i = 0; i < DIRECT_BUFFERS; i++){
+    if(posix_memalign((void **)&bufs[i], DIRECT_ALIGN, DIRECT_BUFFER_BYTES) != 0){
+      bufs[i] = NULL;
+      fprintf(stderr, "ERROR: failed to allocate %i output buffers\n", DIRECT_BUFFERS);
+      ::close(fd);
+      fd = -1;
+      return false;
+    }
+  }
+  ring = uring_open(DIRECT_BUFFERS);
+  fprintf(stderr, "Writing %s with %s%s\n", path,
+          ring != NULL ? "io_uring" : "pwrite",
+          direct ? ", O_DIRECT" : " through the page cache");
+  t_open = now_ns();
+  return true;
+}
+
+/* Keep the file allocated DIRECT_PREALLOC_BYTES past end.
+ */
+bool direct_sink::prealloc(uint64_t end){
+#ifdef __linux__
+  while(alloc_end < end + DIRECT_PREALLOC_BYTES){
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, alloc_end, DIRECT_PREALLOC_BYTES) != 0){
+      /* Not every filesystem can; the writes allocate as they go then.
+       */
+      alloc_end = UINT64_MAX;
+      return errno == EOPNOTSUPP || errno == ENOSYS;
+    }
+    alloc_end += DIRECT_PREALLOC_BYTES;
+  }
+#endif
+  return true;
+}
+
+bool direct_sink::submit(int i, size_t len){
+  if(!prealloc(offset + len)){
+    err = errno;
+    return false;
+  }
+  if(ring != NULL){
+    iovs[i].iov_base = bufs[i];
+    iovs[i].iov_len = len;
+    if(!uring_write(ring, fd, &iovs[i], offset, i)){
+      err = errno;
+      return false;
+    }
+    queued[i] = len;
+    in_flight++;
+  }
+  else{
+    size_t done = 0;
+    while(done < len){
+      ssize_t n = pwrite(fd, bufs[i] + done, len - done, offset + done);
+      if(n < 0 && errno == EINTR){
+        continue;
+      }
+      if(n <= 0){
+        err = n < 0 ? errno : EIO;
+        return false;
+      }
+      done += n;
+    }
+  }
+  offset += len;
+  return true;
+}
+
+/* Collect finished writes. Every write covers a whole buffer, so a
+ * short one is treated as a failure.
+ */
+bool direct_sink::reap(bool wait){
+  uint64_t tag;
+  int res;
+  while(in_flight > 0){
+    if(!uring_reap(ring, wait, &tag, &res)){
+      if(!wait){
+        return true;
+      }
+      /* io_uring_enter itself failed, so the writes still in flight
+       * cannot be waited for; give them up rather than wait forever.
+       */
+      err = errno;
+      in_flight = 0;
+      return false;
+    }
+    in_flight--;
+    size_t len = queued[tag];
+    queued[tag] = 0;
+    if(res < 0){
+      err = -res;
+      return false;
+    }
+    if((size_t)res < len){
+      err = ENOSPC;
+      return false;
+    }
+    wait = false;
+  }
+  return true;
+}
+
+bool direct_sink::write(const byte *data, size_t len){
+  while(len > 0 && !failed){
+    size_t take = DIRECT_BUFFER_BYTES - fill < len ? DIRECT_BUFFER_BYTES - fill : len;
+    memcpy(bufs[cur] + fill, data, take);
+    fill += take;
+    data += take;
+    len -= take;
+    if(fill < DIRECT_BUFFER_BYTES){
+      break;
+    }
+    if(!submit(cur, fill)){
+      failed = true;
+      break;
+    }
+    cur = (cur + 1) % DIRECT_BUFFERS;
+    fill = 0;
+    if(queued[cur] > 0){
+      uint64_t t = now_ns();
+      while(queued[cur] > 0 && !failed){
+        failed = !reap(true);
+      }
+      wait_ns += now_ns() - t;
+    }
+  }
+  return !failed;
+}
+
+bool direct_sink::close(){
+  uint64_t length = offset + fill;
+  if(!failed && fill > 0){
+    /* O_DIRECT writes whole blocks; the padding is cut off below.
+     */
+    size_t len = direct ? (fill + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1) : fill;
+    memset(bufs[cur] + fill, 0, len - fill);
+    failed = !submit(cur, len);
+  }
+  while(ring != NULL && in_flight > 0){
+    if(!reap(true)){
+      failed = true;
+    }
+  }
+  if(ftruncate(fd, length) != 0 && !failed){
+    failed = true;
+    err = errno;
+  }
+  if(::close(fd) != 0 && !failed){
+    failed = true;
+    err = errno;
+  }
+  fd = -1;
+  if(ring != NULL){
+    uring_free(ring);
+    ring = NULL;
+  }
+  if(failed){
+    fprintf(stderr, "ERROR: write failed: %s\n", strerror(err));
+    return false;
+  }
+  double elapsed = (now_ns() - t_open) / 1e9;
+  fprintf(stderr, "Wrote %llu bytes to disk at %.3f MB/s, %.3f s waiting on the disk\n",
+          (unsigned long long)length,
+          elapsed > 0 ? length / elapsed / (1024.0 * 1024.0) : 0.0, wait_ns / 1e9);
+  return true;
+}
@@ -0,0 +1,77 @@
+/* disksink.h -- direct file output for long, fast captures.
+ *
+ * Writing through the page cache leaves the kernel to flush dirty pages
+ * whenever it sees fit, and those writeback stalls reach back through
+ * the ring into the device reads. direct_sink bypasses the cache: the
+ * stream is copied into DIRECT_BUFFERS page-aligned buffers of
+ * DIRECT_BUFFER_BYTES that are written with O_DIRECT, several at once
+ * through io_uring. The file is preallocated DIRECT_PREALLOC_BYTES
+ * ahead of the data with fallocate, so the filesystem is not allocating
+ * blocks on the write path either. Its size only grows with the data,
+ * so a run that is killed leaves no padding behind.
+ *
+ * Without io_uring (old kernels, seccomp) the buffers are written with
+ * pwrite one at a time; without O_DIRECT (tmpfs) through the cache.
+ * Both are reported when the sink is opened.
+ */
+#ifndef DISKSINK_H
+#define DISKSINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+#include "transport.h"
+
+#define DIRECT_BUFFERS 8
+#define DIRECT_BUFFER_BYTES (1 << 20)
+#define DIRECT_PREALLOC_BYTES (256ull << 20)
+
+/* Alignment O_DIRECT needs of buffers, lengths and offsets.
+ */
+#define DIRECT_ALIGN 4096
+
+struct uring;
+
+class direct_sink {
+public:
+  direct_sink();
+  ~direct_sink();
+
+  /* Create path. Returns false with an error on stderr.
+   */
+  bool open(const char *path);
+
+  /* Queue len bytes for writing. Returns false once a write has failed.
+   */
+  bool write(const byte *data, size_t len);
+
+  /* Write what is left, cut the file to the stream length and report
+   * the bandwidth on stderr. Returns false if any write failed.
+   */
+  bool close();
+
+private:
+  bool submit(int i, size_t len);
+  bool reap(bool wait);
+  bool prealloc(uint64_t end);
+
+  int fd;
+  bool direct;
+  uring *ring;
+  byte *bufs[DIRECT_BUFFERS];
+  int cur;                  // buffer being filled
+  size_t fill;
+  int in_flight;
+  size_t queued[DIRECT_BUFFERS];   // bytes being written from each, 0 if free
+  struct iovec iovs[DIRECT_BUFFERS];  // what io_uring is writing from each
+  uint64_t offset;          // file offset of the current buffer
+  uint64_t alloc_end;
+  bool failed;
+  int err;
+  uint64_t t_open;
+  uint64_t wait_ns;         // time spent waiting for a free buffer
+};
+
+#endif
@@ -10,120 +10,802 @@
 #include <ctype.h>
 #include <time.h>
 #include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <poll.h>
 //#include <random.h>
 
-#include "dpcdecl.h"
-#include "dmgr.h"
-#include "dpti.h"
+#include <vector>
+
+#include "capture.h"
+#include "proto.h"
+#include "util.h"
+#include "server.h"
+#include "daemon.h"
+#include "compress.h"
+#include "realtime.h"
 
 #define N_TESTS 65536
-#define W_BYTES 8
-#define WIDTH (W_BYTES * 8)
-#define FINE 10
-#define COARSE (WIDTH - FINE)
 
-typedef unsigned char byte;
+/* Keep devices open for clients (--daemon), or be such a client (--via).
+ */
+const char *daemon_addr = NULL;
+const char *via_addr = NULL;
+
+/* File listing the devices to read at once, see read_multi().
+ */
+const char *multi_path = NULL;
+
+/* Decode this compressed file to stdout instead of capturing.
+ */
+const char *decompress_path = NULL;
+
+enum {
+  OPT_TARGET_RATE = 256,
+  OPT_TARGET_LATENCY,
+  OPT_DAEMON,
+  OPT_VIA,
+  OPT_SPLIT,
+  OPT_HIST_INTERVAL,
+  OPT_CAL_SAVE,
+  OPT_STATS_INTERVAL,
+  OPT_SHM,
+  OPT_SHM_SIZE,
+  OPT_PRE,
+  OPT_POST,
+  OPT_COMPRESS_THREADS,
+  OPT_COMPRESS_BLOCK,
+  OPT_DECOMPRESS,
+  OPT_REALTIME,
+  OPT_CPUS,
+  OPT_RT_PRIORITY,
+};
+
+static struct option long_opts[] = {
+  {"queue", required_argument, NULL, 'q'},
+  {"buffers", required_argument, NULL, 'b'},
+  {"proto", required_argument, NULL, 'P'},
+  {"chunk", required_argument, NULL, 'c'},
+  {"autotune", required_argument, NULL, 'a'},
+  {"target-rate", required_argument, NULL, OPT_TARGET_RATE},
+  {"target-latency", required_argument, NULL, OPT_TARGET_LATENCY},
+  {"duplex", no_argument, NULL, 'x'},
+  {"listen", required_argument, NULL, 'l'},
+  {"count", required_argument, NULL, 'n'},
+  {"daemon", required_argument, NULL, OPT_DAEMON},
+  {"via", required_argument, NULL, OPT_VIA},
+  {"multi", required_argument, NULL, 'm'},
+  {"split", required_argument, NULL, OPT_SPLIT},
+  {"format", required_argument, NULL, 'f'},
+  {"histogram", no_argument, NULL, 'H'},
+  {"hist-interval", required_argument, NULL, OPT_HIST_INTERVAL},
+  {"calibrate", no_argument, NULL, 'C'},
+  {"framed", no_argument, NULL, 'F'},
+  {"cal-save", required_argument, NULL, OPT_CAL_SAVE},
+  {"verbose", no_argument, NULL, 'v'},
+  {"write", required_argument, NULL, 'w'},
+  {"output", required_argument, NULL, 'o'},
+  {"zero-copy", no_argument, NULL, 'z'},
+  {"sink", required_argument, NULL, 'S'},
+  {"shm", required_argument, NULL, OPT_SHM},
+  {"shm-size", required_argument, NULL, OPT_SHM_SIZE},
+  {"trigger", required_argument, NULL, 'T'},
+  {"pre", required_argument, NULL, OPT_PRE},
+  {"post", required_argument, NULL, OPT_POST},
+  {"compress", required_argument, NULL, 'Z'},
+  {"compress-threads", required_argument, NULL, OPT_COMPRESS_THREADS},
+  {"compress-block", required_argument, NULL, OPT_COMPRESS_BLOCK},
+  {"decompress", required_argument, NULL, OPT_DECOMPRESS},
+  {"realtime", no_argument, NULL, OPT_REALTIME},
+  {"cpus", required_argument, NULL, OPT_CPUS},
+  {"rt-priority", required_argument, NULL, OPT_RT_PRIORITY},
+  {"stats-interval", required_argument, NULL, OPT_STATS_INTERVAL},
+  {"help",  no_argument,       NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
 
-char dev_name[cchDvcNameMax + 1];
-HIF hif = hifInvalid;
+void usage(const char *cmd){
+  fprintf(stderr,
+          "Usage: %s [options] <device> <port>\n"
+          "       %s [options] -m FILE\n"
+          "       %s --decompress FILE\n"
+          "  -q, --queue N   keep N overlapped requests in flight\n"
+          "  -b, --buffers N buffer up to N chunks for slow output (default 64)\n"
+          "  -P, --proto V   request protocol version: 1 (default) or 2\n"
+          "  -c, --chunk N   bytes per request, K/M suffixes allowed (default 128,\n"
+          "                  or 64K with -P 2)\n"
+          "  -a, --autotune MIN:MAX\n"
+          "                  adjust the request size within MIN..MAX at run time\n"
+          "      --target-rate B/s\n"
+          "                  tune for the smallest size that sustains this rate\n"
+          "      --target-latency US\n"
+          "                  tune for the largest size that completes within this\n"
+          "  -x, --duplex    also stream stdin to the device (needs -P 2)\n"
+          "  -l, --listen ADDR\n"
+          "                  serve the stream on tcp:[HOST:]PORT or unix:PATH\n"
+          "  -n, --count N   stop after N bytes\n"
+          "      --daemon ADDR\n"
+          "                  keep devices open and serve --via clients on ADDR;\n"
+          "                  <device> <port> are optional and opened up front\n"
+          "      --via ADDR  read through the daemon at ADDR\n"
+          "  -m, --multi FILE\n"
+          "                  read every \"<device> <port>\" line of FILE at once,\n"
+          "                  interleaving the chunks with stripe headers\n"
+          "      --split PATTERN\n"
+          "                  with -m, write source N to the file PATTERN %%d N\n"
+          "  -f, --format F  write raw words (default), or decode them into bin,\n"
+          "                  csv or text coarse/fine records, see decode.h\n"
+          "  -H, --histogram write histograms of the fine field and of coarse\n"
+          "                  deltas instead of the stream, on exit and on SIGUSR1\n"
+          "      --hist-interval S\n"
+          "                  with -H, also write a snapshot every S seconds\n"
+          "  -C, --calibrate with -f, calibrate the fine field from the data and\n"
+          "                  add the calibrated fine time to each record\n"
+          "      --cal-save FILE\n"
+          "                  with -C, write the final calibration table to FILE\n"
+          "  -F, --framed    the bitstream frames its replies with a sequence\n"
+          "                  number and CRC-32C; check and strip them\n"
+          "  -w, --write FILE\n"
+          "                  write an indexed capture file with the arrival time\n"
+          "                  of every chunk instead of the stream, for replay\n"
+          "                  with sim:replay=FILE\n"
+          "  -o, --output FILE\n"
+          "                  write the output to FILE with O_DIRECT and io_uring,\n"
+          "                  bypassing the page cache, instead of to stdout\n"
+          "  -z, --zero-copy when stdout is a pipe, gift the raw stream to it with\n"
+          "                  vmsplice instead of copying it\n"
+          "  -S, --sink DEST[,block|,drop|,spill=FILE]\n"
+          "                  write the stream to DEST (\"-\" for stdout, a file,\n"
+          "                  or tcp:HOST:PORT or unix:PATH to connect to); give\n"
+          "                  several to fan out, see fanout.h\n"
+          "      --shm NAME  publish the stream in the POSIX shared-memory ring\n"
+          "                  NAME for local readers (shmring.h)\n"
+          "      --shm-size N\n"
+          "                  size of that ring (default 64M)\n"
+          "  -T, --trigger COND\n"
+          "                  write only windows around the words matching COND:\n"
+          "                  word=V[/MASK], rate=N:COUNTS (N words within COUNTS\n"
+          "                  coarse counts) or bytes=HEX, see trigger.h\n"
+          "      --pre N     with -T, bytes to keep before the trigger (default 64K)\n"
+          "      --post N    with -T, bytes to write from it on (default 64K)\n"
+          "  -Z, --compress MODE\n"
+          "                  compress the output in independent blocks on a pool\n"
+          "                  of threads: lz4, or delta for timestamp words; see\n"
+          "                  compress.h\n"
+          "      --compress-threads N\n"
+          "                  workers for -Z and --decompress (default one per CPU)\n"
+          "      --compress-block N\n"
+          "                  with -Z, bytes per block (default 1M)\n"
+          "      --decompress FILE\n"
+          "                  decode a -Z file (\"-\" for stdin) to stdout\n"
+          "      --realtime  put the buffers in huge pages and lock them in memory,\n"
+          "                  and report the readers' worst loop jitter\n"
+          "      --cpus R[:W]\n"
+          "                  with --realtime, pin the readers to the CPUs in list\n"
+          "                  R (one each, in turn) and the writers to list W,\n"
+          "                  e.g. 2:3 or 2,3:4-7\n"
+          "      --rt-priority N\n"
+          "                  with --realtime, run the readers under SCHED_FIFO\n"
+          "                  at priority N (1-99)\n"
+          "  -v, --verbose   trace every request on stderr\n"
+          "      --stats-interval S\n"
+          "                  write request, receive and write latency stats to\n"
+          "                  stderr every S seconds; SIGUSR1 writes them at once\n"
+          "  -h, --help      show this help\n", cmd, cmd, cmd);
+}
 
 void cancel_out(int signum){
-  fprintf(stderr, "Ctrl-C pressed, exiting...\n");
-  DmgrClose(hif);
-  exit(1);
+  const char msg[] = "Ctrl-C pressed, exiting...\n";
+  if(write(2, msg, sizeof(msg) - 1) < 0){
+  }
+  stop_requested = 1;
+  interrupted = 1;
+}
+
+void request_dump(int signum){
+  hist_dump_requested = 1;
+  stats_dump_requested = 1;
+}
+
+/* Daemon side of a --via client: run a capture into the client socket.
+ */
+bool daemon_session(transport *t, const daemon_request &req, int fd){
+  source src;
+  src.id = 0;
+  snprintf(src.name, sizeof(src.name), "%s", req.device);
+  src.port = req.port;
+  src.trans = t;
+  std::vector<source *> sources(1, &src);
+  proto = req.proto;
+  n_bytes = req.chunk;
+  queue_depth = req.queue;
+  byte_limit = req.count;
+  stop_requested = 0;
+  
+  fprintf(stderr, "Client asked for %llu bytes from %s port %i\n",
+          (unsigned long long)req.count, req.device, req.port);
+  run_capture(sources, fd);
+  return !transfer_failed;
+}
+
+int run_daemon(int argc, char *argv[]){
+  int listen_fd = server_listen(daemon_addr);
+  if(listen_fd < 0){
+    return 6;
+  }
+  
+  /* A client going away mid-capture must not take the daemon with it.
+   */
+  signal(SIGPIPE, SIG_IGN);
+  
+  daemon_request preopen;
+  if(argc >= 3){
+    snprintf(preopen.device, sizeof(preopen.device), "%s", argv[1]);
+    preopen.port = atoi(argv[2]);
+  }
+  fprintf(stderr, "Daemon listening on %s\n", daemon_addr);
+  daemon_run(listen_fd, daemon_session, argc >= 3 ? &preopen : NULL, &interrupted);
+  return 0;
+}
+
+/* --via: have the daemon do the reads and copy its stream to stdout.
+ */
+int run_client(const char *dev_name, int port_num){
+  daemon_request req;
+  snprintf(req.device, sizeof(req.device), "%s", dev_name);
+  req.port = port_num;
+  req.proto = proto;
+  req.chunk = n_bytes;
+  req.queue = queue_depth;
+  req.count = byte_limit;
+  
+  uint64_t t_start = now_ns();
+  int status;
+  int fd = daemon_request_stream(via_addr, req, &status);
+  if(fd < 0){
+    return status;
+  }
+  
+  byte *buf = new byte[65536];
+  ts_decoder *dec = out_format != FORMAT_RAW ? new ts_decoder(out_format) : NULL;
+  uint64_t n_total = 0;
+  uint64_t t_first = 0;
+  while(!stop_requested){
+    ssize_t got = read(fd, buf, 65536);
+    if(got <= 0){
+      break;
+    }
+    if(n_total == 0){
+      t_first = now_ns();
+    }
+    n_total += got;
+    const byte *out = buf;
+    size_t len = got;
+    if(dec != NULL){
+      len = dec->decode(buf, got, &out);
+    }
+    if(!write_all(1, out, len)){
+      break;
+    }
+  }
+  close(fd);
+  delete[] buf;
+  if(dec != NULL){
+    report_partial(dec);
+    delete dec;
+  }
+  
+  double elapsed = (now_ns() - t_start) / 1e9;
+  fprintf(stderr, "Read %llu bytes in %.3f s, first data after %.3f ms\n",
+          (unsigned long long)n_total, elapsed,
+          n_total > 0 ? (t_first - t_start) / 1e6 : 0.0);
+  if(byte_limit > 0 && n_total < byte_limit && !stop_requested){
+    fprintf(stderr, "ERROR: daemon stopped after %llu of %llu bytes\n",
+            (unsigned long long)n_total, (unsigned long long)byte_limit);
+    return 1;
+  }
+  return stop_requested ? 1 : 0;
+}
+
+/* A --split pattern must take exactly one integer, e.g. "cap%02d.bin".
+ */
+bool valid_split_pattern(const char *p){
+  int n_conv = 0;
+  for(; *p != '\0'; p++){
+    if(*p != '%'){
+      continue;
+    }
+    if(p[1] == '%'){
+      p++;
+      continue;
+    }
+    p++;
+    while(*p == '0' || *p == '-'){
+      p++;
+    }
+    while(isdigit((unsigned char)*p)){
+      p++;
+    }
+    if(*p != 'd' && *p != 'i' && *p != 'x' && *p != 'u'){
+      return false;
+    }
+    n_conv++;
+  }
+  return n_conv == 1;
+}
+
+/* Read the -m file: one "<device> <port>" per line, as in conn.txt.
+ * Blank lines and lines starting with '#' are skipped.
+ */
+bool read_multi(const char *path, std::vector<source *> &sources){
+  FILE *f = fopen(path, "r");
+  if(f == NULL){
+    fprintf(stderr, "ERROR: cannot open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  char line[512];
+  int line_no = 0;
+  bool ok = true;
+  while(ok && fgets(line, sizeof(line), f) != NULL){
+    line_no++;
+    char *p = line;
+    while(isspace((unsigned char)*p)){
+      p++;
+    }
+    if(*p == '\0' || *p == '#'){
+      continue;
+    }
+    source *src = new source;
+    src->id = sources.size();
+    src->trans = NULL;
+    if(sscanf(p, "%255s %d", src->name, &src->port) != 2 || src->port < 0){
+      fprintf(stderr, "ERROR: %s:%i: expected \"<device> <port>\"\n", path, line_no);
+      delete src;
+      ok = false;
+      break;
+    }
+    sources.push_back(src);
+  }
+  fclose(f);
+  if(ok && sources.empty()){
+    fprintf(stderr, "ERROR: no devices listed in %s\n", path);
+    ok = false;
+  }
+  return ok;
 }
 
 int main( int argc, char* argv[] ) {
   srand((unsigned int)time(NULL));
-  if(argc < 2) {
-    fprintf(stderr, "ERROR: no device specified\n");
-    fflush(stderr);
+  int opt;
+  double trig_pre = -1;
+  double trig_post = -1;
+  while((opt = getopt_long(argc, argv, "q:b:P:c:a:xl:n:m:f:HCFvw:o:zS:T:Z:h", long_opts, NULL)) != -1){
+    switch(opt){
+    case 'q':
+      queue_depth = atoi(optarg);
+      if(queue_depth < 0){
+        fprintf(stderr, "ERROR: invalid queue depth %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'b':
+      ring_slots = atoi(optarg);
+      if(ring_slots < 1){
+        fprintf(stderr, "ERROR: invalid buffer count %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'P':
+      proto = atoi(optarg);
+      if(proto != PROTO_V1 && proto != PROTO_V2){
+        fprintf(stderr, "ERROR: invalid protocol version %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'c': {
+      double v;
+      if(!parse_size(optarg, &v) || v < 1 || v > INT_MAX || v != (int)v){
+        fprintf(stderr, "ERROR: invalid chunk size %s\n", optarg);
+        exit(1);
+      }
+      n_bytes = v;
+      break;
+    }
+    case 'a': {
+      double lo, hi;
+      char *sep = strchr(optarg, ':');
+      if(sep != NULL){
+        *sep = '\0';
+      }
+      if(sep == NULL || !parse_size(optarg, &lo) || !parse_size(sep + 1, &hi) ||
+         lo < 1 || hi < lo){
+        fprintf(stderr, "ERROR: invalid autotune range, expected MIN:MAX\n");
+        exit(1);
+      }
+      tune_min = lo;
+      tune_max = hi;
+      break;
+    }
+    case OPT_TARGET_RATE:
+      if(!parse_size(optarg, &target_rate) || target_rate <= 0){
+        fprintf(stderr, "ERROR: invalid target rate %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_TARGET_LATENCY:
+      target_lat_us = atof(optarg);
+      if(target_lat_us <= 0){
+        fprintf(stderr, "ERROR: invalid target latency %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'x':
+      duplex = true;
+      break;
+    case 'l':
+      listen_addr = optarg;
+      break;
+    case 'n': {
+      double v;
+      if(!parse_size(optarg, &v) || v < 1){
+        fprintf(stderr, "ERROR: invalid byte count %s\n", optarg);
+        exit(1);
+      }
+      byte_limit = v;
+      break;
+    }
+    case OPT_DAEMON:
+      daemon_addr = optarg;
+      break;
+    case OPT_VIA:
+      via_addr = optarg;
+      break;
+    case 'm':
+      multi_path = optarg;
+      break;
+    case OPT_SPLIT:
+      split_pattern = optarg;
+      break;
+    case 'H':
+      histogram_mode = true;
+      break;
+    case OPT_HIST_INTERVAL:
+      hist_interval = atof(optarg);
+      if(hist_interval <= 0){
+        fprintf(stderr, "ERROR: invalid histogram interval %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'C':
+      calibrate = true;
+      break;
+    case 'F':
+      framed = true;
+      break;
+    case OPT_CAL_SAVE:
+      cal_save_path = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'w':
+      capture_path = optarg;
+      break;
+    case 'o':
+      direct_path = optarg;
+      break;
+    case 'z':
+      zero_copy = true;
+      break;
+    case OPT_SHM:
+      shm_name = optarg;
+      break;
+    case OPT_SHM_SIZE: {
+      double v;
+      if(!parse_size(optarg, &v) || v < 1){
+        fprintf(stderr, "ERROR: invalid shared memory size %s\n", optarg);
+        exit(1);
+      }
+      shm_bytes = (uint64_t)v;
+      break;
+    }
+    case 'S':
+      if(sinks == NULL){
+        sinks = new fanout;
+      }
+      if(!sinks->add(optarg)){
+        exit(1);
+      }
+      break;
+    case 'T':
+      delete trig;
+      trig = new trigger;
+      if(!trig->parse(optarg)){
+        exit(1);
+      }
+      break;
+    case OPT_PRE:
+      if(!parse_size(optarg, &trig_pre)){
+        fprintf(stderr, "ERROR: invalid pre-trigger size %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_POST:
+      if(!parse_size(optarg, &trig_post) || trig_post < 1){
+        fprintf(stderr, "ERROR: invalid post-trigger size %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'Z':
+      compress_mode = parse_compress_mode(optarg);
+      if(compress_mode < 0){
+        fprintf(stderr, "ERROR: invalid compression mode %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_COMPRESS_THREADS:
+      compress_threads = atoi(optarg);
+      if(compress_threads < 1){
+        fprintf(stderr, "ERROR: invalid thread count %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_COMPRESS_BLOCK: {
+      double v;
+      if(!parse_size(optarg, &v) || v < 4096 || v > Z_MAX_BLOCK_BYTES){
+        fprintf(stderr, "ERROR: invalid block size %s, expected 4K to 64M\n", optarg);
+        exit(1);
+      }
+      /* Whole words, for the delta filter.
+       */
+      compress_block = (size_t)v / W_BYTES * W_BYTES;
+      break;
+    }
+    case OPT_DECOMPRESS:
+      decompress_path = optarg;
+      break;
+    case OPT_REALTIME:
+      realtime = true;
+      break;
+    case OPT_CPUS: {
+      char *sep = strchr(optarg, ':');
+      if(sep != NULL){
+        *sep = '\0';
+      }
+      if(!parse_cpu_list(optarg, &reader_cpus) ||
+         (sep != NULL && !parse_cpu_list(sep + 1, &writer_cpus))){
+        fprintf(stderr, "ERROR: invalid CPU lists, expected READERS[:WRITERS]\n");
+        exit(1);
+      }
+      break;
+    }
+    case OPT_RT_PRIORITY:
+      rt_priority = atoi(optarg);
+      if(rt_priority < 1 || rt_priority > 99){
+        fprintf(stderr, "ERROR: invalid SCHED_FIFO priority %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_STATS_INTERVAL:
+      stats_interval = atof(optarg);
+      if(stats_interval <= 0){
+        fprintf(stderr, "ERROR: invalid stats interval %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'f':
+      out_format = parse_format(optarg);
+      if(out_format < 0){
+        fprintf(stderr, "ERROR: invalid output format %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'h':
+      usage(argv[0]);
+      exit(0);
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  
+  if(n_bytes == 0){
+    n_bytes = proto == PROTO_V2 ? 65536 : 128;
+  }
+  if((uint32_t)n_bytes > proto_max_request(proto) || tune_max > proto_max_request(proto)){
+    fprintf(stderr, "ERROR: protocol %i requests at most %u bytes\n",
+            proto, proto_max_request(proto));
+    exit(1);
+  }
+  if(duplex && proto != PROTO_V2){
+    fprintf(stderr, "ERROR: --duplex needs request protocol 2\n");
+    exit(1);
+  }
+  if(duplex && queue_depth > 0){
+    fprintf(stderr, "ERROR: --duplex cannot be combined with overlapped reads\n");
+    exit(1);
+  }
+  if((target_rate > 0 || target_lat_us > 0) && tune_max == 0){
+    fprintf(stderr, "ERROR: --target-rate and --target-latency need --autotune\n");
     exit(1);
   }
   
-  strcpy(dev_name, argv[1]);
+  if(daemon_addr != NULL && via_addr != NULL){
+    fprintf(stderr, "ERROR: --daemon and --via are exclusive\n");
+    exit(1);
+  }
+  if((daemon_addr != NULL || via_addr != NULL) &&
+     (duplex || listen_addr != NULL || tune_max > 0 || framed)){
+    fprintf(stderr, "ERROR: --daemon and --via cannot be combined with -x, -l, -a or -F\n");
+    exit(1);
+  }
   
-  /* Attempt to open the device.
-   */
-  if ( ! DmgrOpen(&hif, dev_name) ) {
-    fprintf(stderr, "ERROR: unable to open device \"%s\"\n", dev_name);
-    fflush(stderr);
-    exit(2);
+  if(multi_path != NULL &&
+     (daemon_addr != NULL || via_addr != NULL || duplex || listen_addr != NULL)){
+    fprintf(stderr, "ERROR: -m cannot be combined with --daemon, --via, -x or -l\n");
+    exit(1);
+  }
+  if(split_pattern != NULL && multi_path == NULL){
+    fprintf(stderr, "ERROR: --split needs -m\n");
+    exit(1);
+  }
+  if(out_format != FORMAT_RAW &&
+     (daemon_addr != NULL || listen_addr != NULL || (multi_path != NULL && split_pattern == NULL))){
+    fprintf(stderr, "ERROR: -f needs a plain output: not --daemon, -l or -m without --split\n");
+    exit(1);
+  }
+  if(histogram_mode &&
+     (out_format != FORMAT_RAW || listen_addr != NULL || split_pattern != NULL ||
+      daemon_addr != NULL || via_addr != NULL)){
+    fprintf(stderr, "ERROR: -H cannot be combined with -f, -l, --split, --daemon or --via\n");
+    exit(1);
+  }
+  if(calibrate && (out_format == FORMAT_RAW || via_addr != NULL)){
+    fprintf(stderr, "ERROR: -C needs -f and cannot be combined with --via\n");
+    exit(1);
+  }
+  if(cal_save_path != NULL && !calibrate){
+    fprintf(stderr, "ERROR: --cal-save needs -C\n");
+    exit(1);
+  }
+  if(capture_path != NULL &&
+     (multi_path != NULL || listen_addr != NULL || histogram_mode || out_format != FORMAT_RAW ||
+      daemon_addr != NULL || via_addr != NULL)){
+    fprintf(stderr, "ERROR: -w cannot be combined with -m, -l, -H, -f, --daemon or --via\n");
+    exit(1);
+  }
+  if(direct_path != NULL &&
+     (multi_path != NULL || listen_addr != NULL || histogram_mode || capture_path != NULL ||
+      daemon_addr != NULL || via_addr != NULL)){
+    fprintf(stderr, "ERROR: -o cannot be combined with -m, -l, -H, -w, --daemon or --via\n");
+    exit(1);
+  }
+  if(sinks != NULL &&
+     (multi_path != NULL || listen_addr != NULL || histogram_mode || out_format != FORMAT_RAW ||
+      capture_path != NULL || direct_path != NULL || zero_copy ||
+      daemon_addr != NULL || via_addr != NULL)){
+    fprintf(stderr, "ERROR: -S cannot be combined with -m, -l, -H, -f, -w, -o, -z, --daemon or --via\n");
+    exit(1);
   }
-  fprintf(stderr, "Opened HIF\n");
+  if(shm_name != NULL &&
+     (multi_path != NULL || listen_addr != NULL || histogram_mode || out_format != FORMAT_RAW ||
+      capture_path != NULL || direct_path != NULL || sinks != NULL ||
+      daemon_addr != NULL || via_addr != NULL)){
+    fprintf(stderr, "ERROR: --shm cannot be combined with -m, -l, -H, -f, -w, -o, -S, --daemon or --via\n");
+    exit(1);
+  }
+  if(trig != NULL &&
+     (multi_path != NULL || listen_addr != NULL || histogram_mode || out_format != FORMAT_RAW ||
+      capture_path != NULL || sinks != NULL || shm_name != NULL ||
+      daemon_addr != NULL || via_addr != NULL)){
+    fprintf(stderr, "ERROR: -T cannot be combined with -m, -l, -H, -f, -w, -S, --shm, --daemon or --via\n");
+    exit(1);
+  }
+  if(compress_mode >= 0 &&
+     (multi_path != NULL || listen_addr != NULL || histogram_mode || out_format != FORMAT_RAW ||
+      capture_path != NULL || sinks != NULL || shm_name != NULL || trig != NULL || zero_copy ||
+      daemon_addr != NULL || via_addr != NULL)){
+    fprintf(stderr, "ERROR: -Z cannot be combined with -m, -l, -H, -f, -w, -S, --shm, -T, -z, "
+            "--daemon or --via\n");
+    exit(1);
+  }
+  if((!reader_cpus.empty() || rt_priority > 0) && !realtime){
+    fprintf(stderr, "ERROR: --cpus and --rt-priority need --realtime\n");
+    exit(1);
+  }
+  if(realtime && (daemon_addr != NULL || via_addr != NULL)){
+    fprintf(stderr, "ERROR: --realtime cannot be combined with --daemon or --via\n");
+    exit(1);
+  }
+  if(compress_threads > 0 && compress_mode < 0 && decompress_path == NULL){
+    fprintf(stderr, "ERROR: --compress-threads needs -Z or --decompress\n");
+    exit(1);
+  }
+  if(compress_block != Z_DEFAULT_BLOCK_BYTES && compress_mode < 0){
+    fprintf(stderr, "ERROR: --compress-block needs -Z\n");
+    exit(1);
+  }
+  if((trig_pre >= 0 || trig_post >= 0) && trig == NULL){
+    fprintf(stderr, "ERROR: --pre and --post need -T\n");
+    exit(1);
+  }
+  if(trig != NULL){
+    trig->set_window(trig_pre >= 0 ? trig_pre : 65536, trig_post >= 0 ? trig_post : 65536);
+  }
+  if(hist_interval > 0 && !histogram_mode){
+    fprintf(stderr, "ERROR: --hist-interval needs -H\n");
+    exit(1);
+  }
+  if(split_pattern != NULL && !valid_split_pattern(split_pattern)){
+    fprintf(stderr, "ERROR: --split pattern must contain one %%d\n");
+    exit(1);
+  }
+  
   signal(SIGINT, &cancel_out);
-  int n_ports;
+  signal(SIGUSR1, &request_dump);
+  if(sinks != NULL){
+    /* A monitor going away is reported, not fatal.
+     */
+    signal(SIGPIPE, SIG_IGN);
+  }
   
-  DptiGetPortCount(hif, &n_ports);
+  if(decompress_path != NULL){
+    return z_decompress(decompress_path, 1, compress_threads);
+  }
   
-  fprintf(stderr, "Number of ports on %s: %i\n", dev_name, n_ports);
+  if(daemon_addr != NULL){
+    return run_daemon(argc, argv);
+  }
   
-  if(argc < 3){
-    fprintf(stderr, "ERROR: no port specified");
-    DmgrClose(hif);
+  if(argc < 2 && multi_path == NULL) {
+    fprintf(stderr, "ERROR: no device specified\n");
     fflush(stderr);
-    exit(3);
+    exit(1);
   }
-  DPRP port_props;
-  int port_num = atoi(argv[2]);
   
-  DptiGetPortProperties(hif, port_num, &port_props);
+  if(via_addr != NULL){
+    if(argc < 3){
+      fprintf(stderr, "ERROR: no port specified\n");
+      exit(3);
+    }
+    return run_client(argv[1], atoi(argv[2]));
+  }
   
-  if(port_props & dprpPtiAsynchronous){
-    fprintf(stderr, "Port %i is asynchronous\n", port_num);
+  std::vector<source *> sources;
+  if(multi_path != NULL){
+    if(!read_multi(multi_path, sources)){
+      exit(1);
+    }
   }
   else{
-    fprintf(stderr, "Port %i is synchronous\n", port_num);
+    if(argc < 3){
+      fprintf(stderr, "ERROR: no port specified\n");
+      exit(3);
+    }
+    source *src = new source;
+    src->id = 0;
+    snprintf(src->name, sizeof(src->name), "%s", argv[1]);
+    src->port = atoi(argv[2]);
+    sources.push_back(src);
   }
   
-  if (!DptiEnableEx(hif, port_num)){
-    fprintf(stderr, "ERROR: failed to enable port %i\n", port_num);
-    DmgrClose(hif);
-    fflush(stderr);
-    exit(4);
-  }
-  
-  
-  int n_bytes = 128;
-  byte *out_bytes = new byte[1];
-  byte *in_bytes = new byte[n_bytes];
-  
-  for(int test_count = 0; true; test_count++){
-    fprintf(stderr, "Test %i\n", test_count);
-    //int n_bytes = rand() & 0xFF;
-    out_bytes[0] = n_bytes;
-    //out_bytes[1] = 255 - n_bytes;
-    for(int i = 0; i < n_bytes; i++){
-      in_bytes[i] = 0xBA;
-    }
-    
-    fprintf(stderr, "Requesting %i bytes\n", out_bytes[0]);
-    
-    DptiIO(hif, out_bytes, 1, NULL, 0, false);
-    
-
-    fprintf(stderr, "Request Sent\nReceiving %i bytes\n", out_bytes[0]);
-    
-    DptiIO(hif, NULL, 0, in_bytes, out_bytes[0], false);
-
-    //printf("Data Received\nRequesting Remaining %i bytes\n", out_bytes[1]);
-    
-    //DptiIO(hif, out_bytes+1, 1, NULL, 0, false);
-    
-    //printf("Request Sent\nReceiving %i bytes\n", out_bytes[1]);
-    
-    //DptiIO(hif, NULL, 0, in_bytes+out_bytes[0], out_bytes[1], false);
-        
-    fprintf(stderr, "Data received, printing...\n");
-    int bytes_written = 0;
-    while(bytes_written < out_bytes[0]){
-      int bytes_add = write(1, in_bytes, out_bytes[0]);
-      if(bytes_add <= 0){
-	break;
-      }
-      bytes_written += bytes_add;
-    }
-  }
-  DmgrClose(hif);
-  return 0;
+  int status = 0;
+  for(size_t i = 0; i < sources.size() && status == 0; i++){
+    sources[i]->trans = open_device(sources[i]->name, sources[i]->port, &status);
+  }
+  if(status == 0){
+    status = run_capture(sources, 1);
+  }
+  for(size_t i = 0; i < sources.size(); i++){
+    if(sources[i]->trans != NULL){
+      sources[i]->trans->close();
+      delete sources[i]->trans;
+    }
+    delete sources[i];
+  }
+  fflush(stderr);
+  return status;
 }
@@ -0,0 +1,420 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <thread>
+
+#include "fanout.h"
+#include "capture.h"
+#include "server.h"
+#include "util.h"
+
+/* Bytes a sink reads back from its spill file at a time.
+ */
+#define SPILL_READ_BYTES (256 * 1024)
+
+/* How long a sink that does not block gets to catch up at the end
+ * before it is cut off.
+ */
+#define SINK_DRAIN_NS 2000000000ull
+
+/* A chunk on its way to the sinks. refs counts the blocking sinks that
+ * still have to write it, plus one while the dispatcher is handing it
+ * out.
+ */
+struct fan_buf {
+  chunk *c;
+  std::atomic<int> refs;
+};
+
+/* An entry in a sink's queue: a ring chunk held by reference (b set),
+ * or for the other policies the sink's own copy of one.
+ */
+struct fan_item {
+  const byte *data;
+  size_t len;
+  fan_buf *b;
+};
+
+struct sink {
+  int id;
+  char dest[256];
+  int policy;
+  char spill_path[256];
+  int fd;
+  chunk_ring *ring;
+  tel_thread *tel;
+  std::thread thread;
+
+  /* Single-producer/single-consumer queue: the dispatcher pushes at
+   * head, the sink thread pops at tail. Sinks that do not block copy
+   * their chunks into copies, one slot per queue entry, so a stalled one
+   * never holds on to the ring.
+   */
+  std::vector<fan_item> q;
+  std::vector<byte> copies;
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  std::atomic<bool> closing;
+  std::atomic<bool> dead;
+
+  /* While spilling, chunks go to the spill file instead of the queue.
+   * spill_written is only touched under spill_mtx.
+   */
+  int spill_fd;
+  std::mutex spill_mtx;
+  std::atomic<bool> spilling;
+  uint64_t spill_written;
+  uint64_t spill_read;
+
+  uint64_t bytes;
+  uint64_t dropped;
+  uint64_t spilled;
+  bool cut;                 // given up on at the end with data left
+
+  sink() : fd(-1), ring(NULL), tel(NULL), head(0), tail(0), closing(false), dead(false),
+           spill_fd(-1), spilling(false), spill_written(0), spill_read(0),
+           bytes(0), dropped(0), spilled(0), cut(false) {}
+};
+
+/* The sink's output went away. Losing a blocking sink ends the capture
+ * with an error, the others are just left behind.
+ */
+static void sink_failed(sink *s, const char *what){
+  if(s->dead){
+    return;
+  }
+  s->dead = true;
+  if(s->policy == SINK_BLOCK){
+    fprintf(stderr, "ERROR: %s sink %s: %s\n", what, s->dest, strerror(errno));
+    stop_requested = 1;
+    s->ring->stop();
+  }
+  else{
+    fprintf(stderr, "WARNING: %s sink %s: %s\n", what, s->dest, strerror(errno));
+  }
+}
+
+static void sink_write(sink *s, const byte *data, size_t len){
+  if(s->dead){
+    return;
+  }
+  uint64_t t_write = now_ns();
+  if(!write_all(s->fd, data, len)){
+    sink_failed(s, "lost");
+    return;
+  }
+  s->tel->record(TEL_WRITE, now_ns() - t_write);
+  s->tel->count(len);
+  s->bytes += len;
+}
+
+/* Write the next part of the spill file. Once it is drained the file is
+ * emptied and the sink goes back to its queue.
+ */
+static void drain_spill(sink *s, byte *buf){
+  uint64_t avail;
+  {
+    std::lock_guard<std::mutex> lock(s->spill_mtx);
+    avail = s->spill_written - s->spill_read;
+    if(avail == 0){
+      if(ftruncate(s->spill_fd, 0) != 0){
+        sink_failed(s, "cannot truncate spill file of");
+      }
+      s->spill_written = s->spill_read = 0;
+      s->spilling.store(false, std::memory_order_release);
+      return;
+    }
+  }
+  size_t n = avail < SPILL_READ_BYTES ? avail : SPILL_READ_BYTES;
+  ssize_t got = pread(s->spill_fd, buf, n, s->spill_read);
+  if(got <= 0){
+    sink_failed(s, "cannot read spill file of");
+    std::lock_guard<std::mutex> lock(s->spill_mtx);
+    s->spill_read = s->spill_written;
+    return;
+  }
+  sink_write(s, buf, got);
+  s->spill_read += got;
+}
+
+static void sink_run(sink *s){
+  std::vector<byte> buf(SPILL_READ_BYTES);
+  int spins = 0;
+  while(true){
+    bool closing = s->closing.load(std::memory_order_acquire);
+    uint64_t t = s->tail.load(std::memory_order_relaxed);
+    if(t != s->head.load(std::memory_order_acquire)){
+      const fan_item &item = s->q[t % s->q.size()];
+      sink_write(s, item.data, item.len);
+      if(item.b != NULL){
+        item.b->refs.fetch_sub(1, std::memory_order_release);
+      }
+      s->tail.store(t + 1, std::memory_order_release);
+      spins = 0;
+    }
+    else if(s->spilling.load(std::memory_order_acquire)){
+      drain_spill(s, buf.data());
+      spins = 0;
+    }
+    else if(closing){
+      break;
+    }
+    else{
+      ring_backoff(spins);
+    }
+  }
+}
+
+fanout::fanout() : bufs(NULL), n_bufs(0), n_taken(0), n_released(0) {
+}
+
+fanout::~fanout(){
+  for(size_t i = 0; i < sinks.size(); i++){
+    delete sinks[i];
+  }
+  delete[] bufs;
+}
+
+bool fanout::add(const char *spec){
+  sink *s = new sink;
+  s->id = sinks.size();
+  s->policy = SINK_BLOCK;
+  s->spill_path[0] = '\0';
+  if(strlen(spec) >= sizeof(s->dest)){
+    fprintf(stderr, "ERROR: sink too long: %s\n", spec);
+    delete s;
+    return false;
+  }
+  strcpy(s->dest, spec);
+
+  char *comma = strrchr(s->dest, ',');
+  if(comma != NULL){
+    const char *policy = comma + 1;
+    if(strcmp(policy, "block") == 0){
+      s->policy = SINK_BLOCK;
+    }
+    else if(strcmp(policy, "drop") == 0){
+      s->policy = SINK_DROP;
+    }
+    else if(strncmp(policy, "spill=", 6) == 0 && policy[6] != '\0'){
+      s->policy = SINK_SPILL;
+      strcpy(s->spill_path, policy + 6);
+    }
+    else{
+      fprintf(stderr, "ERROR: invalid sink policy %s\n", policy);
+      delete s;
+      return false;
+    }
+    *comma = '\0';
+  }
+  if(s->dest[0] == '\0'){
+    fprintf(stderr, "ERROR: sink without a destination: %s\n", spec);
+    delete s;
+    return false;
+  }
+  sinks.push_back(s);
+  return true;
+}
+
+bool fanout::open(){
+  for(size_t i = 0; i < sinks.size(); i++){
+    sink *s = sinks[i];
+    if(strcmp(s->dest, "-") == 0){
+      s->fd = 1;
+    }
+    else if(strncmp(s->dest, "tcp:", 4) == 0 || strncmp(s->dest, "unix:", 5) == 0){
+      s->fd = server_connect(s->dest);
+      if(s->fd < 0){
+        return false;
+      }
+    }
+    else{
+      s->fd = ::open(s->dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if(s->fd < 0){
+        fprintf(stderr, "ERROR: cannot create %s: %s\n", s->dest, strerror(errno));
+        return false;
+      }
+    }
+    if(s->policy == SINK_SPILL){
+      s->spill_fd = ::open(s->spill_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+      if(s->spill_fd < 0){
+        fprintf(stderr, "ERROR: cannot create %s: %s\n", s->spill_path, strerror(errno));
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/* Give the ring back the chunks every sink is done with, in order.
+ */
+void fanout::release_done(chunk_ring *ring){
+  while(n_released < n_taken &&
+        bufs[n_released % n_bufs].refs.load(std::memory_order_acquire) == 0){
+    ring->release();
+    n_released++;
+  }
+}
+
+/* Queue b for s, or apply its policy if the queue is full. Returns
+ * false if the sink did not take a reference; only blocking sinks do.
+ */
+bool fanout::deliver(sink *s, fan_buf *b, chunk_ring *ring){
+  if(s->dead){
+    return false;
+  }
+  if(s->spilling.load(std::memory_order_acquire)){
+    std::lock_guard<std::mutex> lock(s->spill_mtx);
+    if(s->spilling.load(std::memory_order_relaxed)){
+      if(!write_all(s->spill_fd, b->c->data, b->c->len)){
+        sink_failed(s, "cannot spill for");
+        return false;
+      }
+      s->spill_written += b->c->len;
+      s->spilled += b->c->len;
+      return false;
+    }
+  }
+
+  uint64_t h = s->head.load(std::memory_order_relaxed);
+  int spins = 0;
+  while(h - s->tail.load(std::memory_order_acquire) >= s->q.size()){
+    if(s->dead){
+      return false;
+    }
+    if(s->policy == SINK_DROP){
+      s->dropped += b->c->len;
+      return false;
+    }
+    if(s->policy == SINK_SPILL){
+      std::lock_guard<std::mutex> lock(s->spill_mtx);
+      if(!write_all(s->spill_fd, b->c->data, b->c->len)){
+        sink_failed(s, "cannot spill for");
+        return false;
+      }
+      s->spill_written += b->c->len;
+      s->spilled += b->c->len;
+      s->spilling.store(true, std::memory_order_release);
+      return false;
+    }
+    release_done(ring);
+    ring_backoff(spins);
+  }
+  fan_item &item = s->q[h % s->q.size()];
+  item.len = b->c->len;
+  if(s->policy == SINK_BLOCK){
+    b->refs.fetch_add(1, std::memory_order_relaxed);
+    item.data = b->c->data;
+    item.b = b;
+  }
+  else{
+    byte *copy = &s->copies[(h % s->q.size()) * ring->chunk_bytes()];
+    memcpy(copy, b->c->data, b->c->len);
+    item.data = copy;
+    item.b = NULL;
+  }
+  s->head.store(h + 1, std::memory_order_release);
+  return item.b != NULL;
+}
+
+void fanout::run(chunk_ring *ring, telemetry *tel){
+  n_bufs = ring->size();
+  bufs = new fan_buf[n_bufs];
+  n_taken = n_released = 0;
+  for(size_t i = 0; i < sinks.size(); i++){
+    sink *s = sinks[i];
+    size_t cap = n_bufs;
+    if(s->policy != SINK_BLOCK){
+      cap = n_bufs / 4 > 0 ? n_bufs / 4 : 1;
+      s->copies.resize(cap * ring->chunk_bytes());
+    }
+    s->q.resize(cap);
+    s->ring = ring;
+    s->tel = tel->add("sink %i", s->id);
+    s->thread = std::thread(sink_run, s);
+  }
+
+  int spins = 0;
+  while(true){
+    release_done(ring);
+    chunk *c = ring->try_peek_ahead(n_taken - n_released);
+    if(c == NULL){
+      if(ring->finished_ahead(n_taken - n_released)){
+        break;
+      }
+      ring_backoff(spins);
+      continue;
+    }
+    spins = 0;
+    fan_buf *b = &bufs[n_taken % n_bufs];
+    b->c = c;
+    b->refs.store(1, std::memory_order_relaxed);
+    n_taken++;
+    if(c->len > 0){
+      for(size_t i = 0; i < sinks.size(); i++){
+        deliver(sinks[i], b, ring);
+      }
+    }
+    b->refs.fetch_sub(1, std::memory_order_release);
+  }
+
+  for(size_t i = 0; i < sinks.size(); i++){
+    sinks[i]->closing.store(true, std::memory_order_release);
+  }
+
+  /* A sink that does not block may be stuck behind a peer that stopped
+   * reading. Give it a while to catch up, then cut it off; shutting a
+   * socket down also gets its thread out of a write.
+   */
+  uint64_t t_give_up = now_ns() + SINK_DRAIN_NS;
+  for(size_t i = 0; i < sinks.size(); i++){
+    sink *s = sinks[i];
+    if(s->policy == SINK_BLOCK){
+      continue;
+    }
+    bool behind;
+    while((behind = !s->dead && (s->tail.load(std::memory_order_acquire) !=
+                                 s->head.load(std::memory_order_relaxed) ||
+                                 s->spilling.load(std::memory_order_acquire))) &&
+          now_ns() < t_give_up){
+      struct timespec ts = {0, 10000000};
+      nanosleep(&ts, NULL);
+    }
+    if(behind){
+      s->cut = true;
+      s->dead = true;
+      shutdown(s->fd, SHUT_RDWR);
+    }
+  }
+  for(size_t i = 0; i < sinks.size(); i++){
+    sinks[i]->thread.join();
+  }
+  release_done(ring);
+}
+
+void fanout::report(FILE *f){
+  for(size_t i = 0; i < sinks.size(); i++){
+    sink *s = sinks[i];
+    fprintf(f, "Sink %i (%s): %llu bytes", s->id, s->dest, (unsigned long long)s->bytes);
+    if(s->policy == SINK_DROP){
+      fprintf(f, ", %llu dropped", (unsigned long long)s->dropped);
+    }
+    if(s->policy == SINK_SPILL){
+      fprintf(f, ", %llu spilled", (unsigned long long)s->spilled);
+    }
+    fprintf(f, "%s\n", s->cut ? ", cut short at the end" : s->dead ? ", lost" : "");
+    if(s->fd > 1){
+      close(s->fd);
+    }
+    s->fd = -1;
+    if(s->spill_fd >= 0){
+      close(s->spill_fd);
+      unlink(s->spill_path);
+      s->spill_fd = -1;
+    }
+  }
+}
@@ -0,0 +1,78 @@
+/* fanout.h -- one stream, several outputs.
+ *
+ * With sinks given, the capture's chunks are handed to every sink by
+ * reference instead of being copied: each sink thread writes the chunk
+ * out of the ring slot it arrived in, and the slot goes back to the
+ * reader once the last sink holding it is done. Each sink has its own
+ * queue of chunks and a policy for when that queue is full:
+ *
+ *   block   wait for the sink; the whole capture goes at its pace
+ *   drop    skip the chunk for this sink and count it
+ *   spill   append the chunk to a spill file, which the sink drains
+ *           before it takes chunks from its queue again
+ *
+ * Only blocking sinks hold on to ring slots, and may queue the whole
+ * ring. The others copy their chunks into a queue a quarter of the ring
+ * long, so a stalled monitor never holds back the archive. Losing a
+ * blocking sink ends the capture with an error.
+ *
+ * A sink is written as DEST[,POLICY], where DEST is "-" for stdout,
+ * tcp:HOST:PORT or unix:PATH to connect to, or a file path, and POLICY
+ * is block (the default), drop or spill=PATH.
+ */
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "ring.h"
+#include "telemetry.h"
+
+enum {
+  SINK_BLOCK,
+  SINK_DROP,
+  SINK_SPILL,
+};
+
+struct fan_buf;
+struct sink;
+
+class fanout {
+public:
+  fanout();
+  ~fanout();
+
+  /* Add the sink described by spec. Returns false after printing an
+   * error.
+   */
+  bool add(const char *spec);
+
+  /* Open every sink's output. Returns false after printing an error.
+   */
+  bool open();
+
+  /* Writer thread: hand ring's chunks to the sinks until it is drained.
+   */
+  void run(chunk_ring *ring, telemetry *tel);
+
+  /* Per-sink totals, and close the outputs.
+   */
+  void report(FILE *f);
+
+private:
+  bool deliver(sink *s, fan_buf *b, chunk_ring *ring);
+  void release_done(chunk_ring *ring);
+
+  std::vector<sink *> sinks;
+  fan_buf *bufs;
+  size_t n_bufs;
+  uint64_t n_taken;         // chunks taken from the ring
+  uint64_t n_released;      // and given back
+};
+
+#endif
@@ -0,0 +1,30 @@
+/* frame.h -- framed transport.
+ *
+ * A bitstream built with framing answers every read request for N bytes
+ * with a frame of N + FRAME_OVERHEAD bytes:
+ *
+ *   frame_header   magic, sequence number, N
+ *   N bytes        data
+ *   uint32_t       CRC-32C of the header and the data
+ *
+ * All fields are little-endian. The sequence number counts frames from 0
+ * and wraps, so the host can tell dropped frames from corrupted ones.
+ */
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+
+#define FRAME_MAGIC 0x46545044u  /* "DPTF" */
+
+struct frame_header {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t length;
+};
+
+#define FRAME_HEADER_BYTES sizeof(frame_header)
+#define FRAME_TRAILER_BYTES 4
+#define FRAME_OVERHEAD (FRAME_HEADER_BYTES + FRAME_TRAILER_BYTES)
+
+#endif
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "util.h"
+
+hist_set::hist_set() :
+  fine(HIST_FINE_BINS), coarse(HIST_COARSE_BINS), n_words(0), n_snapshots(0) {
+}
+
+void hist_set::merge(const uint64_t *f, const uint64_t *c, uint64_t n){
+  std::lock_guard<std::mutex> lock(mtx);
+  for(int i = 0; i < HIST_FINE_BINS; i++){
+    fine[i] += f[i];
+  }
+  for(int i = 0; i < HIST_COARSE_BINS; i++){
+    coarse[i] += c[i];
+  }
+  n_words += n;
+}
+
+std::string hist_set::snapshot(double t){
+  std::lock_guard<std::mutex> lock(mtx);
+  std::string s;
+  char line[80];
+  snprintf(line, sizeof(line), "# histogram %i t=%.3f words=%llu\n",
+           n_snapshots++, t, (unsigned long long)n_words);
+  s += line;
+  for(int i = 0; i < HIST_FINE_BINS; i++){
+    if(fine[i] != 0){
+      snprintf(line, sizeof(line), "fine %i %llu\n", i, (unsigned long long)fine[i]);
+      s += line;
+    }
+  }
+  for(int i = 0; i < HIST_COARSE_BINS; i++){
+    if(coarse[i] != 0){
+      snprintf(line, sizeof(line), "coarse_delta %i %llu\n", i, (unsigned long long)coarse[i]);
+      s += line;
+    }
+  }
+  return s;
+}
+
+hist_thread::hist_thread(hist_set *set) :
+  set(set), n_words(0), last_coarse(0), have_last(false) {
+  /* Own cache lines, so threads binning side by side never share one.
+   */
+  size_t len = (HIST_FINE_BINS + HIST_COARSE_BINS) * sizeof(uint64_t);
+  void *p = NULL;
+  if(posix_memalign(&p, 64, len) != 0){
+    abort();
+  }
+  bins = (uint64_t *)p;
+  memset(bins, 0, len);
+  t_merge = now_ns() + HIST_MERGE_NS;
+}
+
+hist_thread::~hist_thread(){
+  flush();
+  free(bins);
+}
+
+void hist_thread::add(const ts_fields *f, size_t n){
+  if(n == 0){
+    return;
+  }
+  uint64_t *fine = bins;
+  uint64_t *coarse = bins + HIST_FINE_BINS;
+  size_t i = 0;
+  if(!have_last){
+    fine[f[0].fine]++;
+    last_coarse = f[0].coarse;
+    have_last = true;
+    i = 1;
+  }
+  for(; i < n; i++){
+    uint64_t d = f[i].coarse - last_coarse;
+    last_coarse = f[i].coarse;
+    fine[f[i].fine]++;
+    coarse[d < HIST_COARSE_BINS ? d : HIST_COARSE_BINS - 1]++;
+  }
+  n_words += n;
+
+  if(now_ns() >= t_merge){
+    flush();
+  }
+}
+
+void hist_thread::flush(){
+  set->merge(bins, bins + HIST_FINE_BINS, n_words);
+  memset(bins, 0, (HIST_FINE_BINS + HIST_COARSE_BINS) * sizeof(uint64_t));
+  n_words = 0;
+  t_merge = now_ns() + HIST_MERGE_NS;
+}
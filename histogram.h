@@ -0,0 +1,76 @@
+/* histogram.h -- online histograms of the decoded timestamp fields.
+ *
+ * Instead of the stream, dpticat can write periodic snapshots of two
+ * histograms: the fine field (one bin per code) and the coarse
+ * difference between consecutive words (one bin per count, the last bin
+ * also counting everything larger).
+ *
+ * Each writer thread bins its words into its own cache-aligned
+ * hist_thread and merges that into the shared hist_set every
+ * HIST_MERGE_NS, so the hot path takes no lock and shares no cache lines.
+ * Snapshots are cumulative and list the non-zero bins:
+ *
+ *   # histogram <n> t=<seconds> words=<total>
+ *   fine <code> <count>
+ *   coarse_delta <delta> <count>
+ */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "decode.h"
+
+#define HIST_FINE_BINS (1 << FINE)
+#define HIST_COARSE_BINS 1024
+
+/* How often a thread merges its bins into the set.
+ */
+#define HIST_MERGE_NS 100000000ull
+
+class hist_set {
+public:
+  hist_set();
+
+  /* Add a thread's bins to the totals.
+   */
+  void merge(const uint64_t *fine, const uint64_t *coarse, uint64_t n_words);
+
+  /* Text snapshot of the totals, t seconds into the capture.
+   */
+  std::string snapshot(double t);
+
+private:
+  std::mutex mtx;
+  std::vector<uint64_t> fine;
+  std::vector<uint64_t> coarse;
+  uint64_t n_words;
+  int n_snapshots;
+};
+
+class hist_thread {
+public:
+  hist_thread(hist_set *set);
+  ~hist_thread();
+
+  void add(const ts_fields *f, size_t n);
+
+  /* Merge what has been binned since the last merge into the set.
+   */
+  void flush();
+
+private:
+  hist_set *set;
+  uint64_t *bins;       // HIST_FINE_BINS fine bins, then the coarse ones
+  uint64_t n_words;
+  uint64_t last_coarse;
+  bool have_last;
+  uint64_t t_merge;
+};
+
+#endif
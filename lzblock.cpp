@@ -0,0 +1,183 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lzblock.h"
+
+#define LZ_HASH_LOG 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+/* The format ends every block with at least LZ_LAST_LITERALS literals,
+ * and no match may start within LZ_MF_LIMIT bytes of the end.
+ */
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT 12
+
+static inline uint32_t read32(const byte *p){
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v){
+  return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static inline byte *put_length(byte *op, size_t len){
+  while(len >= 255){
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (byte)len;
+  return op;
+}
+
+size_t lz_compress(const byte *in, size_t n, byte *out, size_t cap){
+  const byte *ip = in;
+  const byte *anchor = in;
+  const byte *end = in + n;
+  byte *op = out;
+  byte *oend = out + cap;
+
+  if(n > LZ_MF_LIMIT){
+    const byte *mf_limit = end - LZ_MF_LIMIT;
+    const byte *match_limit = end - LZ_LAST_LITERALS;
+    uint32_t table[1 << LZ_HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    while(ip < mf_limit){
+      uint32_t h = lz_hash(read32(ip));
+      const byte *ref = in + table[h];
+      table[h] = ip - in;
+      if(ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != read32(ip)){
+        /* Step further the longer nothing has matched, so incompressible
+         * data goes through quickly.
+         */
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      while(ip > anchor && ref > in && ip[-1] == ref[-1]){
+        ip--;
+        ref--;
+      }
+      const byte *p = ip + LZ_MIN_MATCH;
+      const byte *r = ref + LZ_MIN_MATCH;
+      while(p < match_limit && *p == *r){
+        p++;
+        r++;
+      }
+
+      size_t lit = ip - anchor;
+      size_t mlen = p - ip - LZ_MIN_MATCH;
+      if((size_t)(oend - op) < lit + lit / 255 + mlen / 255 + 8){
+        return 0;
+      }
+      byte *token = op++;
+      if(lit >= 15){
+        *token = 15 << 4;
+        op = put_length(op, lit - 15);
+      }
+      else{
+        *token = lit << 4;
+      }
+      memcpy(op, anchor, lit);
+      op += lit;
+      size_t off = ip - ref;
+      *op++ = off & 0xff;
+      *op++ = off >> 8;
+      if(mlen >= 15){
+        *token |= 15;
+        op = put_length(op, mlen - 15);
+      }
+      else{
+        *token |= mlen;
+      }
+      ip = anchor = p;
+      if(ip < mf_limit){
+        table[lz_hash(read32(ip - 2))] = ip - 2 - in;
+      }
+    }
+  }
+
+  size_t lit = end - anchor;
+  if((size_t)(oend - op) < lit + lit / 255 + 2){
+    return 0;
+  }
+  if(lit >= 15){
+    *op++ = 15 << 4;
+    op = put_length(op, lit - 15);
+  }
+  else{
+    *op++ = lit << 4;
+  }
+  memcpy(op, anchor, lit);
+  op += lit;
+  return op - out;
+}
+
+/* Add the extra length bytes at *ip to len; false if they run off the
+ * end.
+ */
+static inline bool get_length(const byte **ip, const byte *iend, size_t *len){
+  byte b;
+  do{
+    if(*ip >= iend){
+      return false;
+    }
+    b = *(*ip)++;
+    *len += b;
+  } while(b == 255);
+  return true;
+}
+
+bool lz_decompress(const byte *in, size_t n, byte *out, size_t raw_len){
+  const byte *ip = in;
+  const byte *iend = in + n;
+  byte *op = out;
+  byte *oend = out + raw_len;
+
+  while(ip < iend){
+    unsigned token = *ip++;
+    size_t lit = token >> 4;
+    if(lit == 15 && !get_length(&ip, iend, &lit)){
+      return false;
+    }
+    if(lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)){
+      return false;
+    }
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if(ip == iend){
+      break;
+    }
+
+    if(iend - ip < 2){
+      return false;
+    }
+    size_t off = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    size_t mlen = token & 15;
+    if(mlen == 15 && !get_length(&ip, iend, &mlen)){
+      return false;
+    }
+    mlen += LZ_MIN_MATCH;
+    if(off == 0 || off > (size_t)(op - out) || mlen > (size_t)(oend - op)){
+      return false;
+    }
+    const byte *m = op - off;
+    if(off >= mlen){
+      memcpy(op, m, mlen);
+      op += mlen;
+    }
+    else{
+      /* The match overlaps what it writes: a repeating pattern.
+       */
+      for(size_t i = 0; i < mlen; i++){
+        *op++ = m[i];
+      }
+    }
+  }
+  return op == oend;
+}
@@ -0,0 +1,26 @@
+/* lzblock.h -- fast LZ77 block compression in the LZ4 block format.
+ *
+ * A small greedy compressor (one hash probe per position, skipping ahead
+ * faster the longer nothing matches) and a bounds-checked decompressor
+ * for the LZ4 block format, so blocks written by dpticat can also be
+ * read with any LZ4 library's LZ4_decompress_safe(). There is no frame
+ * format here; compress.h frames the blocks.
+ */
+#ifndef LZBLOCK_H
+#define LZBLOCK_H
+
+#include <stddef.h>
+
+#include "transport.h"
+
+/* Compress n bytes of in into out, which has room for cap bytes.
+ * Returns the compressed length, or 0 if it would not fit.
+ */
+size_t lz_compress(const byte *in, size_t n, byte *out, size_t cap);
+
+/* Decompress the n bytes at in, which must come to exactly raw_len
+ * bytes, into out. Returns false if the block is corrupt.
+ */
+bool lz_decompress(const byte *in, size_t n, byte *out, size_t raw_len);
+
+#endif
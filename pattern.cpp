@@ -0,0 +1,151 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PATTERN_AVX2
+#endif
+
+#include "pattern.h"
+
+static bool have_avx2(){
+#ifdef PATTERN_AVX2
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+#else
+  return false;
+#endif
+}
+
+pattern_gen::pattern_gen(uint64_t seed) : block_off(PATTERN_BLOCK) {
+  /* xorshift64 must not start from 0; splitmix64 spreads the seed over
+   * the lanes.
+   */
+  uint64_t x = seed;
+  for(int i = 0; i < PATTERN_LANES; i++){
+    x += 0x9e3779b97f4a7c15ull;
+    uint64_t z = x;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    s[i] = (z ^ (z >> 31)) | 1;
+  }
+}
+
+/* One xorshift64 (13, 7, 17) step on every lane, stored as the next
+ * block of the pattern.
+ */
+void pattern_gen::next_block(byte *out){
+  for(int i = 0; i < PATTERN_LANES; i++){
+    uint64_t x = s[i];
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    s[i] = x;
+  }
+  memcpy(out, s, PATTERN_BLOCK);
+}
+
+#ifdef PATTERN_AVX2
+__attribute__((target("avx2")))
+static void fill_blocks_avx2(uint64_t *s, byte *out, size_t n_blocks){
+  __m256i x = _mm256_loadu_si256((const __m256i *)s);
+  for(size_t i = 0; i < n_blocks; i++){
+    x = _mm256_xor_si256(x, _mm256_slli_epi64(x, 13));
+    x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 7));
+    x = _mm256_xor_si256(x, _mm256_slli_epi64(x, 17));
+    _mm256_storeu_si256((__m256i *)(out + i * PATTERN_BLOCK), x);
+  }
+  _mm256_storeu_si256((__m256i *)s, x);
+}
+#endif
+
+void pattern_gen::fill(byte *buf, size_t n){
+  /* Finish the block a previous fill stopped in.
+   */
+  size_t take = PATTERN_BLOCK - block_off < n ? PATTERN_BLOCK - block_off : n;
+  memcpy(buf, block + block_off, take);
+  block_off += take;
+  buf += take;
+  n -= take;
+
+  size_t n_blocks = n / PATTERN_BLOCK;
+#ifdef PATTERN_AVX2
+  if(have_avx2()){
+    fill_blocks_avx2(s, buf, n_blocks);
+  }
+  else
+#endif
+  {
+    for(size_t i = 0; i < n_blocks; i++){
+      next_block(buf + i * PATTERN_BLOCK);
+    }
+  }
+  buf += n_blocks * PATTERN_BLOCK;
+  n -= n_blocks * PATTERN_BLOCK;
+
+  if(n > 0){
+    next_block(block);
+    memcpy(buf, block, n);
+    block_off = n;
+  }
+}
+
+void bit_errors_clear(bit_errors *e){
+  memset(e, 0, sizeof(*e));
+}
+
+/* Account for every differing byte of a block.
+ */
+static void count_errors(const byte *expect, const byte *got, size_t n,
+                         uint64_t offset, bit_errors *e){
+  for(size_t i = 0; i < n; i++){
+    byte d = expect[i] ^ got[i];
+    if(d == 0){
+      continue;
+    }
+    e->errors += __builtin_popcount(d);
+    e->bad_bytes++;
+    for(int b = 0; b < 8; b++){
+      e->by_bit[b] += (d >> b) & 1;
+    }
+    if(e->n_first < PATTERN_FIRST_ERRORS){
+      e->first[e->n_first++] = offset + i;
+    }
+  }
+}
+
+#ifdef PATTERN_AVX2
+__attribute__((target("avx2")))
+static size_t compare_avx2(const byte *expect, const byte *got, size_t n,
+                           uint64_t offset, bit_errors *e){
+  size_t i = 0;
+  for(; i + PATTERN_BLOCK <= n; i += PATTERN_BLOCK){
+    __m256i a = _mm256_loadu_si256((const __m256i *)(expect + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(got + i));
+    __m256i d = _mm256_xor_si256(a, b);
+    if(!_mm256_testz_si256(d, d)){
+      count_errors(expect + i, got + i, PATTERN_BLOCK, offset + i, e);
+    }
+  }
+  return i;
+}
+#endif
+
+void pattern_compare(const byte *expect, const byte *got, size_t n,
+                     uint64_t offset, bit_errors *e){
+  size_t i = 0;
+#ifdef PATTERN_AVX2
+  if(have_avx2()){
+    i = compare_avx2(expect, got, n, offset, e);
+  }
+#endif
+  for(; i + 8 <= n; i += 8){
+    uint64_t a, b;
+    memcpy(&a, expect + i, 8);
+    memcpy(&b, got + i, 8);
+    if(a != b){
+      count_errors(expect + i, got + i, 8, offset + i, e);
+    }
+  }
+  count_errors(expect + i, got + i, n - i, offset + i, e);
+  e->bits += (uint64_t)n * 8;
+}
@@ -0,0 +1,56 @@
+/* pattern.h -- test pattern generation and bit error counting.
+ *
+ * The pattern is four interleaved xorshift64 streams, one per 64-bit
+ * lane of an AVX2 register, so a fill produces 32 bytes per step. It is
+ * a byte stream: consecutive fills continue where the last one stopped,
+ * whatever their lengths.
+ *
+ * The compare skips 32-byte blocks that match with a single vector test
+ * and only looks at the bytes of blocks that do not, counting every
+ * flipped bit, the bit positions they fall on and where the first few
+ * errors are.
+ */
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "transport.h"
+
+#define PATTERN_LANES 4
+#define PATTERN_BLOCK (PATTERN_LANES * 8)
+#define PATTERN_FIRST_ERRORS 8
+
+class pattern_gen {
+public:
+  pattern_gen(uint64_t seed);
+
+  void fill(byte *buf, size_t n);
+
+private:
+  void next_block(byte *out);
+
+  uint64_t s[PATTERN_LANES];
+  byte block[PATTERN_BLOCK];
+  size_t block_off;
+};
+
+struct bit_errors {
+  uint64_t bits;            // bits compared
+  uint64_t errors;          // bits that differed
+  uint64_t bad_bytes;       // bytes with at least one
+  uint64_t by_bit[8];       // errors on each bit of a byte
+  uint64_t first[PATTERN_FIRST_ERRORS];  // offsets of the first bad bytes
+  int n_first;
+};
+
+void bit_errors_clear(bit_errors *e);
+
+/* Compare n bytes received against the expected ones, offset being the
+ * position of the first byte in the whole transfer.
+ */
+void pattern_compare(const byte *expect, const byte *got, size_t n,
+                     uint64_t offset, bit_errors *e);
+
+#endif
@@ -0,0 +1,64 @@
+/* proto.h -- request headers understood by the FPGA logic.
+ *
+ * Version 1 (the original bitstreams): the host sends one byte holding
+ * the number of bytes it wants, 1..255, and the FPGA returns that many.
+ *
+ * Version 2: the host sends a 32-bit little-endian header. Bits 0-30
+ * hold a byte count. With bit 31 clear it is a read request and the FPGA
+ * returns that many bytes; with bit 31 set it is a write and that many
+ * bytes of payload for the FPGA follow the header.
+ *
+ * The version is a property of the bitstream, so it is picked on the
+ * command line rather than detected.
+ */
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+
+#include "transport.h"
+
+#define PROTO_V1 1
+#define PROTO_V2 2
+
+#define PROTO_V2_LEN_MASK 0x7FFFFFFFu
+#define PROTO_V2_WRITE    0x80000000u
+
+/* Longest request header of any version.
+ */
+#define PROTO_HDR_MAX 4
+
+inline int proto_header_bytes(int proto){
+  return proto == PROTO_V2 ? 4 : 1;
+}
+
+inline uint32_t proto_max_request(int proto){
+  return proto == PROTO_V2 ? PROTO_V2_LEN_MASK : 0xFF;
+}
+
+inline void proto_encode_v2(byte *hdr, uint32_t n){
+  hdr[0] = n;
+  hdr[1] = n >> 8;
+  hdr[2] = n >> 16;
+  hdr[3] = n >> 24;
+}
+
+/* Encode a request for n bytes, returns the header length.
+ */
+inline int proto_encode_request(int proto, byte *hdr, uint32_t n){
+  if(proto == PROTO_V2){
+    proto_encode_v2(hdr, n & PROTO_V2_LEN_MASK);
+    return 4;
+  }
+  hdr[0] = n;
+  return 1;
+}
+
+/* Encode the header of a write of n payload bytes (version 2 only).
+ */
+inline int proto_encode_write(byte *hdr, uint32_t n){
+  proto_encode_v2(hdr, (n & PROTO_V2_LEN_MASK) | PROTO_V2_WRITE);
+  return 4;
+}
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "realtime.h"
+
+bool parse_cpu_list(const char *s, std::vector<int> *cpus){
+  cpus->clear();
+  const char *p = s;
+  while(true){
+    char *end;
+    if(!isdigit((unsigned char)*p)){
+      return false;
+    }
+    long lo = strtol(p, &end, 10);
+    long hi = lo;
+    p = end;
+    if(*p == '-'){
+      p++;
+      if(!isdigit((unsigned char)*p)){
+        return false;
+      }
+      hi = strtol(p, &end, 10);
+      p = end;
+    }
+    if(hi < lo || hi >= CPU_SETSIZE){
+      return false;
+    }
+    for(long c = lo; c <= hi; c++){
+      cpus->push_back(c);
+    }
+    if(*p == '\0'){
+      return true;
+    }
+    if(*p != ','){
+      return false;
+    }
+    p++;
+  }
+}
+
+void format_cpu_list(const std::vector<int> &cpus, char *buf, size_t len){
+  size_t used = 0;
+  buf[0] = '\0';
+  for(size_t i = 0; i < cpus.size() && used < len; ){
+    size_t j = i;
+    while(j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1){
+      j++;
+    }
+    if(j > i){
+      used += snprintf(buf + used, len - used, "%s%i-%i", i > 0 ? "," : "", cpus[i], cpus[j]);
+    }
+    else{
+      used += snprintf(buf + used, len - used, "%s%i", i > 0 ? "," : "", cpus[i]);
+    }
+    i = j + 1;
+  }
+}
+
+bool rt_set_cpus(pthread_t t, const std::vector<int> &cpus, const char *who){
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for(size_t i = 0; i < cpus.size(); i++){
+    CPU_SET(cpus[i], &set);
+  }
+  int err = pthread_setaffinity_np(t, sizeof(set), &set);
+  if(err != 0){
+    char list[256];
+    format_cpu_list(cpus, list, sizeof(list));
+    fprintf(stderr, "WARNING: cannot pin %s to CPU %s: %s\n", who, list, strerror(err));
+    return false;
+  }
+  return true;
+}
+
+bool rt_set_fifo(pthread_t t, int priority, const char *who){
+  struct sched_param sp;
+  memset(&sp, 0, sizeof(sp));
+  sp.sched_priority = priority;
+  int err = pthread_setschedparam(t, SCHED_FIFO, &sp);
+  if(err != 0){
+    fprintf(stderr, "WARNING: cannot run %s under SCHED_FIFO: %s\n", who, strerror(err));
+    return false;
+  }
+  return true;
+}
+
+bool rt_lock_all(){
+  if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0){
+    fprintf(stderr, "WARNING: cannot lock dpticat in memory, locking the buffers only: %s\n",
+            strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void rt_unlock_all(){
+  munlockall();
+}
+
+bool rt_lock(void *p, size_t len){
+  bool ok = mlock(p, len) == 0;
+  if(!ok){
+    fprintf(stderr, "WARNING: cannot lock %zu bytes of buffers in memory: %s\n",
+            len, strerror(errno));
+  }
+  /* Touch every page as well, so they are in place even without the
+   * lock.
+   */
+  size_t page = sysconf(_SC_PAGESIZE);
+  for(size_t off = 0; off < len; off += page){
+    ((volatile char *)p)[off] = 0;
+  }
+  return ok;
+}
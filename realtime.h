@@ -0,0 +1,58 @@
+/* realtime.h -- keeping the device readers on time on a busy host.
+ *
+ * The FPGA's FIFO only covers short gaps between requests, and on a
+ * loaded machine the reader can be preempted or stall on a page fault
+ * for longer than that. dpticat --realtime puts the chunk buffers in
+ * huge pages where the system has them, locks the process in memory
+ * (or failing that the buffers alone) and faults the buffers in before
+ * the capture starts. Optionally the readers and writers
+ * are pinned to their own CPUs (--cpus) and the readers run under
+ * SCHED_FIFO (--rt-priority). Whatever the system refuses is reported
+ * and the capture goes on without it.
+ *
+ * Every reader records the time it spends between one transfer and the
+ * next, not counting waits for a free buffer, as the "loop" step of its
+ * telemetry; in realtime mode the worst of it is reported at the end.
+ */
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include <vector>
+
+/* Parse a CPU list such as "2,4-6" into cpus. Returns false if it is
+ * not one.
+ */
+bool parse_cpu_list(const char *s, std::vector<int> *cpus);
+
+/* "2,4-6" style text for cpus, for reports.
+ */
+void format_cpu_list(const std::vector<int> &cpus, char *buf, size_t len);
+
+/* Let thread t run on cpus only. Returns false after a warning naming
+ * who.
+ */
+bool rt_set_cpus(pthread_t t, const std::vector<int> &cpus, const char *who);
+
+/* Run thread t under SCHED_FIFO at priority. Returns false after a
+ * warning naming who.
+ */
+bool rt_set_fifo(pthread_t t, int priority, const char *who);
+
+/* Lock all of the process into memory, including what it maps later
+ * such as the stacks of threads still to be started. Returns false after
+ * a warning (RLIMIT_MEMLOCK); rt_lock() then covers the buffers alone.
+ * rt_unlock_all() undoes it.
+ */
+bool rt_lock_all();
+void rt_unlock_all();
+
+/* Lock len bytes at p into memory and touch every page, so nothing
+ * faults on them during the capture. Without the lock (RLIMIT_MEMLOCK)
+ * the pages are still touched; returns false after a warning.
+ */
+bool rt_lock(void *p, size_t len);
+
+#endif
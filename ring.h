@@ -0,0 +1,284 @@
+/* ring.h -- single-producer/single-consumer ring of preallocated chunks.
+ *
+ * The producer (device reader) and consumer (output writer) only share
+ * two counters, so neither side takes a lock. A side that has to wait
+ * spins briefly, then yields, then sleeps in short steps.
+ *
+ * The producer may acquire several slots before publishing any of them,
+ * which lets overlapped transfers land directly in the ring. Slots are
+ * published in the order they were acquired.
+ */
+#ifndef RING_H
+#define RING_H
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <atomic>
+#include <thread>
+
+#include "transport.h"
+
+/* Huge page size asked for by chunk_ring(..., huge = true), and how the
+ * buffers ended up backed.
+ */
+#define RING_HUGE_PAGE_BYTES (2u << 20)
+
+enum {
+  RING_PAGES_NORMAL,
+  RING_PAGES_TRANSPARENT,   // madvise(MADV_HUGEPAGE), up to the kernel
+  RING_PAGES_HUGETLB,       // reserved huge pages, MAP_HUGETLB
+  RING_PAGES_SLOTS,         // every slot mapped on its own, see renew()
+};
+
+struct chunk {
+  byte *data;
+  size_t len;
+  uint64_t t_ns;    // raw_now_ns() when the data arrived
+};
+
+inline void ring_backoff(int &spins){
+  if(spins < 64){
+    spins++;
+  }
+  else if(spins < 128){
+    spins++;
+    std::this_thread::yield();
+  }
+  else{
+    struct timespec ts = {0, 20000};
+    nanosleep(&ts, NULL);
+  }
+}
+
+class chunk_ring {
+public:
+  /* Every slot holds slot_bytes at data and another headroom bytes in
+   * front of it, which the producer may use for framing it strips. With
+   * huge set the buffers are put in huge pages if the system has any to
+   * give, so the reader takes fewer TLB misses. With own_pages set
+   * instead, every slot gets pages of its own, which the consumer may
+   * give away and replace with renew().
+   */
+  chunk_ring(size_t n_slots, size_t slot_bytes, size_t headroom = 0, bool huge = false,
+             bool own_pages = false) :
+    n_slots(n_slots), slot_bytes(slot_bytes), mem(NULL), pages(RING_PAGES_NORMAL),
+    slot_map_bytes(0), mapped(false), reserved(0), full_waits(0), head(0), tail(0),
+    closed(false), stopped(false) {
+    slots = new chunk[n_slots];
+    size_t stride = headroom + slot_bytes;
+    mem_bytes = n_slots * stride;
+    if(own_pages){
+      size_t page = sysconf(_SC_PAGESIZE);
+      slot_map_bytes = (slot_bytes + page - 1) & ~(page - 1);
+      mem_bytes = n_slots * slot_map_bytes;
+      pages = RING_PAGES_SLOTS;
+      mapped = true;
+      for(size_t i = 0; i < n_slots; i++){
+        slots[i].data = map_slot();
+        slots[i].len = 0;
+        slots[i].t_ns = 0;
+        mapped = mapped && slots[i].data != NULL;
+      }
+      return;
+    }
+    if(huge){
+      mem_bytes = (mem_bytes + RING_HUGE_PAGE_BYTES - 1) & ~(size_t)(RING_HUGE_PAGE_BYTES - 1);
+      void *p = mmap(NULL, mem_bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if(p != MAP_FAILED){
+        mem = (byte *)p;
+        pages = RING_PAGES_HUGETLB;
+      }
+      else if(posix_memalign((void **)&mem, RING_HUGE_PAGE_BYTES, mem_bytes) == 0){
+        if(madvise(mem, mem_bytes, MADV_HUGEPAGE) == 0){
+          pages = RING_PAGES_TRANSPARENT;
+        }
+      }
+      else{
+        mem = NULL;
+      }
+    }
+    else if(posix_memalign((void **)&mem, 4096, mem_bytes) != 0){
+      mem = NULL;
+    }
+    for(size_t i = 0; i < n_slots; i++){
+      slots[i].data = mem == NULL ? NULL : mem + i * stride + headroom;
+      slots[i].len = 0;
+      slots[i].t_ns = 0;
+    }
+  }
+
+  ~chunk_ring(){
+    if(pages == RING_PAGES_SLOTS){
+      for(size_t i = 0; i < n_slots; i++){
+        if(slots[i].data != NULL){
+          munmap(slots[i].data, slot_map_bytes);
+        }
+      }
+    }
+    else if(pages == RING_PAGES_HUGETLB){
+      munmap(mem, mem_bytes);
+    }
+    else{
+      free(mem);
+    }
+    delete[] slots;
+  }
+
+  bool ok() const { return pages == RING_PAGES_SLOTS ? mapped : mem != NULL; }
+
+  /* The buffers of all the slots, and how they are backed. memory() is
+   * NULL when the slots are mapped on their own.
+   */
+  byte *memory() const { return mem; }
+  size_t memory_bytes() const { return mem_bytes; }
+  int page_kind() const { return pages; }
+  size_t size() const { return n_slots; }
+  size_t chunk_bytes() const { return slot_bytes; }
+
+  /* Producer: claim the next free slot, waiting while the ring is full.
+   * Returns NULL once the consumer has stopped.
+   */
+  chunk *acquire(){
+    int spins = 0;
+    bool waited = false;
+    while(reserved - tail.load(std::memory_order_acquire) >= n_slots){
+      if(stopped.load(std::memory_order_relaxed)){
+        return NULL;
+      }
+      waited = true;
+      ring_backoff(spins);
+    }
+    if(waited){
+      full_waits++;
+    }
+    return &slots[reserved++ % n_slots];
+  }
+
+  /* Producer: the oldest acquired slot that is not yet published.
+   */
+  chunk *peek_acquired(){
+    return &slots[head.load(std::memory_order_relaxed) % n_slots];
+  }
+
+  /* Producer: hand the oldest acquired slot to the consumer.
+   */
+  void publish(){
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /* Producer: no more chunks will be published.
+   */
+  void close(){
+    closed.store(true, std::memory_order_release);
+  }
+
+  /* Consumer: the oldest published slot, waiting for one if necessary.
+   * Returns NULL once the producer has closed and the ring is drained.
+   */
+  chunk *peek(){
+    int spins = 0;
+    size_t t = tail.load(std::memory_order_relaxed);
+    while(head.load(std::memory_order_acquire) == t){
+      if(closed.load(std::memory_order_acquire) &&
+         head.load(std::memory_order_acquire) == t){
+        return NULL;
+      }
+      ring_backoff(spins);
+    }
+    return &slots[t % n_slots];
+  }
+
+  /* Consumer: like peek() but returns NULL straight away when no chunk
+   * is ready. finished() tells a drained ring from an idle one.
+   */
+  chunk *try_peek(){
+    size_t t = tail.load(std::memory_order_relaxed);
+    if(head.load(std::memory_order_acquire) == t){
+      return NULL;
+    }
+    return &slots[t % n_slots];
+  }
+
+  bool finished(){
+    return finished_ahead(0);
+  }
+
+  /* Consumer: the slot k places after the oldest published one, NULL if
+   * it is not ready. For a consumer that keeps slots it has already
+   * written out until the output is done with them.
+   */
+  chunk *try_peek_ahead(size_t k){
+    size_t t = tail.load(std::memory_order_relaxed);
+    if(head.load(std::memory_order_acquire) - t <= k){
+      return NULL;
+    }
+    return &slots[(t + k) % n_slots];
+  }
+
+  bool finished_ahead(size_t k){
+    return closed.load(std::memory_order_acquire) &&
+      head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed) + k;
+  }
+
+  /* Consumer: return the slot from peek() to the producer.
+   */
+  void release(){
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /* Consumer, own_pages rings: give the slot from peek() fresh pages,
+   * for when the kernel may still refer to its old ones (vmsplice).
+   * Returns false, keeping the old pages, if there is no memory.
+   */
+  bool renew(chunk *c){
+    byte *p = map_slot();
+    if(p == NULL){
+      return false;
+    }
+    munmap(c->data, slot_map_bytes);
+    c->data = p;
+    return true;
+  }
+
+  /* Consumer: give up, the producer will see acquire() fail.
+   */
+  void stop(){
+    stopped.store(true, std::memory_order_relaxed);
+  }
+
+  /* Number of times the producer found the ring full.
+   */
+  size_t producer_waits() const { return full_waits; }
+
+private:
+  byte *map_slot(){
+    void *p = mmap(NULL, slot_map_bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    return p == MAP_FAILED ? NULL : (byte *)p;
+  }
+
+  size_t n_slots;
+  size_t slot_bytes;
+  chunk *slots;
+  byte *mem;
+  size_t mem_bytes;
+  int pages;
+  size_t slot_map_bytes;    // own_pages: bytes mapped per slot
+  bool mapped;              // own_pages: every slot got its pages
+
+  /* Producer only.
+   */
+  size_t reserved;
+  size_t full_waits;
+
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+  alignas(64) std::atomic<bool> closed;
+  std::atomic<bool> stopped;
+};
+
+#endif
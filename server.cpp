@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <map>
+#include <vector>
+
+#include "server.h"
+#include "util.h"
+
+/* Path of the Unix socket we created, removed again on exit.
+ */
+static char unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+struct client {
+  int fd;
+  std::vector<byte> backlog;
+  size_t off;
+};
+
+static bool set_nonblocking(int fd){
+  int flags = fcntl(fd, F_GETFL);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+int server_listen(const char *addr){
+  int fd = -1;
+
+  if(strncmp(addr, "unix:", 5) == 0){
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if(strlen(addr + 5) >= sizeof(sun.sun_path)){
+      fprintf(stderr, "ERROR: socket path too long: %s\n", addr + 5);
+      return -1;
+    }
+    strcpy(sun.sun_path, addr + 5);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(sun.sun_path);
+    if(fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0){
+      fprintf(stderr, "ERROR: cannot bind %s: %s\n", sun.sun_path, strerror(errno));
+      if(fd >= 0){
+        close(fd);
+      }
+      return -1;
+    }
+    strcpy(unix_path, sun.sun_path);
+  }
+  else if(strncmp(addr, "tcp:", 4) == 0){
+    char host[256];
+    const char *port = strrchr(addr + 4, ':');
+    if(port == NULL){
+      port = addr + 4;
+      host[0] = '\0';
+    }
+    else{
+      size_t n = port - (addr + 4);
+      if(n >= sizeof(host)){
+        fprintf(stderr, "ERROR: host name too long\n");
+        return -1;
+      }
+      memcpy(host, addr + 4, n);
+      host[n] = '\0';
+      port++;
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+    if(rc != 0){
+      fprintf(stderr, "ERROR: cannot resolve %s: %s\n", addr, gai_strerror(rc));
+      return -1;
+    }
+    for(struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next){
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if(fd < 0){
+        continue;
+      }
+      int one = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0){
+        break;
+      }
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(res);
+    if(fd < 0){
+      fprintf(stderr, "ERROR: cannot bind %s: %s\n", addr, strerror(errno));
+      return -1;
+    }
+  }
+  else{
+    fprintf(stderr, "ERROR: listen address must be tcp:[HOST:]PORT or unix:PATH\n");
+    return -1;
+  }
+
+  if(listen(fd, 16) != 0 || !set_nonblocking(fd)){
+    fprintf(stderr, "ERROR: cannot listen on %s: %s\n", addr, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int server_connect(const char *addr){
+  int fd = -1;
+  
+  if(strncmp(addr, "unix:", 5) == 0){
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if(strlen(addr + 5) >= sizeof(sun.sun_path)){
+      fprintf(stderr, "ERROR: socket path too long: %s\n", addr + 5);
+      return -1;
+    }
+    strcpy(sun.sun_path, addr + 5);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd >= 0 && connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0){
+      close(fd);
+      fd = -1;
+    }
+  }
+  else if(strncmp(addr, "tcp:", 4) == 0){
+    char host[256];
+    const char *port = strrchr(addr + 4, ':');
+    if(port == NULL || (size_t)(port - (addr + 4)) >= sizeof(host)){
+      fprintf(stderr, "ERROR: connect address must be tcp:HOST:PORT\n");
+      return -1;
+    }
+    memcpy(host, addr + 4, port - (addr + 4));
+    host[port - (addr + 4)] = '\0';
+    port++;
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, port, &hints, &res);
+    if(rc != 0){
+      fprintf(stderr, "ERROR: cannot resolve %s: %s\n", addr, gai_strerror(rc));
+      return -1;
+    }
+    for(struct addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next){
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if(fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0){
+        close(fd);
+        fd = -1;
+      }
+    }
+    freeaddrinfo(res);
+  }
+  else{
+    fprintf(stderr, "ERROR: address must be tcp:HOST:PORT or unix:PATH\n");
+    return -1;
+  }
+  
+  if(fd < 0){
+    fprintf(stderr, "ERROR: cannot connect to %s: %s\n", addr, strerror(errno));
+  }
+  return fd;
+}
+
+void server_close(int listen_fd){
+  close(listen_fd);
+  if(unix_path[0] != '\0'){
+    unlink(unix_path);
+    unix_path[0] = '\0';
+  }
+}
+
+static void drop_client(int epfd, std::map<int, client> &clients, int fd, const char *why){
+  fprintf(stderr, "Client %i %s\n", fd, why);
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+  close(fd);
+  clients.erase(fd);
+}
+
+/* Send as much of the client's backlog as the socket takes. Returns
+ * false if the client has gone.
+ */
+static bool flush_client(client &c){
+  while(c.off < c.backlog.size()){
+    ssize_t n = send(c.fd, c.backlog.data() + c.off, c.backlog.size() - c.off,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(n < 0){
+      if(c.off > c.backlog.size() / 2){
+        c.backlog.erase(c.backlog.begin(), c.backlog.begin() + c.off);
+        c.off = 0;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    c.off += n;
+  }
+  c.backlog.clear();
+  c.off = 0;
+  return true;
+}
+
+static void watch_client(int epfd, client &c, bool want_write){
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? (uint32_t)EPOLLOUT : 0u);
+  ev.data.fd = c.fd;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+void server_run(int listen_fd, chunk_ring *ring){
+  std::map<int, client> clients;
+  uint64_t n_served = 0;
+  uint64_t n_slow = 0;
+
+  int epfd = epoll_create1(0);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+  while(!ring->finished()){
+    /* Fan out whatever the reader has published since the last pass.
+     */
+    bool busy = false;
+    chunk *c;
+    while((c = ring->try_peek()) != NULL){
+      busy = true;
+      for(std::map<int, client>::iterator it = clients.begin(); it != clients.end(); ){
+        client &cl = it->second;
+        ++it;
+        bool idle = cl.backlog.empty();
+        if(cl.backlog.size() - cl.off + c->len > SERVER_CLIENT_BACKLOG){
+          n_slow++;
+          drop_client(epfd, clients, cl.fd, "too slow, disconnected");
+          continue;
+        }
+        cl.backlog.insert(cl.backlog.end(), c->data, c->data + c->len);
+        if(!flush_client(cl)){
+          drop_client(epfd, clients, cl.fd, "disconnected");
+        }
+        else if(idle && !cl.backlog.empty()){
+          watch_client(epfd, cl, true);
+        }
+      }
+      ring->release();
+    }
+
+    struct epoll_event events[16];
+    int n = epoll_wait(epfd, events, 16, busy ? 0 : 1);
+    for(int i = 0; i < n; i++){
+      int fd = events[i].data.fd;
+      if(fd == listen_fd){
+        int cfd;
+        while((cfd = accept(listen_fd, NULL, NULL)) >= 0){
+          set_nonblocking(cfd);
+          client &cl = clients[cfd];
+          cl.fd = cfd;
+          cl.off = 0;
+          ev.events = EPOLLIN | EPOLLRDHUP;
+          ev.data.fd = cfd;
+          epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev);
+          n_served++;
+          fprintf(stderr, "Client %i connected\n", cfd);
+        }
+        continue;
+      }
+
+      std::map<int, client>::iterator it = clients.find(fd);
+      if(it == clients.end()){
+        continue;
+      }
+      client &cl = it->second;
+      if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+        /* Subscribers are read-only, so anything they send is thrown away.
+         */
+        byte junk[4096];
+        ssize_t got = recv(fd, junk, sizeof(junk), MSG_DONTWAIT);
+        if(got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR) ||
+           (events[i].events & (EPOLLHUP | EPOLLERR))){
+          drop_client(epfd, clients, fd, "disconnected");
+          continue;
+        }
+      }
+      if(events[i].events & EPOLLOUT){
+        if(!flush_client(cl)){
+          drop_client(epfd, clients, fd, "disconnected");
+        }
+        else if(cl.backlog.empty()){
+          watch_client(epfd, cl, false);
+        }
+      }
+    }
+  }
+
+  /* The stream is over, but the clients may still have a backlog; wait
+   * for them to take it, for a while.
+   */
+  uint64_t t_give_up = now_ns() + SERVER_DRAIN_MS * 1000000ull;
+  std::vector<struct pollfd> pfds;
+  while(true){
+    pfds.clear();
+    for(std::map<int, client>::iterator it = clients.begin(); it != clients.end(); ++it){
+      client &cl = it->second;
+      if(cl.fd >= 0 && !flush_client(cl)){
+        fprintf(stderr, "Client %i disconnected with %zu bytes not sent\n", cl.fd,
+                cl.backlog.size() - cl.off);
+        close(cl.fd);
+        cl.fd = -1;
+      }
+      if(cl.fd >= 0 && !cl.backlog.empty()){
+        struct pollfd pfd = { cl.fd, POLLOUT, 0 };
+        pfds.push_back(pfd);
+      }
+    }
+    uint64_t now = now_ns();
+    if(pfds.empty() || now >= t_give_up){
+      break;
+    }
+    poll(pfds.data(), pfds.size(), (int)((t_give_up - now) / 1000000) + 1);
+  }
+  uint64_t n_cut = 0;
+  for(std::map<int, client>::iterator it = clients.begin(); it != clients.end(); ++it){
+    client &cl = it->second;
+    if(cl.fd < 0){
+      n_cut++;
+      continue;
+    }
+    if(!cl.backlog.empty()){
+      fprintf(stderr, "Client %i cut short with %zu bytes not sent\n", cl.fd,
+              cl.backlog.size() - cl.off);
+      n_cut++;
+    }
+    close(cl.fd);
+  }
+  close(epfd);
+  server_close(listen_fd);
+  fprintf(stderr, "Served %llu clients, %llu disconnected for being too slow, "
+          "%llu cut short at the end\n",
+          (unsigned long long)n_served, (unsigned long long)n_slow, (unsigned long long)n_cut);
+}
@@ -0,0 +1,48 @@
+/* server.h -- serve the device stream to socket subscribers.
+ *
+ * The server listens on a TCP port or a Unix-domain socket and hands a
+ * copy of every chunk to each connected client. Clients are read-only:
+ * anything they send is discarded. A client that falls more than
+ * SERVER_CLIENT_BACKLOG bytes behind is disconnected so it cannot hold
+ * up the others. Clients only see data that arrives while they are
+ * connected; with nobody connected the stream is discarded.
+ *
+ * Addresses:
+ *
+ *   tcp:PORT          all interfaces
+ *   tcp:HOST:PORT
+ *   unix:PATH
+ */
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "ring.h"
+
+#define SERVER_CLIENT_BACKLOG (16 * 1024 * 1024)
+
+/* How long the clients get to take the rest of their backlogs once the
+ * stream has ended.
+ */
+#define SERVER_DRAIN_MS 5000
+
+/* Returns a listening socket for addr, or -1 after printing an error.
+ */
+int server_listen(const char *addr);
+
+/* Close a socket from server_listen(), removing its Unix socket file.
+ */
+void server_close(int listen_fd);
+
+/* Returns a socket connected to addr (as above, but tcp: needs a host),
+ * or -1 after printing an error.
+ */
+int server_connect(const char *addr);
+
+/* Run the epoll loop on listen_fd until the reader closes the ring and
+ * it has been drained, then give the clients up to SERVER_DRAIN_MS to
+ * take what they have not yet been sent. Clients cut short are
+ * reported.
+ */
+void server_run(int listen_fd, chunk_ring *ring);
+
+#endif
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <errno.h>
+
+#include <new>
+
+#include "shmring.h"
+
+shm_writer::shm_writer() : hdr(NULL), data(NULL) {
+  name[0] = '\0';
+}
+
+shm_writer::~shm_writer(){
+  close();
+}
+
+bool shm_writer::open(const char *name, uint64_t data_bytes){
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  uint64_t size = page;
+  while(size < data_bytes){
+    size *= 2;
+  }
+  if(strlen(name) >= sizeof(this->name)){
+    fprintf(stderr, "ERROR: shared memory name too long: %s\n", name);
+    return false;
+  }
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0){
+    fprintf(stderr, "ERROR: cannot create shared memory %s: %s\n", name, strerror(errno));
+    return false;
+  }
+  strcpy(this->name, name);
+  if(ftruncate(fd, SHM_RING_HEADER_BYTES + size) != 0){
+    fprintf(stderr, "ERROR: cannot size shared memory %s: %s\n", name, strerror(errno));
+    ::close(fd);
+    close();
+    return false;
+  }
+  void *h = mmap(NULL, SHM_RING_HEADER_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  data = shm_ring_map_data(fd, size, PROT_READ | PROT_WRITE);
+  ::close(fd);
+  if(h == MAP_FAILED || data == NULL){
+    fprintf(stderr, "ERROR: cannot map shared memory %s: %s\n", name, strerror(errno));
+    hdr = h == MAP_FAILED ? NULL : (shm_ring_header *)h;
+    close();
+    return false;
+  }
+
+  /* Readers check the magic, so it goes in last.
+   */
+  hdr = new (h) shm_ring_header;
+  hdr->version = SHM_RING_VERSION;
+  hdr->data_bytes = size;
+  hdr->reserve_pos.store(0, std::memory_order_relaxed);
+  hdr->write_pos.store(0, std::memory_order_relaxed);
+  hdr->chunks.store(0, std::memory_order_relaxed);
+  hdr->closed.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  hdr->magic = SHM_RING_MAGIC;
+  return true;
+}
+
+void shm_writer::publish(const uint8_t *p, size_t len){
+  /* A chunk longer than the ring only leaves its tail.
+   */
+  if(len > hdr->data_bytes){
+    p += len - hdr->data_bytes;
+    len = hdr->data_bytes;
+  }
+  uint64_t w = hdr->write_pos.load(std::memory_order_relaxed);
+  hdr->reserve_pos.store(w + len, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(data + (w & (hdr->data_bytes - 1)), p, len);
+  hdr->write_pos.store(w + len, std::memory_order_release);
+  hdr->chunks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void shm_writer::close(){
+  if(hdr != NULL){
+    hdr->closed.store(1, std::memory_order_release);
+    if(data != NULL){
+      munmap(data, 2 * hdr->data_bytes);
+      data = NULL;
+    }
+    munmap(hdr, SHM_RING_HEADER_BYTES);
+    hdr = NULL;
+  }
+  if(name[0] != '\0'){
+    shm_unlink(name);
+    name[0] = '\0';
+  }
+}
@@ -0,0 +1,214 @@
+/* shmring.h -- the stream in a POSIX shared-memory ring.
+ *
+ * dpticat --shm NAME publishes the stream into the shared-memory object
+ * NAME for any number of processes on the same host to follow, without
+ * a pipe, copies or system calls. The object is a header page followed
+ * by a byte ring of data_bytes (a power of two). The writer never waits
+ * for readers: a reader that falls more than data_bytes behind loses the
+ * oldest data and is told so.
+ *
+ * The header holds two stream positions. reserve_pos moves to the end
+ * of a chunk before the writer copies it in, and write_pos follows once
+ * the chunk is complete. A reader may use the bytes from its position up
+ * to write_pos; afterwards, reserve_pos tells whether the writer has
+ * since come round and overwritten them, like a seqlock.
+ *
+ * The reader maps the ring twice, back to back, so every block it is
+ * given is contiguous even where it wraps. This file is all a reader
+ * needs:
+ *
+ *   shm_reader r;
+ *   if(!r.open("/dpticat")) ...
+ *   while(!r.finished()){
+ *     const uint8_t *p;
+ *     size_t n = r.peek(&p);
+ *     if(n == 0){ r.wait(); continue; }
+ *     use(p, n);
+ *     if(!r.consume(n)) ...   // overwritten while in use, see overruns()
+ *   }
+ */
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <atomic>
+
+#define SHM_RING_MAGIC 0x52535044    // "DPSR"
+#define SHM_RING_VERSION 1
+#define SHM_RING_HEADER_BYTES 4096
+
+struct shm_ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t data_bytes;
+  alignas(64) std::atomic<uint64_t> reserve_pos;
+  alignas(64) std::atomic<uint64_t> write_pos;
+  std::atomic<uint64_t> chunks;     // chunks published
+  std::atomic<uint32_t> closed;     // the writer is done
+};
+
+/* Map data_bytes of fd at offset SHM_RING_HEADER_BYTES twice in a row.
+ * Returns NULL on failure.
+ */
+inline uint8_t *shm_ring_map_data(int fd, uint64_t data_bytes, int prot){
+  void *base = mmap(NULL, 2 * data_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(base == MAP_FAILED){
+    return NULL;
+  }
+  uint8_t *p = (uint8_t *)base;
+  for(int i = 0; i < 2; i++){
+    if(mmap(p + i * data_bytes, data_bytes, prot, MAP_SHARED | MAP_FIXED, fd,
+            SHM_RING_HEADER_BYTES) == MAP_FAILED){
+      munmap(base, 2 * data_bytes);
+      return NULL;
+    }
+  }
+  return p;
+}
+
+class shm_reader {
+public:
+  shm_reader() : hdr(NULL), data(NULL), pos(0), lost(0), n_overruns(0) {}
+  ~shm_reader() { close(); }
+
+  /* Attach to the ring name, starting at the oldest data it holds, or
+   * only at data published from now on if latest is set.
+   */
+  bool open(const char *name, bool latest = false){
+    int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0){
+      return false;
+    }
+    void *h = mmap(NULL, SHM_RING_HEADER_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+    if(h == MAP_FAILED){
+      ::close(fd);
+      return false;
+    }
+    hdr = (shm_ring_header *)h;
+    if(hdr->magic != SHM_RING_MAGIC || hdr->version != SHM_RING_VERSION){
+      ::close(fd);
+      close();
+      return false;
+    }
+    data = shm_ring_map_data(fd, hdr->data_bytes, PROT_READ);
+    ::close(fd);
+    if(data == NULL){
+      close();
+      return false;
+    }
+    uint64_t w = hdr->write_pos.load(std::memory_order_acquire);
+    pos = w;
+    if(!latest){
+      pos = w > hdr->data_bytes ? w - hdr->data_bytes : 0;
+    }
+    return true;
+  }
+
+  void close(){
+    if(data != NULL){
+      munmap(data, 2 * hdr->data_bytes);
+      data = NULL;
+    }
+    if(hdr != NULL){
+      munmap(hdr, SHM_RING_HEADER_BYTES);
+      hdr = NULL;
+    }
+  }
+
+  /* The next published bytes, up to max of them, at *p. Returns 0 when
+   * there is nothing new.
+   */
+  size_t peek(const uint8_t **p, size_t max = SIZE_MAX){
+    uint64_t w = hdr->write_pos.load(std::memory_order_acquire);
+    if(w - pos > hdr->data_bytes){
+      skip_to(w - hdr->data_bytes);
+    }
+    uint64_t n = w - pos;
+    if(n > max){
+      n = max;
+    }
+    *p = data + (pos & (hdr->data_bytes - 1));
+    return n;
+  }
+
+  /* Done with n bytes from peek(). Returns false if the writer may have
+   * overwritten them in the meantime; they then count as lost.
+   */
+  bool consume(size_t n){
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t r = hdr->reserve_pos.load(std::memory_order_relaxed);
+    bool ok = r <= pos + hdr->data_bytes;
+    if(!ok){
+      n_overruns++;
+      lost += n;
+    }
+    pos += n;
+    return ok;
+  }
+
+  /* Sleep briefly, for when peek() found nothing.
+   */
+  void wait(){
+    struct timespec ts = {0, 100000};
+    nanosleep(&ts, NULL);
+  }
+
+  /* The writer has finished and everything has been read.
+   */
+  bool finished() const {
+    return hdr->closed.load(std::memory_order_acquire) &&
+      pos == hdr->write_pos.load(std::memory_order_acquire);
+  }
+
+  uint64_t position() const { return pos; }
+  uint64_t lost_bytes() const { return lost; }
+  uint64_t overruns() const { return n_overruns; }
+
+private:
+  void skip_to(uint64_t p){
+    n_overruns++;
+    lost += p - pos;
+    pos = p;
+  }
+
+  shm_ring_header *hdr;
+  uint8_t *data;
+  uint64_t pos;
+  uint64_t lost;
+  uint64_t n_overruns;
+};
+
+/* The writing side, in dpticat.
+ */
+class shm_writer {
+public:
+  shm_writer();
+  ~shm_writer();
+
+  /* Create the ring name with at least data_bytes of data. Returns
+   * false after printing an error.
+   */
+  bool open(const char *name, uint64_t data_bytes);
+
+  void publish(const uint8_t *p, size_t len);
+
+  /* Mark the stream finished and remove the name; readers that have it
+   * mapped can still read to the end.
+   */
+  void close();
+
+private:
+  char name[256];
+  shm_ring_header *hdr;
+  uint8_t *data;
+};
+
+#endif
@@ -0,0 +1,662 @@
+/* simdev.cpp -- simulated DPTI device.
+ *
+ * Stands in for a board running the dpticat bitstream so the host side
+ * can be exercised and benchmarked without hardware. Opened with the
+ * device name "sim" or "sim:opt=val,...". Options:
+ *
+ *   ports=N     number of DPTI ports (default 2)
+ *   async=P     port that is asynchronous, -1 for none (default 0)
+ *   abw=B       async port bandwidth in bytes/s (default 8M)
+ *   sbw=B       sync port bandwidth in bytes/s (default 40M)
+ *   bw=B        set both bandwidths
+ *   lat=US      per-transfer latency in microseconds (default 125)
+ *   rate=B      FPGA data production rate in bytes/s, 0 = always ready
+ *   fifo=B      FPGA FIFO depth when rate is set (default 32K)
+ *   proto=V     request protocol version, 1 or 2 (see proto.h)
+ *   loop        protocol 1: echo OUT data back on IN instead of serving
+ *               requests; protocol 2: serve read requests from the
+ *               payload of write requests, waiting for it if needed
+ *   seed=N      seed for the generated data
+ *   frame       answer read requests with frames (frame.h)
+ *   corrupt=P   flip a bit in this fraction of the frames
+ *   drop=P      skip a sequence number before this fraction of frames
+ *   replay=FILE serve the data of a dpticat -w capture (capfile.h)
+ *               instead of generating it, each chunk becoming available
+ *               when it arrived in the capture
+ *   speed=X     replay X times faster than captured, 0 for as fast as
+ *               the link allows (default 1)
+ *   from=S      start the replay S seconds into the capture
+ *   skip=B      start the replay at stream offset B
+ *
+ * Sizes accept K, M and G suffixes (powers of 1024).
+ *
+ * In request mode every OUT request header asks for a number of bytes of
+ * data, which the device then returns on IN, exactly like the FPGA logic.
+ * Headers may be split across OUT transfers. The data is
+ * a stream of timestamp words laid out as in timestamp.h, with a
+ * monotonic coarse count, or the replayed capture. A read that runs past
+ * the end of a replay returns what is left and fails with ercEndOfData;
+ * reads after it return nothing.
+ *
+ * Transfer timing: each transfer costs lat before it reaches the wire and
+ * then occupies the link for its size divided by the port bandwidth.
+ * Latency of overlapped transfers overlaps, wire time does not.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "transport.h"
+#include "proto.h"
+#include "util.h"
+#include "timestamp.h"
+#include "frame.h"
+#include "crc32c.h"
+#include "capfile.h"
+
+static uint64_t mix64(uint64_t x){
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return x;
+}
+
+/* Replayed data not yet sent.
+ */
+struct sim_replay_chunk {
+  const byte *data;
+  uint32_t left;
+};
+
+struct sim_pending {
+  uint64_t done_ns;
+  DWORD n_out;
+  DWORD n_in;
+  bool ok;
+  bool end;                 // the replay ended within n_in
+};
+
+class sim_transport : public transport {
+public:
+  int n_ports;
+  int async_port;
+  double async_bw;
+  double sync_bw;
+  uint64_t lat_ns;
+  double rate;
+  double fifo;
+  bool loop;
+  int proto;
+  uint64_t seed;
+  bool frame;
+  double corrupt;
+  double drop;
+  cap_reader *replay;
+  double speed;
+  uint64_t replay_skip;
+
+  sim_transport() :
+    n_ports(2), async_port(0), async_bw(8.0 * 1024 * 1024),
+    sync_bw(40.0 * 1024 * 1024), lat_ns(125000), rate(0),
+    fifo(32.0 * 1024), loop(false), proto(PROTO_V1), seed(1),
+    frame(false), corrupt(0), drop(0), replay(NULL), speed(1), replay_skip(0),
+    cancel_gen(0), port(-1), err(ercNoErc), end_n(0), link_free_ns(0), owed(0), hdr_len(0), payload_left(0), host_bytes(0), gen_pos(0),
+    fifo_level(0), fifo_t_ns(0), lost(0), frame_off(0), frame_seq(0),
+    n_corrupted(0), n_dropped(0), replay_start_ns(0), replay_t0(0), replay_queued(0),
+    replay_bytes(0), replay_end(false) {}
+
+  ~sim_transport() {
+    close();
+    delete replay;
+  }
+
+  bool get_port_count(int *n){
+    *n = n_ports;
+    return true;
+  }
+
+  bool get_port_properties(int p, DPRP *props){
+    if(p < 0 || p >= n_ports){
+      err = ercInvParam;
+      return false;
+    }
+    *props = p == async_port ? dprpPtiAsynchronous : dprpPtiSynchronous;
+    return true;
+  }
+
+  bool enable(int p){
+    std::lock_guard<std::mutex> lock(mtx);
+    if(p < 0 || p >= n_ports){
+      err = ercInvParam;
+      return false;
+    }
+    port = p;
+    fifo_t_ns = now_ns();
+    return true;
+  }
+
+  bool disable(){
+    std::lock_guard<std::mutex> lock(mtx);
+    port = -1;
+    return true;
+  }
+
+  bool io(byte *out, DWORD n_out, byte *in, DWORD n_in, bool overlap){
+    sim_pending p;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      if(port < 0){
+        err = ercInvParam;
+        return false;
+      }
+      p = transfer(lock, out, n_out, in, n_in);
+      if(overlap){
+        pending.push_back(p);
+        return true;
+      }
+    }
+    sleep_until_ns(p.done_ns);
+    if(!p.ok){
+      err = p.end ? ercEndOfData : ercTransferCancelled;
+      end_n = p.n_in;
+    }
+    return p.ok;
+  }
+
+  bool get_trans_result(DWORD *n_out, DWORD *n_in, bool wait){
+    sim_pending p;
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      if(pending.empty()){
+        err = ercInvParam;
+        return false;
+      }
+      p = pending.front();
+      if(!wait && now_ns() < p.done_ns){
+        err = ercTransferCancelled;
+        return false;
+      }
+      pending.pop_front();
+    }
+    sleep_until_ns(p.done_ns);
+    if(n_out){
+      *n_out = p.ok ? p.n_out : 0;
+    }
+    if(n_in){
+      *n_in = p.ok || p.end ? p.n_in : 0;
+    }
+    if(!p.ok){
+      err = p.end ? ercEndOfData : ercTransferCancelled;
+      end_n = p.n_in;
+    }
+    return p.ok;
+  }
+
+  DWORD end_bytes(){
+    return end_n;
+  }
+
+  bool set_timeout(DWORD){
+    return true;
+  }
+
+  bool cancel(){
+    std::lock_guard<std::mutex> lock(mtx);
+    cancel_gen++;
+    data_cv.notify_all();
+    return true;
+  }
+
+  ERC last_error(){
+    return err;
+  }
+
+  void close(){
+    if(host_bytes > 0){
+      fprintf(stderr, "sim: received %llu bytes of host data\n",
+              (unsigned long long)host_bytes);
+      host_bytes = 0;
+    }
+    if(n_corrupted > 0 || n_dropped > 0){
+      fprintf(stderr, "sim: corrupted %llu frames, dropped %llu\n",
+              (unsigned long long)n_corrupted, (unsigned long long)n_dropped);
+      n_corrupted = n_dropped = 0;
+    }
+    if(lost > 0){
+      fprintf(stderr, "sim: %llu bytes lost to FIFO overflow\n",
+              (unsigned long long)lost);
+      lost = 0;
+    }
+    if(replay_bytes > 0){
+      fprintf(stderr, "sim: replayed %llu bytes%s\n", (unsigned long long)replay_bytes,
+              replay_end ? ", the whole capture" : "");
+      replay_bytes = 0;
+    }
+    port = -1;
+  }
+
+private:
+  std::mutex mtx;
+  std::condition_variable data_cv;
+  uint64_t cancel_gen;
+  int port;
+  ERC err;
+  DWORD end_n;
+  uint64_t link_free_ns;
+  std::deque<sim_pending> pending;
+  uint64_t owed;
+  byte hdr[PROTO_HDR_MAX];
+  int hdr_len;
+  uint32_t payload_left;
+  uint64_t host_bytes;
+  std::deque<byte> loop_data;
+  uint64_t gen_pos;
+  double fifo_level;
+  uint64_t fifo_t_ns;
+  uint64_t lost;
+  std::deque<uint32_t> frame_queue;
+  std::vector<byte> frame_buf;
+  size_t frame_off;
+  uint32_t frame_seq;
+  uint64_t n_corrupted;
+  uint64_t n_dropped;
+  uint64_t replay_start_ns;
+  uint64_t replay_t0;
+  std::deque<sim_replay_chunk> replay_queue;
+  uint64_t replay_queued;
+  uint64_t replay_bytes;
+  bool replay_end;
+
+  /* Byte at position pos of the generated stream.
+   */
+  byte gen_byte(uint64_t pos){
+    uint64_t i = pos / W_BYTES;
+    uint64_t h = mix64(i ^ seed);
+    uint64_t coarse = i * 16 + (h >> FINE) % 16;
+    uint64_t word = (coarse << FINE) | (h & ((1 << FINE) - 1));
+    return (byte)(word >> (8 * (pos % W_BYTES)));
+  }
+
+  /* Uniform in [0, 1) from a hash of x.
+   */
+  double chance(uint64_t x){
+    return (mix64(x ^ seed) >> 11) * (1.0 / (1ull << 53));
+  }
+
+  /* Build the frame answering the oldest outstanding request.
+   */
+  void build_frame(){
+    uint32_t n = frame_queue.front();
+    frame_queue.pop_front();
+    if(drop > 0 && chance(2 * (uint64_t)frame_seq) < drop){
+      frame_seq++;
+      n_dropped++;
+    }
+    frame_buf.resize(FRAME_OVERHEAD + n);
+    frame_header h = { FRAME_MAGIC, frame_seq, n };
+    memcpy(frame_buf.data(), &h, sizeof(h));
+    for(uint32_t i = 0; i < n; i++){
+      frame_buf[FRAME_HEADER_BYTES + i] = gen_byte(gen_pos++);
+    }
+    uint32_t crc = crc32c(0, frame_buf.data(), FRAME_HEADER_BYTES + n);
+    memcpy(frame_buf.data() + FRAME_HEADER_BYTES + n, &crc, sizeof(crc));
+    if(corrupt > 0 && chance(2 * (uint64_t)frame_seq + 1) < corrupt){
+      size_t bit = mix64(frame_seq) % (frame_buf.size() * 8);
+      frame_buf[bit / 8] ^= 1 << (bit % 8);
+      n_corrupted++;
+    }
+    frame_seq++;
+    frame_off = 0;
+  }
+
+  /* Queue the capture records holding the next n bytes of a replay and
+   * move *t to when the last of them arrived. False if the capture ends
+   * first.
+   */
+  bool replay_wait(uint64_t *t, DWORD n){
+    if(replay_start_ns == 0){
+      replay_start_ns = now_ns();
+    }
+    while(replay_queued < n){
+      cap_record rec;
+      const byte *data;
+      if(!replay->next(&rec, &data)){
+        replay_end = true;
+        return false;
+      }
+      if(replay_t0 == 0){
+        replay_t0 = rec.t_ns;
+      }
+      if(rec.offset < replay_skip){
+        /* The seek lands on the record holding the offset.
+         */
+        uint64_t cut = replay_skip - rec.offset;
+        if(cut >= rec.length){
+          continue;
+        }
+        data += cut;
+        rec.length -= cut;
+      }
+      sim_replay_chunk c = { data, rec.length };
+      replay_queue.push_back(c);
+      replay_queued += rec.length;
+      if(speed > 0){
+        uint64_t t_ready = replay_start_ns + (uint64_t)((rec.t_ns - replay_t0) / speed);
+        if(*t < t_ready){
+          *t = t_ready;
+        }
+      }
+    }
+    return true;
+  }
+
+  byte replay_byte(){
+    sim_replay_chunk &c = replay_queue.front();
+    byte b = *c.data++;
+    if(--c.left == 0){
+      replay_queue.pop_front();
+    }
+    replay_queued--;
+    replay_bytes++;
+    return b;
+  }
+
+  /* Next byte of the reply stream.
+   */
+  byte next_byte(){
+    if(replay != NULL){
+      return replay_byte();
+    }
+    if(!frame){
+      return gen_byte(gen_pos++);
+    }
+    if(frame_off == frame_buf.size()){
+      build_frame();
+    }
+    return frame_buf[frame_off++];
+  }
+
+  /* Fill the FPGA FIFO up to time t and return when n bytes are in it.
+   */
+  uint64_t fifo_wait(uint64_t t, DWORD n){
+    if(rate <= 0){
+      return t;
+    }
+    if(t > fifo_t_ns){
+      fifo_level += rate * (t - fifo_t_ns) * 1e-9;
+      fifo_t_ns = t;
+      if(fifo_level > fifo){
+        uint64_t drop = (uint64_t)(fifo_level - fifo);
+        lost += drop;
+        gen_pos += drop;
+        fifo_level = fifo;
+      }
+    }
+    if(fifo_level < n){
+      t += (uint64_t)((n - fifo_level) / rate * 1e9);
+      fifo_level = n;
+      fifo_t_ns = t;
+    }
+    fifo_level -= n;
+    return t;
+  }
+
+  /* A read request for n bytes of data.
+   */
+  void request(uint32_t n){
+    if(frame){
+      frame_queue.push_back(n);
+      owed += n + FRAME_OVERHEAD;
+    }
+    else{
+      owed += n;
+    }
+  }
+
+  /* Add up the data asked for by the request headers in out and take in
+   * the payload of write requests.
+   */
+  void parse_requests(const byte *out, DWORD n_out){
+    int n_hdr = proto_header_bytes(proto);
+    for(DWORD i = 0; i < n_out; i++){
+      if(payload_left > 0){
+        DWORD n = n_out - i < payload_left ? n_out - i : payload_left;
+        if(loop){
+          loop_data.insert(loop_data.end(), out + i, out + i + n);
+          data_cv.notify_all();
+        }
+        host_bytes += n;
+        payload_left -= n;
+        i += n - 1;
+        continue;
+      }
+      hdr[hdr_len++] = out[i];
+      if(hdr_len < n_hdr){
+        continue;
+      }
+      hdr_len = 0;
+      if(proto == PROTO_V2){
+        uint32_t n = hdr[0] | hdr[1] << 8 | hdr[2] << 16 | (uint32_t)hdr[3] << 24;
+        if(n & PROTO_V2_WRITE){
+          payload_left = n & PROTO_V2_LEN_MASK;
+        }
+        else{
+          request(n & PROTO_V2_LEN_MASK);
+        }
+      }
+      else{
+        request(hdr[0]);
+      }
+    }
+  }
+
+  /* Move the data and work out when the transfer completes. Called with
+   * the lock held.
+   */
+  sim_pending transfer(std::unique_lock<std::mutex> &lock,
+                       byte *out, DWORD n_out, byte *in, DWORD n_in){
+    sim_pending p;
+    p.n_out = n_out;
+    p.n_in = n_in;
+    p.ok = true;
+    p.end = false;
+
+    double bw = port == async_port ? async_bw : sync_bw;
+    uint64_t t = now_ns() + lat_ns;
+    if(t < link_free_ns){
+      t = link_free_ns;
+    }
+    t += (uint64_t)(n_out / bw * 1e9);
+
+    bool loop_raw = loop && proto == PROTO_V1;
+    if(loop_raw){
+      loop_data.insert(loop_data.end(), out, out + n_out);
+    }
+    else{
+      parse_requests(out, n_out);
+    }
+
+    if(n_in > 0){
+      if(!loop_raw && owed < n_in){
+        p.ok = false;
+      }
+      else if(loop){
+        /* Write payloads may still be on their way from another thread.
+         */
+        uint64_t gen = cancel_gen;
+        while(!loop_raw && loop_data.size() < n_in && gen == cancel_gen){
+          data_cv.wait(lock);
+        }
+        if(loop_data.size() < n_in){
+          p.ok = false;
+        }
+        else{
+          if(!loop_raw){
+            owed -= n_in;
+          }
+          for(DWORD i = 0; i < n_in; i++){
+            in[i] = loop_data.front();
+            loop_data.pop_front();
+          }
+          uint64_t t_ready = now_ns() + lat_ns;
+          if(t < t_ready){
+            t = t_ready;
+          }
+        }
+      }
+      else if(replay != NULL && !replay_wait(&t, n_in)){
+        /* The capture ends within this reply: send what is left of it.
+         */
+        owed -= n_in;
+        p.ok = false;
+        p.end = true;
+        p.n_in = replay_queued;
+        for(DWORD i = 0; i < p.n_in; i++){
+          in[i] = next_byte();
+        }
+      }
+      else{
+        owed -= n_in;
+        t = fifo_wait(t, n_in);
+        for(DWORD i = 0; i < n_in; i++){
+          in[i] = next_byte();
+        }
+      }
+      t += (uint64_t)(n_in / bw * 1e9);
+    }
+
+    link_free_ns = t;
+    p.done_ns = t;
+    return p;
+  }
+};
+
+transport *sim_open(const char *opts){
+  sim_transport *sim = new sim_transport();
+  char buf[256];
+  if(strlen(opts) >= sizeof(buf)){
+    fprintf(stderr, "ERROR: simulator options too long\n");
+    delete sim;
+    return NULL;
+  }
+  strcpy(buf, opts);
+  const char *replay_path = NULL;
+  double replay_from = 0;
+  double skip = 0;
+
+  for(char *opt = strtok(buf, ","); opt != NULL; opt = strtok(NULL, ",")){
+    char *val = strchr(opt, '=');
+    if(val != NULL){
+      *val++ = '\0';
+    }
+    double v = 0;
+    bool ok = true;
+    if(strcmp(opt, "loop") == 0 && val == NULL){
+      sim->loop = true;
+    }
+    else if(strcmp(opt, "frame") == 0 && val == NULL){
+      sim->frame = true;
+    }
+    else if(val == NULL){
+      ok = false;
+    }
+    else if(strcmp(opt, "ports") == 0){
+      sim->n_ports = atoi(val);
+      ok = sim->n_ports > 0;
+    }
+    else if(strcmp(opt, "async") == 0){
+      sim->async_port = atoi(val);
+    }
+    else if(strcmp(opt, "lat") == 0){
+      ok = parse_size(val, &v);
+      sim->lat_ns = (uint64_t)(v * 1000.0);
+    }
+    else if(strcmp(opt, "proto") == 0){
+      sim->proto = atoi(val);
+      ok = sim->proto == PROTO_V1 || sim->proto == PROTO_V2;
+    }
+    else if(strcmp(opt, "seed") == 0){
+      sim->seed = strtoull(val, NULL, 0);
+    }
+    else if(strcmp(opt, "corrupt") == 0){
+      sim->corrupt = atof(val);
+    }
+    else if(strcmp(opt, "drop") == 0){
+      sim->drop = atof(val);
+    }
+    else if(strcmp(opt, "replay") == 0){
+      replay_path = val;
+    }
+    else if(strcmp(opt, "speed") == 0){
+      sim->speed = atof(val);
+      ok = sim->speed >= 0;
+    }
+    else if(strcmp(opt, "from") == 0){
+      replay_from = atof(val);
+      ok = replay_from >= 0;
+    }
+    else if(strcmp(opt, "skip") == 0){
+      ok = parse_size(val, &skip);
+    }
+    else if(parse_size(val, &v)){
+      if(strcmp(opt, "abw") == 0){
+        sim->async_bw = v;
+      }
+      else if(strcmp(opt, "sbw") == 0){
+        sim->sync_bw = v;
+      }
+      else if(strcmp(opt, "bw") == 0){
+        sim->async_bw = sim->sync_bw = v;
+      }
+      else if(strcmp(opt, "rate") == 0){
+        sim->rate = v;
+      }
+      else if(strcmp(opt, "fifo") == 0){
+        sim->fifo = v;
+      }
+      else{
+        ok = false;
+      }
+    }
+    else{
+      ok = false;
+    }
+    if(!ok || sim->async_bw <= 0 || sim->sync_bw <= 0){
+      fprintf(stderr, "ERROR: bad simulator option \"%s\"\n", opt);
+      delete sim;
+      return NULL;
+    }
+  }
+  if(sim->frame && sim->loop){
+    fprintf(stderr, "ERROR: simulator options frame and loop are exclusive\n");
+    delete sim;
+    return NULL;
+  }
+  if(replay_path != NULL && (sim->frame || sim->loop || sim->rate > 0)){
+    fprintf(stderr, "ERROR: simulator option replay excludes frame, loop and rate\n");
+    delete sim;
+    return NULL;
+  }
+  if(replay_path != NULL){
+    sim->replay = new cap_reader;
+    if(!sim->replay->open(replay_path)){
+      delete sim;
+      return NULL;
+    }
+    if(replay_from > 0){
+      sim->replay->seek_time(sim->replay->start_ns() + (uint64_t)(replay_from * 1e9));
+    }
+    if(skip > 0){
+      sim->replay_skip = (uint64_t)skip;
+      sim->replay->seek_offset(sim->replay_skip);
+    }
+  }
+  return sim;
+}
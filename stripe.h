@@ -0,0 +1,23 @@
+/* stripe.h -- framing for captures interleaved from several devices.
+ *
+ * When dpticat reads more than one device onto a single output, every
+ * chunk is preceded by this header, all fields little-endian. seq counts
+ * the chunks of each source from 0, so a consumer can demultiplex the
+ * stream and spot anything missing.
+ */
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stdint.h>
+
+#define STRIPE_MAGIC 0x53545044u  /* "DPTS" */
+
+struct stripe_header {
+  uint32_t magic;
+  uint16_t source;    // index of the device in the --multi file
+  uint16_t reserved;
+  uint32_t length;    // bytes of data following the header
+  uint32_t seq;
+};
+
+#endif
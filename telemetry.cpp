@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#include "telemetry.h"
+
+static const char *step_names[TEL_STEPS] = { "request", "receive", "write", "loop" };
+
+tel_thread::tel_thread(const char *name) : chunks(0), bytes(0) {
+  snprintf(this->name, sizeof(this->name), "%s", name);
+  for(int s = 0; s < TEL_STEPS; s++){
+    steps[s].sum_ns = 0;
+    steps[s].max_ns = 0;
+    for(int k = 0; k < TEL_BUCKETS; k++){
+      steps[s].buckets[k] = 0;
+    }
+  }
+}
+
+void tel_thread::record(int step, uint64_t ns){
+  tel_latency &l = steps[step];
+  int k = 63 - __builtin_clzll(ns | 1);
+  if(k >= TEL_BUCKETS){
+    k = TEL_BUCKETS - 1;
+  }
+  bump(l.buckets[k], 1);
+  bump(l.sum_ns, ns);
+  if(ns > l.max_ns.load(std::memory_order_relaxed)){
+    l.max_ns.store(ns, std::memory_order_relaxed);
+  }
+}
+
+/* Upper bound in microseconds of the bucket holding the q quantile, no
+ * more than the largest latency seen.
+ */
+static double quantile_us(const uint64_t *buckets, uint64_t n, double q, uint64_t max_ns){
+  uint64_t want = (uint64_t)(q * n);
+  uint64_t below = 0;
+  int k = 0;
+  for(; k < TEL_BUCKETS - 1; k++){
+    below += buckets[k];
+    if(below > want){
+      break;
+    }
+  }
+  uint64_t bound = 2ull << k;
+  return (bound < max_ns ? bound : max_ns) / 1e3;
+}
+
+void tel_thread::dump(FILE *f) const {
+  fprintf(f, "%s: %llu chunks %llu bytes\n", name,
+          (unsigned long long)chunks.load(std::memory_order_relaxed),
+          (unsigned long long)bytes.load(std::memory_order_relaxed));
+  for(int s = 0; s < TEL_STEPS; s++){
+    const tel_latency &l = steps[s];
+    /* The counts are read one by one while the owner keeps adding, so
+     * take n from the buckets to keep the quantiles and the mean
+     * consistent.
+     */
+    uint64_t buckets[TEL_BUCKETS];
+    uint64_t n = 0;
+    for(int k = 0; k < TEL_BUCKETS; k++){
+      buckets[k] = l.buckets[k].load(std::memory_order_relaxed);
+      n += buckets[k];
+    }
+    if(n == 0){
+      continue;
+    }
+    uint64_t max_ns = l.max_ns.load(std::memory_order_relaxed);
+    fprintf(f, "  %s n=%llu mean=%.1fus p50<%.1fus p99<%.1fus max=%.1fus\n",
+            step_names[s], (unsigned long long)n,
+            l.sum_ns.load(std::memory_order_relaxed) / 1e3 / n,
+            quantile_us(buckets, n, 0.5, max_ns), quantile_us(buckets, n, 0.99, max_ns),
+            max_ns / 1e3);
+  }
+}
+
+telemetry::~telemetry(){
+  for(size_t i = 0; i < threads.size(); i++){
+    threads[i]->~tel_thread();
+    free(threads[i]);
+  }
+}
+
+tel_thread *telemetry::add(const char *fmt, int id){
+  char name[32];
+  snprintf(name, sizeof(name), fmt, id);
+  /* Cache-line aligned so threads do not share lines; plain new only
+   * honours that from C++17.
+   */
+  void *mem = NULL;
+  if(posix_memalign(&mem, alignof(tel_thread), sizeof(tel_thread)) != 0){
+    throw std::bad_alloc();
+  }
+  tel_thread *t = new (mem) tel_thread(name);
+  std::lock_guard<std::mutex> lock(mtx);
+  threads.push_back(t);
+  return t;
+}
+
+void telemetry::dump(FILE *f, double t){
+  std::lock_guard<std::mutex> lock(mtx);
+  fprintf(f, "# stats t=%.3f\n", t);
+  for(size_t i = 0; i < threads.size(); i++){
+    threads[i]->dump(f);
+  }
+  fflush(f);
+}
@@ -0,0 +1,96 @@
+/* telemetry.h -- hot-path counters and latency histograms.
+ *
+ * Every reader and writer thread of a capture owns a tel_thread: chunk
+ * and byte counters and, for each timed step (sending a request,
+ * receiving its reply, writing a chunk out, and the readers' own time
+ * between one transfer and the next), a histogram of latencies in
+ * power-of-two buckets. Only the owning thread updates them, with plain
+ * relaxed stores, so the hot path takes no lock and does no atomic
+ * read-modify-write; the dump reads them from another thread at any
+ * time. A dump looks like
+ *
+ *   # stats t=<seconds>
+ *   <thread>: <chunks> chunks <bytes> bytes
+ *     <step> n=<count> mean=<us> p50<<us> p99<<us> max=<us>
+ *
+ * the percentiles being bucket upper bounds (capped at the maximum).
+ */
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+/* Bucket k holds latencies in [2^k, 2^(k+1)) ns, the last one
+ * everything longer.
+ */
+#define TEL_BUCKETS 40
+
+enum {
+  TEL_REQUEST,
+  TEL_RECEIVE,
+  TEL_WRITE,
+  TEL_LOOP,
+  TEL_STEPS,
+};
+
+struct tel_latency {
+  std::atomic<uint64_t> sum_ns;
+  std::atomic<uint64_t> max_ns;
+  std::atomic<uint64_t> buckets[TEL_BUCKETS];
+};
+
+class alignas(64) tel_thread {
+public:
+  tel_thread(const char *name);
+
+  void count(uint64_t bytes){
+    bump(chunks, 1);
+    bump(this->bytes, bytes);
+  }
+
+  void record(int step, uint64_t ns);
+
+  /* Longest latency recorded for step.
+   */
+  uint64_t max_ns(int step) const {
+    return steps[step].max_ns.load(std::memory_order_relaxed);
+  }
+
+  void dump(FILE *f) const;
+
+private:
+  /* Single writer, so a load and a store make an increment.
+   */
+  static void bump(std::atomic<uint64_t> &a, uint64_t v){
+    a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+  }
+
+  char name[32];
+  std::atomic<uint64_t> chunks;
+  std::atomic<uint64_t> bytes;
+  tel_latency steps[TEL_STEPS];
+};
+
+/* The tel_threads of one capture.
+ */
+class telemetry {
+public:
+  ~telemetry();
+
+  /* A new tel_thread named after fmt and id, owned by the set.
+   */
+  tel_thread *add(const char *fmt, int id);
+
+  void dump(FILE *f, double t);
+
+private:
+  std::mutex mtx;
+  std::vector<tel_thread *> threads;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#!/bin/sh
+# sim.sh -- end-to-end checks of dpticat against the simulated device.
+#
+# Run by "make test" after the unit checks. Every output path must give
+# the byte stream plain stdout gives, duplex with -n must stop without
+# waiting for stdin to end, a fan-out sink that stalls must not hold up
+# the others, and a sink that fails must fail the run.
+
+DPTICAT=${DPTICAT:-./dpticat}
+DEV="sim:proto=2,bw=4G,lat=1"
+ARGS="-P 2 -c 64K -n 8M"
+
+tmp=$(mktemp -d /tmp/dpticat-sim.XXXXXX) || exit 1
+trap 'kill $holder $peer 2>/dev/null; rm -rf "$tmp"' EXIT
+failures=0
+
+fail(){
+  echo "FAIL: $*" >&2
+  failures=$((failures + 1))
+}
+
+same(){
+  cmp -s "$tmp/base" "$1" || fail "$2 differs from plain stdout"
+}
+
+"$DPTICAT" $ARGS $DEV 0 > "$tmp/base" 2>/dev/null || fail "plain stdout run failed"
+[ "$(wc -c < "$tmp/base")" -eq 8388608 ] || fail "plain stdout did not give 8M bytes"
+
+"$DPTICAT" $ARGS -q 0 $DEV 0 2>/dev/null > "$tmp/out" || fail "-q 0 failed"
+same "$tmp/out" "-q 0"
+"$DPTICAT" $ARGS -q 8 $DEV 0 2>/dev/null > "$tmp/out" || fail "-q 8 failed"
+same "$tmp/out" "-q 8"
+"$DPTICAT" $ARGS -z $DEV 0 2>/dev/null | cat > "$tmp/out"
+same "$tmp/out" "-z to a pipe"
+"$DPTICAT" -P 2 -c 5000 -n 8M -z $DEV 0 2>/dev/null | cat > "$tmp/out"
+same "$tmp/out" "-z with chunks of 5000"
+"$DPTICAT" $ARGS -S "$tmp/out" $DEV 0 2>/dev/null || fail "-S FILE failed"
+same "$tmp/out" "-S FILE"
+
+# -Z container, through --decompress.
+for mode in lz4 delta; do
+  "$DPTICAT" $ARGS -Z $mode --compress-block 100000 $DEV 0 > "$tmp/z" 2>/dev/null ||
+    fail "-Z $mode failed"
+  "$DPTICAT" --decompress "$tmp/z" > "$tmp/out" 2>/dev/null || fail "--decompress of -Z $mode failed"
+  same "$tmp/out" "-Z $mode and --decompress"
+done
+
+# Duplex with -n ends at N bytes while stdin is still open.
+mkfifo "$tmp/in"
+sleep 60 > "$tmp/in" &
+holder=$!
+start=$(date +%s)
+timeout 20 "$DPTICAT" -x $ARGS $DEV 0 < "$tmp/in" > "$tmp/out" 2>/dev/null ||
+  fail "-x -n did not end by itself"
+[ $(($(date +%s) - start)) -lt 10 ] || fail "-x -n took until the timeout"
+same "$tmp/out" "-x -n"
+kill $holder 2>/dev/null
+
+# A drop sink whose peer never reads must not hold up a block sink, nor
+# the end of the run.
+if command -v python3 > /dev/null; then
+  python3 -c '
+import socket, sys, time
+s = socket.socket(socket.AF_UNIX)
+s.bind(sys.argv[1])
+s.listen(1)
+c, _ = s.accept()
+time.sleep(60)
+' "$tmp/sock" &
+  peer=$!
+  for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$tmp/sock" ] && break
+    sleep 0.2
+  done
+  start=$(date +%s)
+  timeout 30 "$DPTICAT" -P 2 -c 64K -n 64M -S "$tmp/arch,block" -S "unix:$tmp/sock,drop" \
+    $DEV 0 2>/dev/null || fail "fan-out with a stalled drop sink failed"
+  [ $(($(date +%s) - start)) -lt 20 ] || fail "fan-out with a stalled drop sink took too long"
+  head -c 8388608 "$tmp/arch" > "$tmp/out"
+  same "$tmp/out" "the block sink next to a stalled drop sink"
+  [ "$(wc -c < "$tmp/arch")" -eq 67108864 ] || fail "the block sink lost data to a stalled drop sink"
+  kill $peer 2>/dev/null
+else
+  echo "skipped the stalled sink check, no python3" >&2
+fi
+
+# A block sink that fails fails the run.
+if "$DPTICAT" $ARGS -S /dev/full $DEV 0 2> "$tmp/err"; then
+  fail "-S /dev/full exited 0"
+fi
+grep -q ERROR "$tmp/err" || fail "-S /dev/full gave no error"
+
+if [ $failures -gt 0 ]; then
+  echo "$failures sim checks failed" >&2
+  exit 1
+fi
+echo "All sim checks passed" >&2
@@ -0,0 +1,479 @@
+/* units.cpp -- checks of the stream stages that need no device.
+ *
+ * Run by "make test", next to sim.sh for what needs the simulated
+ * device. Every check that fails says why on stderr, and the
+ * program then exits with status 1.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "../capture.h"
+#include "../trigger.h"
+#include "../timestamp.h"
+#include "../lzblock.h"
+#include "../compress.h"
+#include "../crc32c.h"
+#include "../decode.h"
+
+/* The parts of capture.cpp the stages under test lean on.
+ */
+volatile sig_atomic_t stop_requested = 0;
+
+bool write_all(int fd, const byte *buf, size_t len){
+  while(len > 0){
+    ssize_t n = write(fd, buf, len);
+    if(n <= 0){
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if(!(cond)){ \
+      fprintf(stderr, "FAIL %s:%i: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      failures++; \
+    } \
+  } while(0)
+
+/* Deterministic filler that never holds the byte 0xA1 nor a word with
+ * its low bits clear, so the test patterns only match where put.
+ */
+static std::vector<byte> filler(size_t len, uint32_t seed){
+  std::vector<byte> v(len);
+  for(size_t i = 0; i < len; i++){
+    seed = seed * 1103515245 + 12345;
+    v[i] = (byte)((seed >> 16) | 0x01);
+    if(v[i] == 0xA1){
+      v[i] = 0x55;
+    }
+  }
+  return v;
+}
+
+/* The stream cut at the offsets in cuts, in increasing order.
+ */
+static std::vector<size_t> chunk_lens(size_t len, const std::vector<size_t> &cuts){
+  std::vector<size_t> lens;
+  size_t at = 0;
+  for(size_t i = 0; i < cuts.size(); i++){
+    lens.push_back(cuts[i] - at);
+    at = cuts[i];
+  }
+  lens.push_back(len - at);
+  return lens;
+}
+
+static std::vector<size_t> every(size_t len, size_t step){
+  std::vector<size_t> cuts;
+  for(size_t at = step; at < len; at += step){
+    cuts.push_back(at);
+  }
+  return cuts;
+}
+
+/* Everything trigger spec with the window pre, post writes for stream
+ * fed in chunks of lens.
+ */
+static std::vector<byte> run_trigger(const char *spec, uint64_t pre, uint64_t post,
+                                     const std::vector<byte> &stream,
+                                     const std::vector<size_t> &lens){
+  trigger trig;
+  std::vector<byte> out;
+  if(!trig.parse(spec)){
+    return out;
+  }
+  trig.set_window(pre, post);
+  const byte *p;
+  size_t at = 0;
+  for(size_t i = 0; i < lens.size(); i++){
+    size_t n = trig.feed(stream.data() + at, lens[i], 0, &p);
+    out.insert(out.end(), p, p + n);
+    at += lens[i];
+  }
+  size_t n = trig.flush(&p);
+  out.insert(out.end(), p, p + n);
+  return out;
+}
+
+/* The windows in out, each checked against the stream it came from.
+ * Returns their trigger points.
+ */
+static std::vector<uint64_t> windows(const std::vector<byte> &out,
+                                     const std::vector<byte> &stream, const char *what){
+  std::vector<uint64_t> trigs;
+  size_t at = 0;
+  while(at + sizeof(trig_header) <= out.size()){
+    trig_header h;
+    memcpy(&h, out.data() + at, sizeof(h));
+    at += sizeof(h);
+    CHECK(h.magic == TRIG_MAGIC, "%s: window %zu bad magic", what, trigs.size());
+    CHECK(h.seq == trigs.size(), "%s: window %zu has seq %u", what, trigs.size(), h.seq);
+    if(h.magic != TRIG_MAGIC || at + h.length > out.size() ||
+       h.start + h.length > stream.size()){
+      CHECK(false, "%s: window %zu runs past the end", what, trigs.size());
+      return trigs;
+    }
+    CHECK(memcmp(out.data() + at, stream.data() + h.start, h.length) == 0,
+          "%s: window %zu does not match the stream", what, trigs.size());
+    trigs.push_back(h.trigger);
+    at += h.length;
+  }
+  CHECK(at == out.size(), "%s: %zu stray bytes after the windows", what, out.size() - at);
+  return trigs;
+}
+
+/* Feed stream whole, split in two at every offset, and in chunks of
+ * every size up to 2 * W_BYTES; all must give the same windows, and
+ * those must be at trigs.
+ */
+static void check_splits(const char *spec, uint64_t pre, uint64_t post,
+                         const std::vector<byte> &stream, const std::vector<uint64_t> &trigs){
+  char what[128];
+  std::vector<byte> whole = run_trigger(spec, pre, post, stream,
+                                        chunk_lens(stream.size(), std::vector<size_t>()));
+  snprintf(what, sizeof(what), "%s pre=%llu post=%llu whole", spec,
+           (unsigned long long)pre, (unsigned long long)post);
+  std::vector<uint64_t> got = windows(whole, stream, what);
+  CHECK(got == trigs, "%s: %zu windows, expected %zu", what, got.size(), trigs.size());
+
+  for(size_t at = 1; at < stream.size(); at++){
+    std::vector<size_t> cut(1, at);
+    std::vector<byte> out = run_trigger(spec, pre, post, stream, chunk_lens(stream.size(), cut));
+    snprintf(what, sizeof(what), "%s pre=%llu post=%llu split at %zu", spec,
+             (unsigned long long)pre, (unsigned long long)post, at);
+    windows(out, stream, what);
+    CHECK(out == whole, "%s: output differs from the whole stream's", what);
+  }
+  for(size_t step = 1; step <= 2 * W_BYTES; step++){
+    std::vector<byte> out = run_trigger(spec, pre, post, stream,
+                                        chunk_lens(stream.size(), every(stream.size(), step)));
+    snprintf(what, sizeof(what), "%s pre=%llu post=%llu chunks of %zu", spec,
+             (unsigned long long)pre, (unsigned long long)post, step);
+    windows(out, stream, what);
+    CHECK(out == whole, "%s: output differs from the whole stream's", what);
+  }
+}
+
+/* Timestamp-like words: a coarse count that creeps up and a noisy fine
+ * field, the stream -Z delta is made for.
+ */
+static std::vector<byte> timestamps(size_t n_words, uint32_t seed){
+  std::vector<byte> v(n_words * W_BYTES);
+  uint64_t coarse = 1000;
+  for(size_t i = 0; i < n_words; i++){
+    seed = seed * 1103515245 + 12345;
+    coarse += (seed >> 16) % 5;
+    uint64_t w = coarse << FINE | ((seed >> 8) & ((1u << FINE) - 1));
+    for(int k = 0; k < W_BYTES; k++){
+      v[i * W_BYTES + k] = (byte)(w >> (8 * k));
+    }
+  }
+  return v;
+}
+
+static void test_crc32c(){
+  static const struct { const char *data; size_t len; uint32_t crc; } known[] = {
+    { "", 0, 0x00000000 },
+    { "a", 1, 0xC1D04330 },
+    { "123456789", 9, 0xE3069283 },
+    { "The quick brown fox jumps over the lazy dog", 43, 0x22620404 },
+  };
+  for(size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++){
+    uint32_t hw = crc32c(0, known[i].data, known[i].len);
+    uint32_t sw = crc32c_sw(0, known[i].data, known[i].len);
+    CHECK(hw == known[i].crc && sw == known[i].crc, "crc32c(\"%s\") = %08x/%08x, expected %08x",
+          known[i].data, hw, sw, known[i].crc);
+  }
+
+  /* RFC 3720 B.4: 32 bytes of zeros, of ones and counting up.
+   */
+  byte buf[32];
+  memset(buf, 0, sizeof(buf));
+  CHECK(crc32c(0, buf, 32) == 0x8A9136AA, "crc32c of 32 zeros = %08x", crc32c(0, buf, 32));
+  memset(buf, 0xff, sizeof(buf));
+  CHECK(crc32c(0, buf, 32) == 0x62A8AB43, "crc32c of 32 ones = %08x", crc32c(0, buf, 32));
+  for(int i = 0; i < 32; i++){
+    buf[i] = i;
+  }
+  CHECK(crc32c(0, buf, 32) == 0x46DD794E, "crc32c of 0..31 = %08x", crc32c(0, buf, 32));
+
+  /* Every length and alignment, whole and chained in two.
+   */
+  std::vector<byte> data = filler(300, 3);
+  for(size_t off = 0; off < 8; off++){
+    for(size_t len = 0; off + len <= data.size(); len += 7){
+      uint32_t sw = crc32c_sw(0, data.data() + off, len);
+      CHECK(crc32c(0, data.data() + off, len) == sw, "crc32c at %zu+%zu differs from the table",
+            off, len);
+      size_t half = len / 3;
+      uint32_t chained = crc32c(crc32c(0, data.data() + off, half), data.data() + off + half,
+                                len - half);
+      CHECK(chained == sw, "crc32c at %zu+%zu chained at %zu differs", off, len, half);
+    }
+  }
+}
+
+/* Compress in, check it decompresses to in and that corrupt blocks are
+ * refused without reading or writing out of bounds.
+ */
+static void check_lz(const std::vector<byte> &in, const char *what){
+  size_t cap = in.size() + in.size() / 255 + 16;
+  std::vector<byte> comp(cap);
+  size_t n = lz_compress(in.data(), in.size(), comp.data(), cap);
+  CHECK(n > 0 || in.empty(), "%s: %zu bytes did not compress", what, in.size());
+  if(n == 0){
+    return;
+  }
+  comp.resize(n);
+  std::vector<byte> out(in.size() + 1, 0xee);
+  CHECK(lz_decompress(comp.data(), n, out.data(), in.size()), "%s: did not decompress", what);
+  CHECK(memcmp(out.data(), in.data(), in.size()) == 0, "%s: round trip differs", what);
+  CHECK(out[in.size()] == 0xee, "%s: wrote past raw_len", what);
+
+  if(in.empty()){
+    return;
+  }
+  CHECK(!lz_decompress(comp.data(), n, out.data(), in.size() - 1),
+        "%s: decompressed to a short raw_len", what);
+  for(size_t cut = 0; cut < n; cut += 1 + n / 64){
+    std::vector<byte> part(comp.begin(), comp.begin() + cut);
+    CHECK(!lz_decompress(part.data(), cut, out.data(), in.size()),
+          "%s: took a block cut to %zu bytes", what, cut);
+  }
+}
+
+static void test_lz(){
+  char what[64];
+  for(size_t len = 0; len <= 300; len++){
+    snprintf(what, sizeof(what), "lz random %zu", len);
+    check_lz(filler(len, 4 + len), what);
+    snprintf(what, sizeof(what), "lz zeros %zu", len);
+    check_lz(std::vector<byte>(len, 0), what);
+  }
+  std::vector<byte> rep;
+  for(int i = 0; i < 100000; i++){
+    rep.push_back("dpticat"[i % 7]);
+  }
+  check_lz(rep, "lz repeated text");
+  check_lz(timestamps(1 << 17, 5), "lz timestamps");
+  check_lz(filler(1 << 20, 6), "lz random 1M");
+
+  size_t cap = rep.size();
+  std::vector<byte> comp(cap);
+  CHECK(lz_compress(rep.data(), rep.size(), comp.data(), cap) < rep.size() / 50,
+        "lz: repeated text barely compressed");
+}
+
+/* Send stderr, where the -Z stages report, to /dev/null while quiet is
+ * set, so only the checks' complaints show.
+ */
+static void quiet(bool on){
+  static int saved = -1;
+  if(on && saved < 0){
+    saved = dup(2);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, 2);
+    close(null_fd);
+  }
+  else if(!on && saved >= 0){
+    dup2(saved, 2);
+    close(saved);
+    saved = -1;
+  }
+}
+
+/* Write stream through z_writer in pieces of piece bytes and read it
+ * back with z_decompress(), also from a copy cut short.
+ */
+static void check_container(int mode, size_t block, size_t piece, const std::vector<byte> &stream){
+  char what[96];
+  snprintf(what, sizeof(what), "-Z %s block %zu pieces %zu", mode == Z_MODE_LZ4 ? "lz4" : "delta",
+           block, piece);
+  char z_path[] = "/tmp/dpticat-units-XXXXXX";
+  char raw_path[] = "/tmp/dpticat-units-XXXXXX";
+  int z_fd = mkstemp(z_path);
+  int raw_fd = mkstemp(raw_path);
+  if(z_fd < 0 || raw_fd < 0){
+    CHECK(false, "%s: cannot create temporary files", what);
+    return;
+  }
+
+  quiet(true);
+  z_writer zw;
+  zw.open(z_fd, NULL, mode, block, 2);
+  bool written = true;
+  for(size_t at = 0; at < stream.size(); at += piece){
+    size_t n = stream.size() - at < piece ? stream.size() - at : piece;
+    written = zw.write(stream.data() + at, n) && written;
+  }
+  written = zw.close() && written;
+  int status = z_decompress(z_path, raw_fd, 2);
+  quiet(false);
+  CHECK(written, "%s: writing failed", what);
+  CHECK(status == 0, "%s: --decompress failed", what);
+  off_t z_len = lseek(z_fd, 0, SEEK_END);
+
+  off_t raw_len = lseek(raw_fd, 0, SEEK_END);
+  std::vector<byte> back(raw_len);
+  CHECK(pread(raw_fd, back.data(), raw_len, 0) == raw_len && back == stream,
+        "%s: %lld bytes came back, not the %zu written", what, (long long)raw_len, stream.size());
+
+  /* A file still being written decodes up to its last whole block.
+   */
+  CHECK(ftruncate(z_fd, z_len / 2) == 0 && ftruncate(raw_fd, 0) == 0 &&
+        lseek(raw_fd, 0, SEEK_SET) == 0, "%s: cannot truncate", what);
+  quiet(true);
+  z_decompress(z_path, raw_fd, 2);
+  quiet(false);
+  raw_len = lseek(raw_fd, 0, SEEK_END);
+  back.resize(raw_len);
+  CHECK(raw_len % block == 0 && (size_t)raw_len <= stream.size() &&
+        pread(raw_fd, back.data(), raw_len, 0) == raw_len &&
+        memcmp(back.data(), stream.data(), raw_len) == 0,
+        "%s: the first half gave %lld bytes that are not a prefix", what, (long long)raw_len);
+
+  close(z_fd);
+  close(raw_fd);
+  unlink(z_path);
+  unlink(raw_path);
+}
+
+static void test_container(){
+  std::vector<byte> ts = timestamps(50000, 7);
+  ts.resize(ts.size() - 3);     // not whole words at the end
+  std::vector<byte> noise = filler(150001, 8);
+  for(int mode = Z_MODE_LZ4; mode <= Z_MODE_DELTA; mode++){
+    check_container(mode, 65536, 4096, ts);
+    check_container(mode, 65536, 1000, noise);
+    check_container(mode, 4096, 100000, ts);
+    check_container(mode, 4096, 7, std::vector<byte>(20000, 0));
+  }
+}
+
+/* ts_decoder output for the stream fed in chunks of lens.
+ */
+static std::vector<byte> run_decoder(int format, const std::vector<byte> &stream,
+                                     const std::vector<size_t> &lens, size_t *partial){
+  ts_decoder dec(format);
+  std::vector<byte> out;
+  const byte *p;
+  size_t at = 0;
+  for(size_t i = 0; i < lens.size(); i++){
+    size_t n = dec.decode(stream.data() + at, lens[i], &p);
+    out.insert(out.end(), p, p + n);
+    at += lens[i];
+  }
+  *partial = dec.partial();
+  return out;
+}
+
+static void test_decoder(){
+  std::vector<byte> stream = timestamps(50, 9);
+  stream.resize(stream.size() - 5);
+
+  std::vector<ts_fields> vec(50), scalar(50);
+  ts_unpack(stream.data(), 49, vec.data());
+  ts_unpack_scalar(stream.data(), 49, scalar.data());
+  CHECK(memcmp(vec.data(), scalar.data(), 49 * sizeof(ts_fields)) == 0,
+        "ts_unpack differs from ts_unpack_scalar");
+
+  static const int formats[] = { FORMAT_BIN, FORMAT_CSV, FORMAT_TEXT };
+  for(size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++){
+    size_t partial;
+    std::vector<byte> whole = run_decoder(formats[f], stream,
+                                          chunk_lens(stream.size(), std::vector<size_t>()),
+                                          &partial);
+    CHECK(partial == 3, "format %i: %zu bytes held back, expected 3", formats[f], partial);
+    if(formats[f] == FORMAT_BIN){
+      CHECK(whole.size() == 49 * sizeof(ts_fields) &&
+            memcmp(whole.data(), scalar.data(), whole.size()) == 0,
+            "format bin: records differ from the words");
+    }
+    for(size_t at = 1; at < stream.size(); at++){
+      std::vector<byte> out = run_decoder(formats[f], stream,
+                                          chunk_lens(stream.size(), std::vector<size_t>(1, at)),
+                                          &partial);
+      CHECK(out == whole && partial == 3, "format %i split at %zu: output differs",
+            formats[f], at);
+    }
+    for(size_t step = 1; step <= 2 * W_BYTES; step++){
+      std::vector<byte> out = run_decoder(formats[f], stream,
+                                          chunk_lens(stream.size(), every(stream.size(), step)),
+                                          &partial);
+      CHECK(out == whole && partial == 3, "format %i in chunks of %zu: output differs",
+            formats[f], step);
+    }
+  }
+}
+
+static void test_trigger_bytes(){
+  static const byte pat[] = { 0xA1, 0xB2, 0xC3, 0xD4 };
+  std::vector<byte> stream = filler(96, 1);
+  memcpy(&stream[10], pat, sizeof(pat));
+  memcpy(&stream[40], pat, sizeof(pat));
+  memcpy(&stream[44], pat, sizeof(pat));   // held off unless post <= 4
+  memcpy(&stream[90], pat, sizeof(pat));   // cut short by the end with a long post
+
+  std::vector<uint64_t> all;
+  all.push_back(10);
+  all.push_back(40);
+  all.push_back(44);
+  all.push_back(90);
+  std::vector<uint64_t> held(all);
+  held.erase(held.begin() + 2);
+
+  check_splits("bytes=A1B2C3D4", 0, 1, stream, all);
+  check_splits("bytes=A1B2C3D4", 3, 1, stream, all);
+  check_splits("bytes=A1B2C3D4", 4, 2, stream, all);
+  check_splits("bytes=A1B2C3D4", 8, 16, stream, held);
+  check_splits("bytes=A1B2C3D4", 100, 100, stream, std::vector<uint64_t>(1, 10));
+}
+
+static void test_trigger_words(){
+  std::vector<byte> stream = filler(40 * W_BYTES, 2);
+  static const int at[] = { 3, 12, 13, 39 };
+  for(size_t i = 0; i < sizeof(at) / sizeof(at[0]); i++){
+    memset(&stream[at[i] * W_BYTES], 0, W_BYTES);
+    stream[at[i] * W_BYTES] = 0x34;
+    stream[at[i] * W_BYTES + 1] = 0x12;
+  }
+
+  std::vector<uint64_t> all;
+  for(size_t i = 0; i < sizeof(at) / sizeof(at[0]); i++){
+    all.push_back(at[i] * W_BYTES);
+  }
+  std::vector<uint64_t> held(all);
+  held.erase(held.begin() + 2);
+
+  check_splits("word=0x1234", 0, 1, stream, all);
+  check_splits("word=0x1234", 2 * W_BYTES, W_BYTES, stream, all);
+  check_splits("word=0x1234/0xffff", W_BYTES, 4 * W_BYTES, stream, held);
+}
+
+int main(){
+  test_crc32c();
+  test_lz();
+  test_container();
+  test_decoder();
+  test_trigger_bytes();
+  test_trigger_words();
+
+  if(failures > 0){
+    fprintf(stderr, "%i checks failed\n", failures);
+    return 1;
+  }
+  fprintf(stderr, "All checks passed\n");
+  return 0;
+}
@@ -0,0 +1,14 @@
+/* timestamp.h -- layout of the words produced by the dpticat bitstream.
+ *
+ * The FPGA streams W_BYTES-byte little-endian words: a FINE-bit fine
+ * time in the low bits and a COARSE-bit coarse count above it.
+ */
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#define W_BYTES 8
+#define WIDTH (W_BYTES * 8)
+#define FINE 10
+#define COARSE (WIDTH - FINE)
+
+#endif
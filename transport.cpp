@@ -0,0 +1,160 @@
+#include <string.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#include "transport.h"
+
+#ifndef DPTICAT_NO_ADEPT
+
+/* Thin pass-through to the Adept SDK, with one HIF shared between
+ * threads (the duplex sender and the reader). Every transfer is queued
+ * overlapped and takes a ticket in queueing order, which is the order
+ * DmgrGetTransResult hands the results back in. A thread collects its
+ * result only once all older ones have been collected, and waits for it
+ * without holding io_mtx. So what is serialised is queueing a transfer
+ * and the order results are collected in; a blocking IN transfer that is
+ * waiting on the device does not keep another thread from queueing an
+ * OUT transfer. Overlapped transfers are collected with
+ * get_trans_result() by the one thread that queues them.
+ */
+class adept_transport : public transport {
+public:
+  adept_transport(HIF h) : hif(h), n_queued(0), n_collected(0) {}
+  ~adept_transport() { close(); }
+
+  bool get_port_count(int *n_ports){
+    INT32 n;
+    if(!DptiGetPortCount(hif, &n)){
+      return false;
+    }
+    *n_ports = n;
+    return true;
+  }
+
+  bool get_port_properties(int port, DPRP *props){
+    return DptiGetPortProperties(hif, port, props);
+  }
+
+  bool enable(int port){
+    return DptiEnableEx(hif, port);
+  }
+
+  bool disable(){
+    return DptiDisable(hif);
+  }
+
+  bool io(byte *out, DWORD n_out, byte *in, DWORD n_in, bool overlap){
+    uint64_t ticket;
+    {
+      std::lock_guard<std::mutex> lock(io_mtx);
+      if(!DptiIO(hif, out, n_out, in, n_in, fTrue)){
+        return false;
+      }
+      ticket = n_queued++;
+      if(overlap){
+        overlapped.push_back(ticket);
+        return true;
+      }
+    }
+    DWORD n_sent, n_received;
+    return collect(ticket, &n_sent, &n_received, true);
+  }
+
+  bool get_trans_result(DWORD *n_out, DWORD *n_in, bool wait){
+    uint64_t ticket;
+    {
+      std::lock_guard<std::mutex> lock(io_mtx);
+      if(overlapped.empty()){
+        return DmgrGetTransResult(hif, n_out, n_in, wait ? tmsWaitInfinite : 0);
+      }
+      ticket = overlapped.front();
+    }
+    return collect(ticket, n_out, n_in, wait);
+  }
+
+  bool set_timeout(DWORD ms){
+    return DmgrSetTransTimeout(hif, ms);
+  }
+
+  bool cancel(){
+    return DmgrCancelTrans(hif);
+  }
+
+  ERC last_error(){
+    return DmgrGetLastError();
+  }
+
+  void close(){
+    if(hif != hifInvalid){
+      DmgrClose(hif);
+      hif = hifInvalid;
+    }
+  }
+
+private:
+  /* Wait until ticket is the oldest transfer still to be collected, then
+   * collect it. Without wait, returns false at once if it is not done.
+   */
+  bool collect(uint64_t ticket, DWORD *n_out, DWORD *n_in, bool wait){
+    {
+      std::unique_lock<std::mutex> lock(io_mtx);
+      if(!wait && n_collected != ticket){
+        return false;
+      }
+      while(n_collected != ticket){
+        turn_cv.wait(lock);
+      }
+    }
+    /* Without wait a false result may just mean the transfer is not
+     * done yet, so it stays the oldest. With wait it is finished either
+     * way.
+     */
+    bool ok = DmgrGetTransResult(hif, n_out, n_in, wait ? tmsWaitInfinite : 0);
+    if(!ok && !wait){
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(io_mtx);
+      n_collected++;
+      if(!overlapped.empty() && overlapped.front() == ticket){
+        overlapped.pop_front();
+      }
+    }
+    turn_cv.notify_all();
+    return ok;
+  }
+
+  HIF hif;
+  std::mutex io_mtx;
+  std::condition_variable turn_cv;
+  uint64_t n_queued;        // tickets handed out
+  uint64_t n_collected;     // results collected
+  std::deque<uint64_t> overlapped;
+};
+
+#endif
+
+transport *transport_open(const char *name){
+  if(strcmp(name, "sim") == 0){
+    return sim_open("");
+  }
+  if(strncmp(name, "sim:", 4) == 0){
+    return sim_open(name + 4);
+  }
+#ifndef DPTICAT_NO_ADEPT
+  char dev_name[cchDvcNameMax + 1];
+  HIF hif = hifInvalid;
+  if(strlen(name) > cchDvcNameMax){
+    return NULL;
+  }
+  strcpy(dev_name, name);
+  if(!DmgrOpen(&hif, dev_name)){
+    return NULL;
+  }
+  return new adept_transport(hif);
+#else
+  return NULL;
+#endif
+}
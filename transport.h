@@ -0,0 +1,60 @@
+/* transport.h -- device access behind a common interface.
+ *
+ * A transport wraps one open device handle. The methods mirror the Adept
+ * DMGR/DPTI calls they replace and follow the same conventions: they
+ * return false on failure and the reason is available from last_error().
+ * Transfers may be issued from more than one thread; each io() call is
+ * carried out as a unit. cancel() aborts transfers that are waiting on
+ * the device and may be called while another thread is inside io().
+ *
+ * transport_open() picks the backend from the device name:
+ *
+ *   sim[:opt=val,...]   simulated DPTI device (see simdev.cpp)
+ *   anything else       real device opened through DmgrOpen
+ */
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "adept.h"
+
+typedef unsigned char byte;
+
+/* last_error() of a receive that ran into the end of the device's data.
+ * Not an Adept code; only a simulated replay ends.
+ */
+const ERC ercEndOfData = 0x10000;
+
+class transport {
+public:
+  virtual ~transport() {}
+
+  virtual bool get_port_count(int *n_ports) = 0;
+  virtual bool get_port_properties(int port, DPRP *props) = 0;
+  virtual bool enable(int port) = 0;
+  virtual bool disable() = 0;
+
+  /* Send n_out bytes then receive n_in bytes. With overlap set the call
+   * returns as soon as the transfer is queued and its completion must be
+   * collected, oldest first, with get_trans_result().
+   */
+  virtual bool io(byte *out, DWORD n_out, byte *in, DWORD n_in, bool overlap) = 0;
+  virtual bool get_trans_result(DWORD *n_out, DWORD *n_in, bool wait) = 0;
+
+  /* After a transfer failed with ercEndOfData, the bytes of its reply
+   * that did arrive.
+   */
+  virtual DWORD end_bytes() { return 0; }
+
+  virtual bool set_timeout(DWORD ms) = 0;
+  virtual bool cancel() = 0;
+  virtual ERC last_error() = 0;
+  virtual void close() = 0;
+};
+
+transport *transport_open(const char *name);
+transport *sim_open(const char *opts);
+
+#endif
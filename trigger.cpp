@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "trigger.h"
+#include "timestamp.h"
+
+#define COARSE_MASK (COARSE >= 64 ? ~0ull : (1ull << COARSE) - 1)
+
+static uint64_t load_word(const byte *p){
+  uint64_t w = 0;
+  for(int k = 0; k < W_BYTES; k++){
+    w |= (uint64_t)p[k] << (8 * k);
+  }
+  return w;
+}
+
+static int hex_digit(char c){
+  if(c >= '0' && c <= '9'){
+    return c - '0';
+  }
+  c = tolower((unsigned char)c);
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+trigger::trigger() :
+  kind(TRIG_WORD), value(0), mask(~0ull), rate_words(0), rate_counts(0), pattern_len(0),
+  pre(0), post(0), base(0), n_carry(0), n_words(0), n_tail(0), next_allowed(0),
+  hist_len(0), capturing(false), win_pos(0), win_end(0), last_end(0),
+  n_windows(0), held_off(0), bytes_out(0) {
+}
+
+bool trigger::parse(const char *spec){
+  char *end;
+  if(strncmp(spec, "word=", 5) == 0){
+    kind = TRIG_WORD;
+    value = strtoull(spec + 5, &end, 0);
+    bool ok = end != spec + 5;
+    if(ok && *end == '/'){
+      const char *m = end + 1;
+      mask = strtoull(m, &end, 0);
+      ok = end != m;
+    }
+    if(ok && *end == '\0'){
+      value &= mask;
+      return true;
+    }
+  }
+  else if(strncmp(spec, "rate=", 5) == 0){
+    kind = TRIG_RATE;
+    rate_words = strtoull(spec + 5, &end, 0);
+    if(*end == ':' && rate_words >= 2){
+      const char *c = end + 1;
+      rate_counts = strtoull(c, &end, 0);
+      if(end != c && *end == '\0'){
+        recent.assign(rate_words, 0);
+        return true;
+      }
+    }
+  }
+  else if(strncmp(spec, "bytes=", 6) == 0){
+    kind = TRIG_BYTES;
+    const char *h = spec + 6;
+    size_t n = strlen(h);
+    bool ok = n > 0 && n % 2 == 0 && n / 2 <= TRIG_MAX_PATTERN;
+    for(size_t i = 0; ok && i < n / 2; i++){
+      int hi = hex_digit(h[2 * i]);
+      int lo = hex_digit(h[2 * i + 1]);
+      ok = hi >= 0 && lo >= 0;
+      pattern[i] = hi << 4 | lo;
+    }
+    if(ok){
+      pattern_len = n / 2;
+      return true;
+    }
+  }
+  fprintf(stderr, "ERROR: invalid trigger %s, expected word=V[/MASK], rate=N:COUNTS "
+          "or bytes=HEX\n", spec);
+  return false;
+}
+
+void trigger::set_window(uint64_t pre, uint64_t post){
+  if(kind != TRIG_BYTES){
+    pre = (pre + W_BYTES - 1) / W_BYTES * W_BYTES;
+    post = (post + W_BYTES - 1) / W_BYTES * W_BYTES;
+  }
+  this->pre = pre;
+  this->post = post > 0 ? post : 1;
+  /* Room for a pattern or word that began in an earlier chunk on top.
+   */
+  hist.resize(pre + TRIG_MAX_PATTERN);
+}
+
+void trigger::fire(uint64_t off){
+  if(off < next_allowed){
+    held_off++;
+    return;
+  }
+  fires.push_back(off);
+  next_allowed = off + post;
+}
+
+inline void trigger::check_word(uint64_t w, uint64_t off){
+  if(kind == TRIG_WORD){
+    if((w & mask) == value){
+      fire(off);
+    }
+    return;
+  }
+  uint64_t coarse = w >> FINE;
+  recent[n_words % rate_words] = coarse;
+  n_words++;
+  if(n_words >= rate_words &&
+     ((coarse - recent[n_words % rate_words]) & COARSE_MASK) <= rate_counts){
+    fire(off);
+  }
+}
+
+/* Collect the trigger points in the len bytes at base into fires.
+ */
+void trigger::detect(const byte *in, size_t len){
+  if(kind == TRIG_BYTES){
+    /* Matches that start in the tail of the previous chunk first.
+     */
+    size_t take = len < pattern_len - 1 ? len : pattern_len - 1;
+    if(n_tail > 0 && take > 0){
+      byte edge[2 * TRIG_MAX_PATTERN];
+      memcpy(edge, tail, n_tail);
+      memcpy(edge + n_tail, in, take);
+      for(size_t i = 0; i < n_tail && i + pattern_len <= n_tail + take; i++){
+        if(memcmp(edge + i, pattern, pattern_len) == 0){
+          fire(base - n_tail + i);
+        }
+      }
+    }
+    const byte *p = in;
+    const byte *end = in + len;
+    while((p = (const byte *)memmem(p, end - p, pattern, pattern_len)) != NULL){
+      fire(base + (p - in));
+      p++;
+    }
+
+    /* Keep the last pattern_len - 1 bytes of the stream.
+     */
+    size_t keep = pattern_len - 1;
+    if(len >= keep){
+      memcpy(tail, in + len - keep, keep);
+      n_tail = keep;
+    }
+    else{
+      size_t drop = n_tail + len > keep ? n_tail + len - keep : 0;
+      memmove(tail, tail + drop, n_tail - drop);
+      memcpy(tail + n_tail - drop, in, len);
+      n_tail = n_tail - drop + len;
+    }
+    return;
+  }
+
+  size_t i = 0;
+  if(n_carry > 0){
+    size_t take = W_BYTES - n_carry < len ? W_BYTES - n_carry : len;
+    memcpy(carry + n_carry, in, take);
+    n_carry += take;
+    i = take;
+    if(n_carry < W_BYTES){
+      return;
+    }
+    check_word(load_word(carry), base + i - W_BYTES);
+    n_carry = 0;
+  }
+  for(; i + W_BYTES <= len; i += W_BYTES){
+    check_word(load_word(in + i), base + i);
+  }
+  n_carry = len - i;
+  memcpy(carry, in + i, n_carry);
+}
+
+/* Begin the window for trig, taking what it needs from before base out
+ * of the history. A pattern that began in an earlier chunk may have
+ * been followed by all of the window there, then it is complete before
+ * base and fill() finishes it.
+ */
+void trigger::start_window(uint64_t trig, uint64_t t_ns){
+  uint64_t start = trig > pre ? trig - pre : 0;
+  if(start < last_end){
+    start = last_end;
+  }
+  if(start < base - hist_len){
+    start = base - hist_len;
+  }
+
+  win.resize(sizeof(trig_header));
+  trig_header hdr;
+  hdr.magic = TRIG_MAGIC;
+  hdr.seq = n_windows;
+  hdr.start = start;
+  hdr.trigger = trig;
+  hdr.length = 0;
+  hdr.t_ns = t_ns;
+  memcpy(win.data(), &hdr, sizeof(hdr));
+
+  win_end = trig + post;
+  uint64_t upto = win_end < base ? win_end : base;
+  size_t h = hist.size();
+  for(uint64_t o = start; o < upto; ){
+    size_t at = o % h;
+    size_t n = h - at < upto - o ? h - at : upto - o;
+    win.insert(win.end(), hist.data() + at, hist.data() + at + n);
+    o += n;
+  }
+  capturing = true;
+  win_pos = start > upto ? start : upto;
+}
+
+/* Add the chunk's share of the window being captured.
+ */
+void trigger::fill(const byte *in, size_t len){
+  if(!capturing){
+    return;
+  }
+  uint64_t to = win_end < base + len ? win_end : base + len;
+  if(win_pos < to){
+    win.insert(win.end(), in + (win_pos - base), in + (to - base));
+    win_pos = to;
+  }
+  if(win_pos == win_end){
+    finish_window();
+  }
+}
+
+void trigger::finish_window(){
+  trig_header *hdr = (trig_header *)win.data();
+  hdr->length = win.size() - sizeof(trig_header);
+  out_buf.insert(out_buf.end(), win.begin(), win.end());
+  bytes_out += hdr->length;
+  last_end = win_pos;
+  capturing = false;
+  n_windows++;
+}
+
+void trigger::keep_history(const byte *in, size_t len){
+  size_t h = hist.size();
+  if(len > h){
+    in += len - h;
+    base += len - h;
+    len = h;
+  }
+  while(len > 0){
+    size_t at = base % h;
+    size_t n = h - at < len ? h - at : len;
+    memcpy(hist.data() + at, in, n);
+    in += n;
+    base += n;
+    len -= n;
+  }
+  hist_len = base < h ? base : h;
+}
+
+size_t trigger::feed(const byte *in, size_t len, uint64_t t_ns, const byte **out){
+  out_buf.clear();
+  fires.clear();
+  detect(in, len);
+
+  /* Windows never overlap, so the one being captured always ends before
+   * the next trigger point.
+   */
+  for(size_t i = 0; i < fires.size(); i++){
+    fill(in, len);
+    start_window(fires[i], t_ns);
+  }
+  fill(in, len);
+  keep_history(in, len);
+  *out = out_buf.data();
+  return out_buf.size();
+}
+
+size_t trigger::flush(const byte **out){
+  out_buf.clear();
+  if(capturing){
+    finish_window();
+  }
+  *out = out_buf.data();
+  return out_buf.size();
+}
+
+void trigger::report(FILE *f) const {
+  fprintf(f, "Trigger: %u windows, %llu of %llu bytes written, %llu triggers held off\n",
+          n_windows, (unsigned long long)bytes_out, (unsigned long long)base,
+          (unsigned long long)held_off);
+}
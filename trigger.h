@@ -0,0 +1,135 @@
+/* trigger.h -- write only the windows of the stream around events.
+ *
+ * Like a logic analyser, the trigger stage watches the stream for a
+ * condition and, each time it is met, writes a window of pre bytes
+ * before the trigger point and post bytes from it on. The last pre bytes
+ * are always kept in a history ring, so the window can reach back before
+ * the data that set it off. A condition is one of
+ *
+ *   word=V[/MASK]  a word whose bits under MASK (default all) equal V
+ *   rate=N:C       N words within C coarse counts of each other, a burst
+ *   bytes=HEX      the raw byte sequence HEX anywhere in the stream
+ *
+ * The word conditions look at whole W_BYTES words (timestamp.h) and keep
+ * the windows word aligned. While a window is being captured the
+ * condition is not re-armed: triggers within post bytes of the last one
+ * are counted as held off. Windows never repeat data, the pre part of a
+ * window stops where the previous window ended.
+ *
+ * Each window is written as a trig_header, all fields little-endian,
+ * followed by length bytes of the stream.
+ */
+#ifndef TRIGGER_H
+#define TRIGGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "transport.h"
+
+#define TRIG_MAGIC 0x47525444u  /* "DTRG" */
+
+/* Longest bytes= pattern.
+ */
+#define TRIG_MAX_PATTERN 64
+
+struct trig_header {
+  uint32_t magic;
+  uint32_t seq;       // window number, from 0
+  uint64_t start;     // stream offset of the first byte of the window
+  uint64_t trigger;   // stream offset of the trigger point
+  uint64_t length;    // bytes of stream following the header
+  uint64_t t_ns;      // arrival time of the chunk that set it off
+};
+
+enum {
+  TRIG_WORD,
+  TRIG_RATE,
+  TRIG_BYTES,
+};
+
+class trigger {
+public:
+  trigger();
+
+  /* Set the condition from spec. Returns false after printing an error.
+   */
+  bool parse(const char *spec);
+
+  /* Window around each trigger point, rounded up to whole words for the
+   * word conditions.
+   */
+  void set_window(uint64_t pre, uint64_t post);
+
+  /* Feed len bytes of stream that arrived at t_ns. The windows completed
+   * by them, headers included, are returned in *out, valid until the
+   * next call, and their length as the result.
+   */
+  size_t feed(const byte *in, size_t len, uint64_t t_ns, const byte **out);
+
+  /* End of stream: the window still being captured, cut short.
+   */
+  size_t flush(const byte **out);
+
+  /* Windows written and triggers held off, on f.
+   */
+  void report(FILE *f) const;
+
+private:
+  void detect(const byte *in, size_t len);
+  void check_word(uint64_t w, uint64_t off);
+  void fire(uint64_t off);
+  void start_window(uint64_t trig, uint64_t t_ns);
+  void fill(const byte *in, size_t len);
+  void finish_window();
+  void keep_history(const byte *in, size_t len);
+
+  int kind;
+  uint64_t value;
+  uint64_t mask;
+  uint64_t rate_words;
+  uint64_t rate_counts;
+  byte pattern[TRIG_MAX_PATTERN];
+  size_t pattern_len;
+  uint64_t pre;
+  uint64_t post;
+
+  /* Detection: the stream offset of the chunk being fed, a word split
+   * across chunks, the coarse counts of the last rate_words words, the
+   * end of the previous chunk for patterns that straddle chunks, and
+   * the trigger points found in the current chunk.
+   */
+  uint64_t base;
+  byte carry[8];
+  size_t n_carry;
+  std::vector<uint64_t> recent;
+  uint64_t n_words;
+  byte tail[TRIG_MAX_PATTERN];
+  size_t n_tail;
+  uint64_t next_allowed;
+  std::vector<uint64_t> fires;
+
+  /* The last hist.size() bytes before base, byte o at o % hist.size().
+   */
+  std::vector<byte> hist;
+  uint64_t hist_len;
+
+  /* The window being captured: its bytes after a header, the stream
+   * offsets it has been filled up to and ends at.
+   */
+  bool capturing;
+  std::vector<byte> win;
+  uint64_t win_pos;
+  uint64_t win_end;
+  uint64_t last_end;
+
+  std::vector<byte> out_buf;
+  uint32_t n_windows;
+  uint64_t held_off;
+  uint64_t bytes_out;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#include "tuner.h"
+#include "util.h"
+
+/* Measurement window. Requests issued before a size change are still
+ * completing in the window right after it, so that one is skipped.
+ */
+#define WINDOW_NS 100000000ull
+#define WINDOW_MIN_REQUESTS 8
+
+/* Windows to stay at the best size before probing a larger one again.
+ */
+#define HOLD_WINDOWS 50
+
+chunk_tuner::chunk_tuner(uint32_t min, uint32_t max, uint32_t start,
+                         double target_rate, double target_lat_us) :
+  min_size(min), max_size(max), cur(start), target_rate(target_rate),
+  target_lat_us(target_lat_us), win_bytes(0), win_lat_ns(0),
+  win_requests(0), best_rate(0), best_size(0), hold(0), settling(false) {
+  if(cur < min_size){
+    cur = min_size;
+  }
+  if(cur > max_size){
+    cur = max_size;
+  }
+  t_start = win_start = now_ns();
+  step s = { 0, cur, 0, 0 };
+  history.push_back(s);
+}
+
+void chunk_tuner::record(uint32_t bytes, uint64_t latency_ns){
+  win_bytes += bytes;
+  win_lat_ns += latency_ns;
+  win_requests++;
+
+  uint64_t t = now_ns();
+  if(t - win_start < WINDOW_NS || win_requests < WINDOW_MIN_REQUESTS){
+    return;
+  }
+  double rate = win_bytes * 1e9 / (t - win_start);
+  double lat_us = win_lat_ns / 1e3 / win_requests;
+  win_start = t;
+  win_bytes = 0;
+  win_lat_ns = 0;
+  win_requests = 0;
+  if(settling){
+    settling = false;
+    return;
+  }
+  adjust(rate, lat_us, (t - t_start) / 1e9);
+}
+
+void chunk_tuner::adjust(double rate, double lat_us, double t){
+  if(target_lat_us > 0){
+    if(lat_us > target_lat_us){
+      set_size(cur * 0.75, rate, lat_us, t);
+    }
+    else if(lat_us < 0.6 * target_lat_us){
+      set_size(cur * 1.5, rate, lat_us, t);
+    }
+  }
+  else if(target_rate > 0){
+    if(rate < 0.95 * target_rate){
+      set_size(cur * 2.0, rate, lat_us, t);
+    }
+    else if(rate > 1.2 * target_rate){
+      set_size(cur * 0.75, rate, lat_us, t);
+    }
+  }
+  else if(hold > 0){
+    best_rate = rate;
+    if(--hold == 0){
+      set_size(cur * 2.0, rate, lat_us, t);
+    }
+  }
+  else if(rate > best_rate * 1.02){
+    /* Still improving, keep growing.
+     */
+    best_rate = rate;
+    best_size = cur;
+    set_size(cur * 2.0, rate, lat_us, t);
+    if(cur == best_size){
+      hold = HOLD_WINDOWS;
+    }
+  }
+  else{
+    /* No better than the last size, so go back to it.
+     */
+    set_size(best_size, rate, lat_us, t);
+    hold = HOLD_WINDOWS;
+  }
+}
+
+void chunk_tuner::set_size(double size, double rate, double lat_us, double t){
+  uint32_t n = size < min_size ? min_size : size > max_size ? max_size : (uint32_t)size;
+  if(n == cur){
+    return;
+  }
+  cur = n;
+  settling = true;
+  step s = { t, cur, rate, lat_us };
+  history.push_back(s);
+}
+
+void chunk_tuner::report(FILE *f) const {
+  fprintf(f, "Request size history (%zu changes):\n", history.size() - 1);
+  for(size_t i = 0; i < history.size(); i++){
+    const step &s = history[i];
+    if(i == 0){
+      fprintf(f, "  %9.3f s  %10u bytes  (start)\n", s.t, s.size);
+    }
+    else{
+      fprintf(f, "  %9.3f s  %10u bytes  after %.3f MB/s, %.1f us/request\n",
+              s.t, s.size, s.rate / (1024.0 * 1024.0), s.lat_us);
+    }
+  }
+  fprintf(f, "Final request size: %u bytes\n", cur);
+}
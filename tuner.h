@@ -0,0 +1,65 @@
+/* tuner.h -- runtime tuning of the request size.
+ *
+ * The reader reports every completed request; once per measurement
+ * window the tuner looks at the achieved throughput and the mean request
+ * latency and picks a new size within [min, max]:
+ *
+ *   target rate set     smallest size that sustains the rate
+ *   target latency set  largest size whose requests finish within it
+ *   neither             grow while throughput improves, then hold the
+ *                       best size and probe upwards again now and then
+ */
+#ifndef TUNER_H
+#define TUNER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <vector>
+
+class chunk_tuner {
+public:
+  struct step {
+    double t;         // seconds since the tuner started
+    uint32_t size;    // new request size
+    double rate;      // bytes/s seen in the window that led to it
+    double lat_us;    // mean request latency in that window
+  };
+
+  chunk_tuner(uint32_t min, uint32_t max, uint32_t start,
+              double target_rate, double target_lat_us);
+
+  uint32_t size() const { return cur; }
+
+  /* One request of the given size completed, latency_ns after it was
+   * issued.
+   */
+  void record(uint32_t bytes, uint64_t latency_ns);
+
+  void report(FILE *f) const;
+
+private:
+  uint32_t min_size;
+  uint32_t max_size;
+  uint32_t cur;
+  double target_rate;
+  double target_lat_us;
+
+  uint64_t t_start;
+  uint64_t win_start;
+  uint64_t win_bytes;
+  uint64_t win_lat_ns;
+  uint32_t win_requests;
+
+  double best_rate;
+  uint32_t best_size;
+  int hold;
+  bool settling;
+
+  std::vector<step> history;
+
+  void adjust(double rate, double lat_us, double t);
+  void set_size(double size, double rate, double lat_us, double t);
+};
+
+#endif
@@ -0,0 +1,55 @@
+/* util.h -- small helpers shared by dpticat and the simulator.
+ */
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+
+inline uint64_t now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Like now_ns() but not slewed by NTP, for timestamps that are
+ * compared across runs.
+ */
+inline uint64_t raw_now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+inline void sleep_until_ns(uint64_t t){
+  struct timespec ts;
+  ts.tv_sec = t / 1000000000ull;
+  ts.tv_nsec = t % 1000000000ull;
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR){
+  }
+}
+
+/* Parse a non-negative number with an optional K, M or G suffix (powers
+ * of 1024).
+ */
+inline bool parse_size(const char *s, double *v){
+  char *end;
+  double d = strtod(s, &end);
+  if(end == s){
+    return false;
+  }
+  switch(*end){
+  case 'k': case 'K': d *= 1024.0; end++; break;
+  case 'm': case 'M': d *= 1024.0 * 1024.0; end++; break;
+  case 'g': case 'G': d *= 1024.0 * 1024.0 * 1024.0; end++; break;
+  }
+  if(*end != '\0' || d < 0){
+    return false;
+  }
+  *v = d;
+  return true;
+}
+
+#endif